@@ -9,38 +9,70 @@ const ChatRoom = () => {
   const [messages, setMessages] = useState([]);
   const [text, setText] = useState("");
   const ws = useRef(null);
+  // Sent messages the server hasn't acknowledged yet, by client_msg_id.
+  // They are sent again after a reconnect; the server drops the duplicates.
+  const pending = useRef(new Map());
 
   useEffect(() => {
-    ws.current = new WebSocket("ws://localhost:9000");
+    let closed = false;
+    let retryTimer = null;
+    let retryDelay = 500;
 
-    ws.current.onopen = () => {
-      const joinMessage = {
-        type: "join", // Changed from "login" to "join"
-        username: currentUser,
-        room: room,
+    const connect = () => {
+      const socket = new WebSocket("ws://localhost:9000");
+      ws.current = socket;
+
+      socket.onopen = () => {
+        retryDelay = 500;
+        const joinMessage = {
+          type: "join", // Changed from "login" to "join"
+          username: currentUser,
+          room: room,
+        };
+        socket.send(JSON.stringify(joinMessage));
+        console.log("Sent join message:", joinMessage);
+        pending.current.forEach((queued) => socket.send(JSON.stringify(queued)));
       };
-      ws.current.send(JSON.stringify(joinMessage));
-      console.log("Sent join message:", joinMessage);
-    };
 
-    ws.current.onmessage = (message) => {
-      const data = JSON.parse(message.data);
+      socket.onmessage = (message) => {
+        const data = JSON.parse(message.data);
 
-      // Accept only messages for this room
-      if (data.type === "message" && data.room === room) {
-        setMessages((prev) => [...prev, data]);
-      }
-    };
+        if (data.type === "ack") {
+          pending.current.delete(data.client_msg_id);
+          return;
+        }
 
-    ws.current.onerror = (err) => {
-      console.error("WebSocket error:", err);
-    };
+        // Accept only messages for this room
+        if (data.type === "message" && data.room === room) {
+          setMessages((prev) =>
+            data.client_msg_id &&
+            prev.some((m) => m.client_msg_id === data.client_msg_id && m.from === data.from)
+              ? prev
+              : [...prev, data]
+          );
+        }
+      };
 
-    ws.current.onclose = () => {
-      console.log("WebSocket closed");
+      socket.onerror = (err) => {
+        console.error("WebSocket error:", err);
+      };
+
+      socket.onclose = () => {
+        console.log("WebSocket closed");
+        if (!closed) {
+          retryTimer = setTimeout(connect, retryDelay);
+          retryDelay = Math.min(retryDelay * 2, 10000);
+        }
+      };
     };
 
-    return () => ws.current?.close();
+    connect();
+
+    return () => {
+      closed = true;
+      clearTimeout(retryTimer);
+      ws.current?.close();
+    };
   }, [room, currentUser]);
 
   const sendMessage = () => {
@@ -52,14 +84,18 @@ const ChatRoom = () => {
       room: room,
       content: text,
       timestamp: new Date().toISOString(),
+      client_msg_id: crypto.randomUUID(),
     };
 
+    // Queued until acknowledged, so a message typed while disconnected goes
+    // out on reconnect.
+    pending.current.set(messageToSend.client_msg_id, messageToSend);
+    setText("");
     if (ws.current && ws.current.readyState === WebSocket.OPEN) {
       console.log("Sending message:", messageToSend);
       ws.current.send(JSON.stringify(messageToSend));
-      setText("");
     } else {
-      console.warn("WebSocket is not open. Cannot send message.");
+      console.warn("WebSocket is not open. Message will be sent on reconnect.");
     }
   };
 
@@ -0,0 +1,70 @@
+#include "Backplane.h"
+#include <vector>
+
+InProcessBackplane::InProcessBackplane(InProcessBus &bus) : bus(bus) {}
+
+InProcessBackplane::~InProcessBackplane() {
+    stop();
+}
+
+void InProcessBackplane::start(Handler handler) {
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    this->handler = handler;
+}
+
+void InProcessBackplane::publish(const std::string &room, const std::string &payload) {
+    // Copy the handlers so they run without the bus lock; a handler may well
+    // subscribe or unsubscribe on its own node.
+    std::vector<Handler> targets;
+    {
+        std::lock_guard<std::mutex> lock(bus.mutex);
+        auto it = bus.subscribers.find(room);
+        if (it == bus.subscribers.end()) {
+            return;
+        }
+        for (InProcessBackplane *node : it->second) {
+            if (node != this && node->handler) {
+                targets.push_back(node->handler);
+            }
+        }
+    }
+    for (auto &target : targets) {
+        target(room, payload);
+    }
+}
+
+void InProcessBackplane::subscribe(const std::string &room) {
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    if (rooms.insert(room).second) {
+        bus.subscribers[room].insert(this);
+    }
+}
+
+void InProcessBackplane::unsubscribe(const std::string &room) {
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    if (rooms.erase(room) == 0) {
+        return;
+    }
+    auto it = bus.subscribers.find(room);
+    if (it != bus.subscribers.end()) {
+        it->second.erase(this);
+        if (it->second.empty()) {
+            bus.subscribers.erase(it);
+        }
+    }
+}
+
+void InProcessBackplane::stop() {
+    std::lock_guard<std::mutex> lock(bus.mutex);
+    for (const auto &room : rooms) {
+        auto it = bus.subscribers.find(room);
+        if (it != bus.subscribers.end()) {
+            it->second.erase(this);
+            if (it->second.empty()) {
+                bus.subscribers.erase(it);
+            }
+        }
+    }
+    rooms.clear();
+    handler = nullptr;
+}
@@ -0,0 +1,63 @@
+#ifndef BACKPLANE_H
+#define BACKPLANE_H
+
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+// Carries room messages between server nodes so clients connected to
+// different processes share rooms. A node subscribes to a room while it has
+// local members there, publishes every message sent in a room, and hands what
+// other nodes publish to its own members. Publishers never get their own
+// messages back. Implementations are safe to call from any thread.
+class Backplane {
+public:
+    // Receives a message another node published to a subscribed room. May run
+    // on any thread.
+    typedef std::function<void(const std::string &room, const std::string &payload)> Handler;
+
+    virtual ~Backplane() {}
+
+    // Begin delivering to handler. Called once, before anything else.
+    virtual void start(Handler handler) = 0;
+    virtual void publish(const std::string &room, const std::string &payload) = 0;
+    virtual void subscribe(const std::string &room) = 0;
+    virtual void unsubscribe(const std::string &room) = 0;
+    // Stop delivering; later calls are ignored.
+    virtual void stop() = 0;
+};
+
+class InProcessBackplane;
+
+// Shared by the InProcessBackplanes of several servers in one process.
+class InProcessBus {
+private:
+    friend class InProcessBackplane;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::set<InProcessBackplane*>> subscribers;
+};
+
+// Backplane for nodes in the same process, e.g. several servers on different
+// ports. Delivery is synchronous on the publishing thread. Stop every node
+// before destroying any of them.
+class InProcessBackplane : public Backplane {
+public:
+    explicit InProcessBackplane(InProcessBus &bus);
+    ~InProcessBackplane();
+
+    void start(Handler handler) override;
+    void publish(const std::string &room, const std::string &payload) override;
+    void subscribe(const std::string &room) override;
+    void unsubscribe(const std::string &room) override;
+    void stop() override;
+
+private:
+    InProcessBus &bus;
+    // Guarded by bus.mutex.
+    Handler handler;
+    std::set<std::string> rooms;
+};
+
+#endif // BACKPLANE_H
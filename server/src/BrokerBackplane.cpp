@@ -0,0 +1,409 @@
+#include "BrokerBackplane.h"
+#include <algorithm>
+#include <iostream>
+#include <unistd.h>
+
+using tcp = asio::ip::tcp;
+using generic_stream = asio::generic::stream_protocol;
+
+//----------------------
+// Wire format
+//----------------------
+namespace broker_protocol {
+
+static void putU32(std::string &out, uint32_t value) {
+    out.push_back(static_cast<char>(value >> 24));
+    out.push_back(static_cast<char>(value >> 16));
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value));
+}
+
+static uint32_t getU32(const char *p) {
+    const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+    return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | uint32_t(u[3]);
+}
+
+void appendFrame(std::string &out, char op, const std::string &room, const std::string &payload) {
+    uint16_t roomLength = static_cast<uint16_t>(std::min<std::size_t>(room.size(), 0xffff));
+    putU32(out, static_cast<uint32_t>(1 + 2 + roomLength + payload.size()));
+    out.push_back(op);
+    out.push_back(static_cast<char>(roomLength >> 8));
+    out.push_back(static_cast<char>(roomLength));
+    out.append(room, 0, roomLength);
+    out.append(payload);
+}
+
+bool takeFrames(std::string &buffer, std::vector<Frame> &frames) {
+    std::size_t pos = 0;
+    while (buffer.size() - pos >= 4) {
+        uint32_t length = getU32(buffer.data() + pos);
+        if (length < 3 || length > kMaxFrameBytes) {
+            return false;
+        }
+        if (buffer.size() - pos - 4 < length) {
+            break;
+        }
+        const char *body = buffer.data() + pos + 4;
+        const unsigned char *u = reinterpret_cast<const unsigned char*>(body);
+        std::size_t roomLength = (std::size_t(u[1]) << 8) | u[2];
+        if (3 + roomLength > length) {
+            return false;
+        }
+        Frame frame;
+        frame.op = body[0];
+        frame.room.assign(body + 3, roomLength);
+        frame.payload.assign(body + 3 + roomLength, length - 3 - roomLength);
+        frames.push_back(std::move(frame));
+        pos += 4 + length;
+    }
+    buffer.erase(0, pos);
+    return true;
+}
+
+bool parseAddress(const std::string &address, generic_stream::endpoint &endpoint) {
+    const std::string unixPrefix = "unix:";
+    if (address.compare(0, unixPrefix.size(), unixPrefix) == 0) {
+        std::string path = address.substr(unixPrefix.size());
+        if (path.empty()) {
+            return false;
+        }
+        endpoint = generic_stream::endpoint(asio::local::stream_protocol::endpoint(path));
+        return true;
+    }
+
+    std::size_t colon = address.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+        return false;
+    }
+    asio::io_context resolverContext;
+    tcp::resolver resolver(resolverContext);
+    boost::system::error_code ec;
+    auto results = resolver.resolve(address.substr(0, colon), address.substr(colon + 1), ec);
+    if (ec || results.empty()) {
+        return false;
+    }
+    endpoint = generic_stream::endpoint(results.begin()->endpoint());
+    return true;
+}
+
+} // namespace broker_protocol
+
+//----------------------
+// BrokerBackplane
+//----------------------
+BrokerBackplane::BrokerBackplane(asio::io_context &context, const std::string &address, int reconnect_delay_ms)
+    : strand(context.get_executor()), socket(strand), reconnect_timer(strand),
+      reconnect_delay_ms(reconnect_delay_ms)
+{
+    valid_address = broker_protocol::parseAddress(address, endpoint);
+    if (!valid_address) {
+        std::cerr << "[Backplane] Invalid broker address: " << address << std::endl;
+    }
+}
+
+void BrokerBackplane::start(Handler handler) {
+    asio::post(strand, [this, handler]() {
+        this->handler = handler;
+        if (valid_address) {
+            connect();
+        }
+    });
+}
+
+void BrokerBackplane::stop() {
+    asio::post(strand, [this]() {
+        stopped = true;
+        handler = nullptr;
+        reconnect_timer.cancel();
+        boost::system::error_code ec;
+        socket.close(ec);
+    });
+}
+
+void BrokerBackplane::publish(const std::string &room, const std::string &payload) {
+    asio::post(strand, [this, room, payload]() {
+        // Keep a bounded backlog across a reconnect; past that, drop.
+        if (!connected && pending.size() > broker_protocol::kMaxFrameBytes) {
+            return;
+        }
+        enqueue(broker_protocol::Publish, room, payload);
+    });
+}
+
+void BrokerBackplane::subscribe(const std::string &room) {
+    asio::post(strand, [this, room]() {
+        if (rooms.insert(room).second && connected) {
+            enqueue(broker_protocol::Subscribe, room, std::string());
+        }
+    });
+}
+
+void BrokerBackplane::unsubscribe(const std::string &room) {
+    asio::post(strand, [this, room]() {
+        if (rooms.erase(room) && connected) {
+            enqueue(broker_protocol::Unsubscribe, room, std::string());
+        }
+    });
+}
+
+void BrokerBackplane::connect() {
+    socket.async_connect(endpoint, asio::bind_executor(strand, [this](boost::system::error_code ec) {
+        if (stopped) {
+            return;
+        }
+        if (ec) {
+            schedule_reconnect();
+            return;
+        }
+        if (endpoint.protocol().family() != AF_UNIX) {
+            boost::system::error_code ignored;
+            socket.set_option(tcp::no_delay(true), ignored);
+        }
+        std::cout << "[Backplane] Connected to broker." << std::endl;
+
+        // Subscriptions go ahead of anything published while disconnected.
+        std::string backlog;
+        backlog.swap(pending);
+        for (const auto &room : rooms) {
+            enqueue(broker_protocol::Subscribe, room, std::string());
+        }
+        pending.append(backlog);
+        connected = true;
+        flush();
+        do_read();
+    }));
+}
+
+void BrokerBackplane::schedule_reconnect() {
+    connected = false;
+    writing = false;
+    in_flight.clear();
+    read_buffer.clear();
+    boost::system::error_code ec;
+    socket.close(ec);
+    reconnect_timer.expires_after(std::chrono::milliseconds(reconnect_delay_ms));
+    reconnect_timer.async_wait([this](boost::system::error_code ec) {
+        if (!ec && !stopped) {
+            connect();
+        }
+    });
+}
+
+void BrokerBackplane::do_read() {
+    socket.async_read_some(asio::buffer(read_chunk), asio::bind_executor(strand,
+        [this](boost::system::error_code ec, std::size_t length) {
+            if (stopped) {
+                return;
+            }
+            if (ec) {
+                std::cerr << "[Backplane] Lost broker connection: " << ec.message() << std::endl;
+                schedule_reconnect();
+                return;
+            }
+            read_buffer.append(read_chunk.data(), length);
+            std::vector<broker_protocol::Frame> received;
+            if (!broker_protocol::takeFrames(read_buffer, received)) {
+                std::cerr << "[Backplane] Malformed frame from broker." << std::endl;
+                schedule_reconnect();
+                return;
+            }
+            for (auto &frame : received) {
+                if (frame.op == broker_protocol::Publish && handler) {
+                    handler(frame.room, frame.payload);
+                }
+            }
+            do_read();
+        }));
+}
+
+void BrokerBackplane::enqueue(char op, const std::string &room, const std::string &payload) {
+    broker_protocol::appendFrame(pending, op, room, payload);
+    frames++;
+    if (connected && !writing) {
+        flush();
+    }
+}
+
+// Send everything queued so far in one write. Frames queued meanwhile wait for
+// the next call, which the completion makes.
+void BrokerBackplane::flush() {
+    if (pending.empty() || writing || !connected) {
+        return;
+    }
+    writing = true;
+    in_flight.swap(pending);
+    pending.clear();
+    batches++;
+    asio::async_write(socket, asio::buffer(in_flight), asio::bind_executor(strand,
+        [this](boost::system::error_code ec, std::size_t) {
+            if (stopped) {
+                return;
+            }
+            writing = false;
+            in_flight.clear();
+            if (ec) {
+                std::cerr << "[Backplane] Write to broker failed: " << ec.message() << std::endl;
+                schedule_reconnect();
+                return;
+            }
+            flush();
+        }));
+}
+
+//----------------------
+// Broker
+//----------------------
+Broker::Broker(asio::io_context &context, const std::string &address)
+    : strand(context.get_executor()), acceptor(strand), address(address) {}
+
+bool Broker::start() {
+    generic_stream::endpoint endpoint;
+    if (!broker_protocol::parseAddress(address, endpoint)) {
+        std::cerr << "[Broker] Invalid address: " << address << std::endl;
+        return false;
+    }
+    unix_socket = endpoint.protocol().family() == AF_UNIX;
+    if (unix_socket) {
+        // A socket file left over from an earlier run would make bind fail.
+        ::unlink(address.substr(5).c_str());
+    }
+
+    boost::system::error_code ec;
+    acceptor.open(endpoint.protocol(), ec);
+    if (!ec && !unix_socket) {
+        acceptor.set_option(asio::socket_base::reuse_address(true), ec);
+    }
+    if (!ec) {
+        acceptor.bind(endpoint, ec);
+    }
+    if (!ec) {
+        acceptor.listen(asio::socket_base::max_listen_connections, ec);
+    }
+    if (ec) {
+        std::cerr << "[Broker] Failed to listen on " << address << ": " << ec.message() << std::endl;
+        return false;
+    }
+    std::cout << "[Broker] Listening on " << address << std::endl;
+    asio::post(strand, [this]() { accept(); });
+    return true;
+}
+
+void Broker::stop() {
+    asio::post(strand, [this]() {
+        boost::system::error_code ec;
+        acceptor.close(ec);
+        for (auto &connection : connections) {
+            connection->socket.close(ec);
+        }
+    });
+}
+
+void Broker::accept() {
+    auto connection = std::make_shared<Connection>(strand);
+    acceptor.async_accept(connection->socket, asio::bind_executor(strand,
+        [this, connection](boost::system::error_code ec) {
+            if (ec == asio::error::operation_aborted) {
+                return;
+            }
+            if (!ec) {
+                if (!unix_socket) {
+                    boost::system::error_code ignored;
+                    connection->socket.set_option(tcp::no_delay(true), ignored);
+                }
+                connections.insert(connection);
+                do_read(connection);
+            } else {
+                std::cerr << "[Broker] Accept error: " << ec.message() << std::endl;
+            }
+            accept();
+        }));
+}
+
+void Broker::do_read(std::shared_ptr<Connection> connection) {
+    connection->socket.async_read_some(asio::buffer(connection->read_chunk), asio::bind_executor(strand,
+        [this, connection](boost::system::error_code ec, std::size_t length) {
+            if (ec) {
+                drop(connection);
+                return;
+            }
+            connection->read_buffer.append(connection->read_chunk.data(), length);
+            std::vector<broker_protocol::Frame> received;
+            if (!broker_protocol::takeFrames(connection->read_buffer, received)) {
+                std::cerr << "[Broker] Malformed frame, dropping connection." << std::endl;
+                drop(connection);
+                return;
+            }
+
+            // Queue everything this read produced before writing, so each
+            // subscriber gets one batched write per read.
+            std::set<std::shared_ptr<Connection>> touched;
+            for (auto &frame : received) {
+                if (frame.op == broker_protocol::Subscribe) {
+                    connection->rooms.insert(frame.room);
+                    subscribers[frame.room].insert(connection);
+                } else if (frame.op == broker_protocol::Unsubscribe) {
+                    connection->rooms.erase(frame.room);
+                    auto it = subscribers.find(frame.room);
+                    if (it != subscribers.end()) {
+                        it->second.erase(connection);
+                        if (it->second.empty()) {
+                            subscribers.erase(it);
+                        }
+                    }
+                } else if (frame.op == broker_protocol::Publish) {
+                    auto it = subscribers.find(frame.room);
+                    if (it == subscribers.end()) {
+                        continue;
+                    }
+                    for (auto &subscriber : it->second) {
+                        if (subscriber != connection) {
+                            broker_protocol::appendFrame(subscriber->pending, broker_protocol::Publish,
+                                                         frame.room, frame.payload);
+                            touched.insert(subscriber);
+                        }
+                    }
+                }
+            }
+            for (auto &subscriber : touched) {
+                flush(subscriber);
+            }
+            do_read(connection);
+        }));
+}
+
+void Broker::flush(std::shared_ptr<Connection> connection) {
+    if (connection->writing || connection->pending.empty()) {
+        return;
+    }
+    connection->writing = true;
+    connection->in_flight.swap(connection->pending);
+    connection->pending.clear();
+    asio::async_write(connection->socket, asio::buffer(connection->in_flight), asio::bind_executor(strand,
+        [this, connection](boost::system::error_code ec, std::size_t) {
+            connection->writing = false;
+            connection->in_flight.clear();
+            if (ec) {
+                drop(connection);
+                return;
+            }
+            flush(connection);
+        }));
+}
+
+void Broker::drop(std::shared_ptr<Connection> connection) {
+    if (!connections.erase(connection)) {
+        return;
+    }
+    for (const auto &room : connection->rooms) {
+        auto it = subscribers.find(room);
+        if (it != subscribers.end()) {
+            it->second.erase(connection);
+            if (it->second.empty()) {
+                subscribers.erase(it);
+            }
+        }
+    }
+    connection->rooms.clear();
+    boost::system::error_code ec;
+    connection->socket.close(ec);
+}
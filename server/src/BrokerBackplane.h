@@ -0,0 +1,134 @@
+#ifndef BROKER_BACKPLANE_H
+#define BROKER_BACKPLANE_H
+
+#include "IoBackend.h"
+#include <boost/asio.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Backplane.h"
+
+namespace asio = boost::asio;
+
+// Wire format between BrokerBackplane nodes and the Broker. Every frame is a
+// 4-byte big-endian body length followed by the body: a 1-byte op, a 2-byte
+// big-endian room length, the room, and (for publishes) the payload.
+namespace broker_protocol {
+
+enum Op : char {
+    Subscribe = 'S',
+    Unsubscribe = 'U',
+    Publish = 'P'
+};
+
+struct Frame {
+    char op;
+    std::string room;
+    std::string payload;
+};
+
+// Frames larger than this are treated as a corrupt stream.
+const std::size_t kMaxFrameBytes = 16 * 1024 * 1024;
+
+void appendFrame(std::string &out, char op, const std::string &room, const std::string &payload);
+
+// Move every complete frame off the front of buffer into frames. Returns false
+// if the stream is malformed.
+bool takeFrames(std::string &buffer, std::vector<Frame> &frames);
+
+// Parse "unix:/path/to/socket" or "host:port".
+bool parseAddress(const std::string &address, asio::generic::stream_protocol::endpoint &endpoint);
+
+} // namespace broker_protocol
+
+// Backplane that talks to a Broker over TCP or a Unix socket. Frames queued
+// while a write is in flight go out together in the next write, so busy rooms
+// cost one syscall per batch rather than per message. If the connection
+// drops, it reconnects and re-sends its subscriptions; messages published
+// while disconnected are buffered up to a limit and then dropped.
+class BrokerBackplane : public Backplane {
+public:
+    BrokerBackplane(asio::io_context &context, const std::string &address, int reconnect_delay_ms = 500);
+
+    void start(Handler handler) override;
+    void publish(const std::string &room, const std::string &payload) override;
+    void subscribe(const std::string &room) override;
+    void unsubscribe(const std::string &room) override;
+    void stop() override;
+
+    // Frames and writes sent so far; their ratio is the average batch size.
+    uint64_t frames_sent() const { return frames; }
+    uint64_t batches_sent() const { return batches; }
+
+private:
+    void connect();
+    void schedule_reconnect();
+    void do_read();
+    void enqueue(char op, const std::string &room, const std::string &payload);
+    void flush();
+
+    asio::strand<asio::io_context::executor_type> strand;
+    asio::generic::stream_protocol::socket socket;
+    asio::generic::stream_protocol::endpoint endpoint;
+    bool valid_address;
+    asio::steady_timer reconnect_timer;
+    int reconnect_delay_ms;
+
+    // Everything below runs on the strand.
+    Handler handler;
+    std::set<std::string> rooms;
+    bool connected = false;
+    bool stopped = false;
+    bool writing = false;
+    std::string pending;
+    std::string in_flight;
+    std::array<char, 64 * 1024> read_chunk;
+    std::string read_buffer;
+
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> batches{0};
+};
+
+// Minimal pub/sub broker for BrokerBackplane nodes: it relays each publish to
+// every other connection subscribed to the room. Meant as a local stand-in
+// for a real message broker, so it keeps no history and does no auth.
+class Broker {
+public:
+    Broker(asio::io_context &context, const std::string &address);
+
+    // Bind and start accepting. Returns false if the address is unusable.
+    bool start();
+    void stop();
+
+private:
+    struct Connection {
+        explicit Connection(asio::strand<asio::io_context::executor_type> &strand) : socket(strand) {}
+        asio::generic::stream_protocol::socket socket;
+        std::set<std::string> rooms;
+        std::array<char, 64 * 1024> read_chunk;
+        std::string read_buffer;
+        bool writing = false;
+        std::string pending;
+        std::string in_flight;
+    };
+
+    void accept();
+    void do_read(std::shared_ptr<Connection> connection);
+    void flush(std::shared_ptr<Connection> connection);
+    void drop(std::shared_ptr<Connection> connection);
+
+    // The acceptor and every connection share one strand.
+    asio::strand<asio::io_context::executor_type> strand;
+    asio::basic_socket_acceptor<asio::generic::stream_protocol> acceptor;
+    std::string address;
+    bool unix_socket = false;
+    std::set<std::shared_ptr<Connection>> connections;
+    std::unordered_map<std::string, std::set<std::shared_ptr<Connection>>> subscribers;
+};
+
+#endif // BROKER_BACKPLANE_H
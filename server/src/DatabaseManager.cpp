@@ -1,4 +1,6 @@
 #include "DatabaseManager.h"
+#include "SqliteMessageStore.h"
+#include "LogMessageStore.h"
 #include <iostream>
 #include <sstream>
 #include <iomanip>
@@ -17,15 +19,28 @@ static std::string hashPassword(const std::string &password) {
     return ss.str();
 }
 
-DatabaseManager::DatabaseManager(const std::string &dbFile) : db(nullptr), dbFile(dbFile) {}
+DatabaseManager::DatabaseManager(const std::string &dbFile, const StorageConfig &storage)
+    : db(nullptr), dbFile(dbFile), storage(storage)
+{
+    if (storage.engine == StorageConfig::Log) {
+        std::string directory = storage.logDirectory.empty() ? dbFile + ".log" : storage.logDirectory;
+        messageStore.reset(new LogMessageStore(directory, storage));
+    } else {
+        messageStore.reset(new SqliteMessageStore(db, dbMutex, readPool, dbFile, storage));
+    }
+}
 
 DatabaseManager::~DatabaseManager() {
+    messageStore.reset();
+    readPool.close();
+    std::lock_guard<std::mutex> lock(dbMutex);
     if (db) {
         sqlite3_close(db);
     }
 }
 
 bool DatabaseManager::initDB() {
+    std::unique_lock<std::mutex> lock(dbMutex);
     std::cout << "Database initialized." << std::endl;
     int rc = sqlite3_open(dbFile.c_str(), &db);
     if (rc) {
@@ -36,9 +51,12 @@ bool DatabaseManager::initDB() {
     // Set a busy timeout of 3000ms so SQLite waits for locks to clear
     sqlite3_busy_timeout(db, 3000);
 
+    // Write-ahead logging keeps readers off the writer's lock and lets
+    // shutdown checkpoint committed work in one step.
+    sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+
     char* errMsg = nullptr;
     const int maxRetries = 3;
-    int attempt = 0;
 
     // Helper lambda for executing a query with retry logic
     auto execWithRetry = [&](const char* sql) -> int {
@@ -77,23 +95,6 @@ bool DatabaseManager::initDB() {
         return false;
     }
 
-    // Create the messages table
-    const char* createMessagesSQL =
-        "CREATE TABLE IF NOT EXISTS messages ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-        "room TEXT NOT NULL, "
-        "sender TEXT NOT NULL, "
-        "content TEXT NOT NULL, "
-        "timestamp TEXT NOT NULL"
-        ");";
-    rc = execWithRetry(createMessagesSQL);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL error (messages table creation): " << errMsg << std::endl;
-        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        sqlite3_free(errMsg);
-        return false;
-    }
-
     // Commit transaction
     rc = execWithRetry("COMMIT;");
     if (rc != SQLITE_OK) {
@@ -103,21 +104,24 @@ bool DatabaseManager::initDB() {
         return false;
     }
 
-    return true;
+    // The message engine creates or recovers its own state; readers open
+    // after it so they see its schema.
+    lock.unlock();
+    return messageStore->open() && readPool.open(dbFile, storage.readConnections, storage.mmapBytes);
 }
 
 bool DatabaseManager::authenticateUser(const std::string &username, const std::string &password) {
+    SqliteReadPool::Lease lease = readPool.acquire();
+    sqlite3* reader = lease.get();
     // Hash the provided password for comparison
     std::string hashedPassword = hashPassword(password);
 
-    sqlite3_busy_timeout(db, 3000); // Wait up to 3 seconds if the DB is locked
-
     const int maxRetries = 3;
     const int retryDelayMs = 100;
 
     for (int attempt = 0; attempt < maxRetries; ++attempt) {
         char* errMsg = nullptr;
-        int rc = sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg);
+        int rc = sqlite3_exec(reader, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg);
         if (rc == SQLITE_BUSY) {
             std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
             continue;
@@ -129,10 +133,10 @@ bool DatabaseManager::authenticateUser(const std::string &username, const std::s
 
         const char* sql = "SELECT password FROM users WHERE username = ?;";
         sqlite3_stmt* stmt;
-        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        rc = sqlite3_prepare_v2(reader, sql, -1, &stmt, nullptr);
         if (rc != SQLITE_OK) {
-            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(reader) << std::endl;
+            sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
             return false;
         }
 
@@ -142,7 +146,7 @@ bool DatabaseManager::authenticateUser(const std::string &username, const std::s
         bool auth = false;
         if (rc == SQLITE_BUSY) {
             sqlite3_finalize(stmt);
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
             std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
             continue;
         } else if (rc == SQLITE_ROW) {
@@ -153,14 +157,14 @@ bool DatabaseManager::authenticateUser(const std::string &username, const std::s
 
         sqlite3_finalize(stmt);
 
-        rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, &errMsg);
+        rc = sqlite3_exec(reader, "COMMIT;", nullptr, nullptr, &errMsg);
         if (rc == SQLITE_BUSY) {
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
             std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
             continue;
         } else if (rc != SQLITE_OK) {
             std::cerr << "SQL error (commit transaction): " << errMsg << std::endl;
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
             sqlite3_free(errMsg);
             return false;
         }
@@ -173,6 +177,7 @@ bool DatabaseManager::authenticateUser(const std::string &username, const std::s
 }
 
 bool DatabaseManager::registerUser(const std::string &username, const std::string &password) {
+    std::lock_guard<std::mutex> lock(dbMutex);
     // Hash the password before storing it
     std::string hashedPassword = hashPassword(password);
 
@@ -240,114 +245,68 @@ bool DatabaseManager::registerUser(const std::string &username, const std::strin
 }
 
 bool DatabaseManager::storeMessage(const std::string &room, const std::string &sender, const std::string &content, const std::string &timestamp) {
-    sqlite3_busy_timeout(db, 3000);
-
-    const int maxRetries = 3;
-    const int retryDelayMs = 100;
-
-    for (int attempt = 0; attempt < maxRetries; ++attempt) {
-        char* errMsg = nullptr;
-
-        int rc = sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg);
-        if (rc == SQLITE_BUSY) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
-            continue;
-        } else if (rc != SQLITE_OK) {
-            std::cerr << "SQL error (begin transaction): " << errMsg << std::endl;
-            sqlite3_free(errMsg);
-            return false;
-        }
+    return messageStore->storeMessage(room, sender, content, timestamp);
+}
 
-        const char* sql = "INSERT INTO messages (room, sender, content, timestamp) VALUES (?, ?, ?, ?);";
-        sqlite3_stmt* stmt;
-        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Failed to prepare statement for storing message: " << sqlite3_errmsg(db) << std::endl;
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-            return false;
-        }
+bool DatabaseManager::storeMessage(const std::string &room, const std::string &sender, const std::string &content,
+                                   const std::string &timestamp, const std::string &clientMsgId,
+                                   int64_t &seq, bool &duplicate) {
+    return messageStore->storeMessage(room, sender, content, timestamp, clientMsgId, seq, duplicate);
+}
 
-        sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, sender.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, content.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 4, timestamp.c_str(), -1, SQLITE_STATIC);
+std::vector<nlohmann::json> DatabaseManager::getMessagesForRoom(const std::string &room, std::time_t since) {
+    return messageStore->getMessagesForRoom(room, since);
+}
 
-        rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+DatabaseManager::historyFrames(const std::string &room, std::time_t since) {
+    return messageStore->historyFrames(room, since);
+}
 
-        if (rc == SQLITE_BUSY) {
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-            std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
-            continue;
-        } else if (rc != SQLITE_DONE) {
-            std::cerr << "Failed to store message: " << sqlite3_errmsg(db) << std::endl;
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-            return false;
-        }
+std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+DatabaseManager::recentFrames(const std::string &room, std::size_t limit) {
+    return messageStore->recentFrames(room, limit);
+}
 
-        rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, &errMsg);
-        if (rc == SQLITE_BUSY) {
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-            std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
-            continue;
-        } else if (rc != SQLITE_OK) {
-            std::cerr << "SQL error (commit transaction): " << errMsg << std::endl;
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-            sqlite3_free(errMsg);
-            return false;
-        }
+std::vector<std::string> DatabaseManager::activeRooms(std::size_t limit) {
+    return messageStore->activeRooms(limit);
+}
 
-        return true;
-    }
+std::vector<nlohmann::json> DatabaseManager::searchMessages(const std::string &room, const std::string &sender,
+                                                            const std::string &query, int limit, int offset) {
+    return messageStore->searchMessages(room, sender, query, limit, offset);
+}
 
-    std::cerr << "Failed to store message after multiple retries due to database lock." << std::endl;
-    return false;
+bool DatabaseManager::supportsSearch() const {
+    return messageStore->supportsSearch();
 }
 
-std::vector<nlohmann::json> DatabaseManager::getMessagesForRoom(const std::string &room) {
-    std::vector<nlohmann::json> messages;
+bool DatabaseManager::compactPartitions(std::time_t now) {
+    std::vector<std::string> expiredRooms;
+    return messageStore->compact(now, expiredRooms);
+}
 
-    char* errMsg = nullptr;
-    int rc = sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg);
-    if (rc != SQLITE_OK) {
-        std::cerr << "SQL error (begin transaction): " << errMsg << std::endl;
-        sqlite3_free(errMsg);
-        return messages;
-    }
+bool DatabaseManager::compactPartitions(std::time_t now, std::vector<std::string> &expiredRooms) {
+    return messageStore->compact(now, expiredRooms);
+}
 
-    const char* sql = "SELECT sender, content, timestamp FROM messages WHERE room = ? ORDER BY id ASC;";
-    std::cout << sql << std::endl;
-    sqlite3_stmt *stmt;
-    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
-    if (rc != SQLITE_OK) {
-        std::cerr << "Failed to prepare statement for loading messages: " << sqlite3_errmsg(db) << std::endl;
-        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        return messages;
+bool DatabaseManager::checkpoint() {
+    if (!messageStore->flush()) {
+        return false;
     }
 
-    sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        const unsigned char* senderText = sqlite3_column_text(stmt, 0);
-        const unsigned char* contentText = sqlite3_column_text(stmt, 1);
-        const unsigned char* timestampText = sqlite3_column_text(stmt, 2);
-        nlohmann::json message = {
-            {"type", "message"},
-            {"room", room},
-            {"from", reinterpret_cast<const char*>(senderText)},
-            {"content", reinterpret_cast<const char*>(contentText)},
-            {"timestamp", reinterpret_cast<const char*>(timestampText)}
-        };
-
-        messages.push_back(message);
+    // Taking the lock waits out any statement still running on another thread.
+    std::lock_guard<std::mutex> lock(dbMutex);
+    if (!db) {
+        return false;
     }
-    sqlite3_finalize(stmt);
 
-    rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, &errMsg);
+    char* errMsg = nullptr;
+    int rc = sqlite3_exec(db, "PRAGMA wal_checkpoint(TRUNCATE);", nullptr, nullptr, &errMsg);
     if (rc != SQLITE_OK) {
-        std::cerr << "SQL error (commit transaction): " << errMsg << std::endl;
-        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        std::cerr << "SQL error (wal checkpoint): " << errMsg << std::endl;
         sqlite3_free(errMsg);
-        return messages;
+        return false;
     }
-    return messages;
+    return true;
 }
@@ -3,12 +3,17 @@
 
 #include <string>
 #include <vector>
+#include <mutex>
+#include <memory>
+#include <ctime>
 #include <sqlite3.h>
 #include <nlohmann/json.hpp>
+#include "MessageStore.h"
+#include "SqliteReadPool.h"
 
 class DatabaseManager {
 public:
-    DatabaseManager(const std::string &dbFile);
+    DatabaseManager(const std::string &dbFile, const StorageConfig &storage = StorageConfig());
     ~DatabaseManager();
 
     // Initialize the database (create tables if they don’t exist)
@@ -18,13 +23,55 @@ public:
     bool registerUser(const std::string &username, const std::string &password);
     bool authenticateUser(const std::string &username, const std::string &password);
 
-    // Message persistence functions
+    // Message persistence functions, forwarded to the configured MessageStore
     bool storeMessage(const std::string &room, const std::string &sender, const std::string &content, const std::string &timestamp);
-    std::vector<nlohmann::json> getMessagesForRoom(const std::string &room);
+    // Idempotent variant: reports the message's sequence number, and for a
+    // clientMsgId the sender already used, the original's with duplicate set
+    // (see MessageStore::storeMessage).
+    bool storeMessage(const std::string &room, const std::string &sender, const std::string &content,
+                      const std::string &timestamp, const std::string &clientMsgId, int64_t &seq, bool &duplicate);
+    // Messages stored at or after since (unix seconds), oldest first. With the
+    // SQLite engine only the archived months that hold this room are read.
+    std::vector<nlohmann::json> getMessagesForRoom(const std::string &room, std::time_t since = 0);
+
+    // The same history as (seq, serialized message frame) pairs, ready to send.
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+    historyFrames(const std::string &room, std::time_t since = 0);
+    // Only the newest limit of them, oldest first.
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+    recentFrames(const std::string &room, std::size_t limit);
+    // Up to limit rooms with the most recent (unarchived) messages, busiest first.
+    std::vector<std::string> activeRooms(std::size_t limit);
+
+    // Age out history per StorageConfig: the SQLite engine archives months older
+    // than the hot window, one month per lock hold so live traffic can
+    // interleave; both engines drop data past retention.
+    bool compactPartitions(std::time_t now = std::time(nullptr));
+    // The same, adding the rooms that lost messages to retention to expiredRooms.
+    bool compactPartitions(std::time_t now, std::vector<std::string> &expiredRooms);
+
+    // Full-text search over a room's history, best matches first. An empty
+    // sender matches everyone. Each result carries its id, from, content,
+    // timestamp and bm25 rank (lower is better). Archived months are searched
+    // through their own indexes; the log engine has no index and returns nothing.
+    std::vector<nlohmann::json> searchMessages(const std::string &room, const std::string &sender,
+                                               const std::string &query, int limit, int offset);
+    // False when the message engine has no search index.
+    bool supportsSearch() const;
+
+    // Wait for in-flight work, make stored messages durable and fold the WAL
+    // back into the main database file.
+    bool checkpoint();
 
 private:
     sqlite3* db;
     std::string dbFile;
+    // The write connection is shared by every io thread; one statement sequence at a time.
+    std::mutex dbMutex;
+    // Lookups, history and search run here and never take dbMutex.
+    SqliteReadPool readPool;
+    StorageConfig storage;
+    std::unique_ptr<MessageStore> messageStore;
 };
 
 #endif // DATABASE_MANAGER_H
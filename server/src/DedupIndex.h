@@ -0,0 +1,125 @@
+#ifndef DEDUP_INDEX_H
+#define DEDUP_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Recently accepted client message ids, per user, so a retried send can be
+// answered with the original sequence number without touching the database.
+// Each user keeps at most max_per_user ids and each id lapses window_ms after
+// it was accepted, which bounds memory at roughly users * max_per_user
+// entries. Users are spread over locked shards, as in RateLimiter.
+class DedupIndex {
+public:
+    DedupIndex(int64_t window_ms, std::size_t max_per_user)
+        : window_ms(window_ms), max_per_user(max_per_user), shards(kShards) {}
+
+    // The sequence recorded for (user, id), or 0 when it is unknown or lapsed.
+    int64_t find(const std::string &user, const std::string &id, int64_t now_ms) {
+        Shard &shard = shard_for(user);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.users.find(user);
+        if (it == shard.users.end()) {
+            return 0;
+        }
+        auto entry = it->second.ids.find(id);
+        if (entry == it->second.ids.end() || entry->second.expires_ms <= now_ms) {
+            return 0;
+        }
+        return entry->second.seq;
+    }
+
+    void insert(const std::string &user, const std::string &id, int64_t seq, int64_t now_ms) {
+        Shard &shard = shard_for(user);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (now_ms >= shard.next_sweep_ms) {
+            sweep(shard, now_ms);
+        }
+        User &entry = shard.users[user];
+        expire(entry, now_ms);
+        auto inserted = entry.ids.emplace(id, Entry{seq, now_ms + window_ms});
+        if (!inserted.second) {
+            // The first sequence recorded for an id stands.
+            return;
+        }
+        entry.order.push_back(&inserted.first->first);
+        if (entry.order.size() > max_per_user) {
+            auto oldest = entry.ids.find(*entry.order.front());
+            entry.order.pop_front();
+            entry.ids.erase(oldest);
+        }
+    }
+
+    // Ids currently held, across all users.
+    std::size_t size() {
+        std::size_t total = 0;
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto &user : shard.users) {
+                total += user.second.ids.size();
+            }
+        }
+        return total;
+    }
+
+private:
+    static const std::size_t kShards = 16;
+
+    struct Entry {
+        int64_t seq;
+        int64_t expires_ms;
+    };
+
+    struct User {
+        std::unordered_map<std::string, Entry> ids;
+        // Keys of ids, oldest first; every id shares one window, so this is
+        // also expiry order. Node-based map keys don't move on rehash.
+        std::deque<const std::string *> order;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, User> users;
+        int64_t next_sweep_ms = 0;
+    };
+
+    Shard &shard_for(const std::string &user) {
+        return shards[std::hash<std::string>()(user) % kShards];
+    }
+
+    void expire(User &user, int64_t now_ms) {
+        while (!user.order.empty()) {
+            auto it = user.ids.find(*user.order.front());
+            if (it->second.expires_ms > now_ms) {
+                break;
+            }
+            user.order.pop_front();
+            user.ids.erase(it);
+        }
+    }
+
+    // Drop lapsed ids and users with none left, at most once per window.
+    void sweep(Shard &shard, int64_t now_ms) {
+        for (auto it = shard.users.begin(); it != shard.users.end(); ) {
+            expire(it->second, now_ms);
+            if (it->second.ids.empty()) {
+                it = shard.users.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        shard.next_sweep_ms = now_ms + window_ms;
+    }
+
+    int64_t window_ms;
+    std::size_t max_per_user;
+    std::vector<Shard> shards;
+};
+
+#endif // DEDUP_INDEX_H
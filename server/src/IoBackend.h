@@ -0,0 +1,33 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+// Boost 1.74's awaitable.hpp, which boost/asio.hpp pulls in under C++20, uses
+// std::exchange without including <utility>.
+#include <utility>
+#include <boost/version.hpp>
+
+// Asio's I/O backend. Asio uses its epoll reactor by default; the
+// CHAT_ASIO_IO_URING CMake option defines BOOST_ASIO_HAS_IO_URING and
+// BOOST_ASIO_DISABLE_EPOLL for every translation unit and links liburing,
+// which moves it to io_uring. Either way, ServerConfig::io_uring runs ws://
+// sockets on the server's own ring (IoUring.h); IoBackendTest.BroadcastFanOut
+// compares that with the reactor.
+#if defined(BOOST_ASIO_HAS_IO_URING) && BOOST_VERSION < 107800
+#error "The io_uring backend needs Boost 1.78 or newer."
+#endif
+
+#include <boost/asio.hpp>
+
+inline const char* io_backend_name() {
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+    return "io_uring";
+#elif defined(BOOST_ASIO_HAS_IO_URING)
+    return "io_uring (files only; sockets on epoll, define BOOST_ASIO_DISABLE_EPOLL)";
+#elif defined(BOOST_ASIO_HAS_EPOLL)
+    return "epoll";
+#else
+    return "select";
+#endif
+}
+
+#endif // IO_BACKEND_H
@@ -0,0 +1,330 @@
+#include "IoUring.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+template <typename T>
+static T *ring_field(void *ring, unsigned offset) {
+    return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+}
+
+IoUring::IoUring(boost::asio::io_context &context, unsigned entries, std::size_t read_buffers,
+                 std::size_t buffer_bytes)
+    : context(context), entries(entries), buffer_count(0), buffer_bytes(std::max<std::size_t>(buffer_bytes, 1)),
+      completions(context) {
+    // The buffer ring's size must be a power of two, at most 32768.
+    for (std::size_t count = 1; count <= read_buffers && count <= 32768; count *= 2) {
+        buffer_count = count;
+    }
+}
+
+IoUring::~IoUring() {
+    // Closing the ring cancels whatever the kernel still holds. Requests
+    // never completed hold handlers (and through them sessions); destroy
+    // them unrun, as io_context does with its own.
+    boost::system::error_code ec;
+    completions.close(ec);
+    if (ring_fd >= 0) {
+        close(ring_fd);
+    }
+    std::vector<Request *> orphans;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Request *request = in_flight; request; request = request->next) {
+            orphans.push_back(request);
+        }
+        in_flight = nullptr;
+    }
+    for (Request *request : orphans) {
+        delete request;
+    }
+
+    if (sqes) {
+        munmap(sqes, sqes_bytes);
+    }
+    if (cq_ring && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_bytes);
+    }
+    if (sq_ring) {
+        munmap(sq_ring, sq_ring_bytes);
+    }
+    if (buffer_ring) {
+        munmap(buffer_ring, buffer_ring_bytes);
+    }
+}
+
+bool IoUring::open() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    // Room for a completion per connection's read and write, well past the
+    // submissions one flush can carry.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = entries * 4;
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd < 0) {
+        std::cerr << "[io_uring] Setup failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    entries = params.sq_entries;
+
+    sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_bytes = cq_ring_bytes = std::max(sq_ring_bytes, cq_ring_bytes);
+    }
+    sq_ring = mmap(nullptr, sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                   IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        std::cerr << "[io_uring] Mapping the submission queue failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                       IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            std::cerr << "[io_uring] Mapping the completion queue failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+    void *mapped = mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                        IORING_OFF_SQES);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "[io_uring] Mapping the submission entries failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe *>(mapped);
+
+    sq_head = ring_field<unsigned>(sq_ring, params.sq_off.head);
+    sq_tail = ring_field<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask = ring_field<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_flags = ring_field<unsigned>(sq_ring, params.sq_off.flags);
+    sq_array = ring_field<unsigned>(sq_ring, params.sq_off.array);
+    cq_head = ring_field<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail = ring_field<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask = ring_field<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes = ring_field<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+    // Entries are used in ring order, so slot i always names entry i.
+    for (unsigned i = 0; i < params.sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+
+    if (buffer_count > 0) {
+        buffer_ring_bytes = buffer_count * sizeof(io_uring_buf);
+        mapped = mmap(nullptr, buffer_ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        io_uring_buf_reg registration;
+        std::memset(&registration, 0, sizeof(registration));
+        if (mapped != MAP_FAILED) {
+            buffer_ring = static_cast<io_uring_buf_ring *>(mapped);
+            registration.ring_addr = reinterpret_cast<uint64_t>(buffer_ring);
+            registration.ring_entries = static_cast<unsigned>(buffer_count);
+            registration.bgid = 0;
+        }
+        if (!buffer_ring || io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+            std::cerr << "[io_uring] Registering read buffers failed (" << std::strerror(errno)
+                      << "); receiving into session buffers." << std::endl;
+            if (buffer_ring) {
+                munmap(buffer_ring, buffer_ring_bytes);
+                buffer_ring = nullptr;
+            }
+            buffer_count = 0;
+        } else {
+            buffer_memory.resize(buffer_count * buffer_bytes);
+            for (unsigned id = 0; id < buffer_count; ++id) {
+                recycle_buffer(id);
+            }
+        }
+    }
+
+    int event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event < 0 || io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &event, 1) < 0) {
+        std::cerr << "[io_uring] Registering the completion eventfd failed: " << std::strerror(errno) << std::endl;
+        if (event >= 0) {
+            close(event);
+        }
+        return false;
+    }
+    completions.assign(event);
+    wait_for_completions();
+    return true;
+}
+
+void IoUring::receive(int fd, std::size_t size, Request *request) {
+    std::lock_guard<std::mutex> lock(mutex);
+    io_uring_sqe *sqe = next_sqe(request);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = static_cast<unsigned>(std::min(size, buffer_bytes));
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    queue_locked();
+}
+
+void IoUring::receive(int fd, void *data, std::size_t size, Request *request) {
+    std::lock_guard<std::mutex> lock(mutex);
+    io_uring_sqe *sqe = next_sqe(request);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<unsigned>(std::min<std::size_t>(size, INT_MAX));
+    queue_locked();
+}
+
+void IoUring::send(int fd, const msghdr *message, Request *request) {
+    std::lock_guard<std::mutex> lock(mutex);
+    io_uring_sqe *sqe = next_sqe(request);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(message);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    queue_locked();
+}
+
+io_uring_sqe *IoUring::next_sqe(Request *request) {
+    if (*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries) {
+        // Full until the kernel takes what is queued; it does so before
+        // io_uring_enter returns.
+        submit_locked();
+    }
+    io_uring_sqe *sqe = &sqes[*sq_tail & *sq_mask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = reinterpret_cast<uint64_t>(request);
+    if (!request->tracked) {
+        request->tracked = true;
+        request->prev = nullptr;
+        request->next = in_flight;
+        if (in_flight) {
+            in_flight->prev = request;
+        }
+        in_flight = request;
+    }
+    return sqe;
+}
+
+void IoUring::queue_locked() {
+    __atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+    ++queued;
+    schedule_flush();
+}
+
+// Whatever is queued by the time the flush runs goes in one system call.
+void IoUring::schedule_flush() {
+    if (flush_scheduled) {
+        return;
+    }
+    flush_scheduled = true;
+    boost::asio::post(context, [this]() { flush(); });
+}
+
+void IoUring::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    flush_scheduled = false;
+    submit_locked();
+}
+
+void IoUring::submit_locked() {
+    while (queued > 0) {
+        int result = io_uring_enter(ring_fd, queued, 0, 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EAGAIN and EBUSY clear as completions are reaped; try again then.
+            if (errno != EAGAIN && errno != EBUSY) {
+                std::cerr << "[io_uring] Submit failed: " << std::strerror(errno) << std::endl;
+            }
+            schedule_flush();
+            return;
+        }
+        submit_calls_count.fetch_add(1, std::memory_order_relaxed);
+        submitted_count.fetch_add(static_cast<uint64_t>(result), std::memory_order_relaxed);
+        queued -= static_cast<unsigned>(result);
+    }
+}
+
+void IoUring::wait_for_completions() {
+    completions.async_wait(boost::asio::posix::descriptor_base::wait_read, [this](boost::system::error_code ec) {
+        if (ec) {
+            return;
+        }
+        uint64_t signalled;
+        // Reset before reaping, so a completion posted meanwhile signals again.
+        if (read(completions.native_handle(), &signalled, sizeof(signalled)) < 0 && errno != EAGAIN) {
+            std::cerr << "[io_uring] Reading the completion eventfd failed: " << std::strerror(errno) << std::endl;
+        }
+        reap();
+        wait_for_completions();
+    });
+}
+
+// Only the completion handler reaps, so the queue has a single consumer.
+void IoUring::reap() {
+    for (;;) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // Completions the queue had no room for wait in the kernel until asked for.
+            if (!(__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) {
+                return;
+            }
+            io_uring_enter(ring_fd, 0, 0, IORING_ENTER_GETEVENTS);
+            if (*cq_head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                return;
+            }
+            continue;
+        }
+        for (; head != tail; ++head) {
+            const io_uring_cqe &cqe = cqes[head & *cq_mask];
+            Request *request = reinterpret_cast<Request *>(cqe.user_data);
+            int result = cqe.res;
+            unsigned flags = cqe.flags;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            if (!request || !request->complete(result, flags)) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (request->prev) {
+                    request->prev->next = request->next;
+                } else {
+                    in_flight = request->next;
+                }
+                if (request->next) {
+                    request->next->prev = request->prev;
+                }
+            }
+            delete request;
+        }
+    }
+}
+
+void IoUring::recycle_buffer(unsigned id) {
+    // Not buffer_ring->bufs: C++ lays the kernel header's flexible array out
+    // 8 bytes in, while the kernel reads the entries from the ring's start.
+    io_uring_buf &buffer = reinterpret_cast<io_uring_buf *>(buffer_ring)[buffer_tail & (buffer_count - 1)];
+    buffer.addr = reinterpret_cast<uint64_t>(buffer_memory.data() + id * buffer_bytes);
+    buffer.len = static_cast<unsigned>(buffer_bytes);
+    buffer.bid = static_cast<uint16_t>(id);
+    ++buffer_tail;
+    __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,138 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include "IoBackend.h"
+#include <boost/asio.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// An io_uring instance driven from an Asio io_context, for socket reads and
+// writes that bypass the reactor (see UringStream). Built on the raw system
+// calls, so it needs only the kernel headers, not liburing.
+//
+// Submissions from any thread are queued under a lock, and one posted flush
+// hands everything queued since to the kernel in a single io_uring_enter, so
+// a broadcast to many sessions costs one system call rather than one send
+// each. Completions signal an eventfd that the io_context waits on; the
+// waiting handler reaps the completion queue and hands each result back to
+// its request.
+//
+// Reads use a ring of provided buffers registered with the kernel: a receive
+// takes one only when data arrives, so idle connections hold none, and the
+// data is copied out to the caller and the buffer put back. When every
+// buffer is in use the receive is retried straight into the caller's buffer.
+class IoUring {
+public:
+    // One submitted operation. complete() runs on the reaping thread with
+    // the kernel's result (a byte count or -errno) and CQE flags; returning
+    // false means it submitted itself again and stays alive. The ring owns
+    // requests in flight and deletes them once they are done, or unrun when
+    // the ring is destroyed.
+    struct Request {
+        virtual ~Request() {}
+        virtual bool complete(int result, unsigned flags) = 0;
+
+        // Links in the ring's list of requests in flight.
+        bool tracked = false;
+        Request *prev = nullptr;
+        Request *next = nullptr;
+    };
+
+    // entries is the submission queue size; read_buffers of buffer_bytes
+    // each are registered for receives (0 turns buffer selection off).
+    IoUring(boost::asio::io_context &context, unsigned entries, std::size_t read_buffers, std::size_t buffer_bytes);
+    ~IoUring();
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    // False if the kernel refused the ring; nothing else may be called then.
+    bool open();
+
+    // Receive into a registered buffer; complete() gets its id through
+    // flags and must copy it out with take_buffer.
+    void receive(int fd, std::size_t size, Request *request);
+    // Receive straight into data.
+    void receive(int fd, void *data, std::size_t size, Request *request);
+    // sendmsg(2); message and its iovecs must stay put until completion.
+    void send(int fd, const msghdr *message, Request *request);
+
+    // Copy the bytes a buffer-selecting receive delivered, then hand the
+    // buffer back to the kernel. Reaping thread only.
+    template <typename MutableBuffers>
+    std::size_t take_buffer(unsigned flags, int result, const MutableBuffers &out) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+        std::size_t copied = boost::asio::buffer_copy(
+            out, boost::asio::buffer(buffer_memory.data() + id * buffer_bytes, static_cast<std::size_t>(result)));
+        recycle_buffer(id);
+        return copied;
+    }
+    bool selects_buffers() const { return buffer_count > 0; }
+
+    // io_uring_enter calls that submitted work, and requests submitted.
+    uint64_t submit_calls() const { return submit_calls_count.load(std::memory_order_relaxed); }
+    uint64_t submitted() const { return submitted_count.load(std::memory_order_relaxed); }
+
+private:
+    // A cleared submission queue entry for request, and publishing it once
+    // filled in; caller holds mutex.
+    io_uring_sqe *next_sqe(Request *request);
+    void queue_locked();
+    void schedule_flush();
+    void flush();
+    // io_uring_enter for everything queued; caller holds mutex.
+    void submit_locked();
+    void wait_for_completions();
+    void reap();
+    void recycle_buffer(unsigned id);
+
+    boost::asio::io_context &context;
+    unsigned entries;
+    std::size_t buffer_count;
+    std::size_t buffer_bytes;
+
+    int ring_fd = -1;
+    // The mapped rings; sq_ring also holds the completion queue when the
+    // kernel maps both at once.
+    void *sq_ring = nullptr;
+    std::size_t sq_ring_bytes = 0;
+    void *cq_ring = nullptr;
+    std::size_t cq_ring_bytes = 0;
+    io_uring_sqe *sqes = nullptr;
+    std::size_t sqes_bytes = 0;
+
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_flags = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    // Provided buffers: one block of memory, and the ring telling the kernel
+    // which of them are free.
+    std::vector<char> buffer_memory;
+    io_uring_buf_ring *buffer_ring = nullptr;
+    std::size_t buffer_ring_bytes = 0;
+    uint16_t buffer_tail = 0;
+
+    boost::asio::posix::stream_descriptor completions;
+
+    // Guards the submission queue, the in-flight list and flush_scheduled.
+    std::mutex mutex;
+    unsigned queued = 0;
+    bool flush_scheduled = false;
+    Request *in_flight = nullptr;
+
+    std::atomic<uint64_t> submit_calls_count{0};
+    std::atomic<uint64_t> submitted_count{0};
+};
+
+#endif // IO_URING_H
@@ -0,0 +1,271 @@
+#ifndef KTLS_STREAM_H
+#define KTLS_STREAM_H
+
+#include "IoBackend.h"
+#include <boost/asio.hpp>
+#include <boost/asio/ssl/error.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/websocket/teardown.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// TLS run by OpenSSL directly on the socket's file descriptor, for use as the
+// next layer of a websocket::stream.
+//
+// asio::ssl::stream (and beast::ssl_stream) feed OpenSSL through memory BIOs,
+// which rules out kernel TLS. Here OpenSSL owns the socket BIO, so with
+// SSL_OP_ENABLE_KTLS set on the context it installs the negotiated keys in the
+// kernel once the handshake is done; from then on SSL_write/SSL_read pass
+// plaintext to the socket and the kernel does the record encryption. When the
+// kernel or cipher can't be offloaded, OpenSSL simply keeps encrypting in user
+// space. The socket is non-blocking and readiness comes from async_wait, so
+// this works with any Asio reactor.
+template <typename Socket>
+class KtlsStream {
+public:
+    using executor_type = typename Socket::executor_type;
+    using next_layer_type = Socket;
+
+    KtlsStream(const executor_type &executor, SSL_CTX *context)
+        : socket(executor), context(context), ssl(nullptr) {}
+
+    ~KtlsStream() {
+        if (ssl) {
+            SSL_free(ssl);
+        }
+    }
+
+    KtlsStream(const KtlsStream &) = delete;
+    KtlsStream &operator=(const KtlsStream &) = delete;
+
+    executor_type get_executor() { return socket.get_executor(); }
+    Socket &next_layer() { return socket; }
+    const Socket &next_layer() const { return socket; }
+    SSL *native_handle() { return ssl; }
+
+    // True once the kernel encrypts outgoing / decrypts incoming records.
+    bool ktls_send() const { return ssl && BIO_get_ktls_send(SSL_get_wbio(ssl)); }
+    bool ktls_recv() const { return ssl && BIO_get_ktls_recv(SSL_get_rbio(ssl)); }
+
+    // Server-side handshake on an accepted socket. Handler: void(error_code).
+    template <typename Token>
+    auto async_handshake(Token &&token) {
+        return boost::asio::async_compose<Token, void(boost::system::error_code)>(
+            handshake_op{*this}, token, socket);
+    }
+
+    template <typename MutableBuffers, typename Token>
+    auto async_read_some(const MutableBuffers &buffers, Token &&token) {
+        return boost::asio::async_compose<Token, void(boost::system::error_code, std::size_t)>(
+            io_op<MutableBuffers, false>{*this, buffers}, token, socket);
+    }
+
+    template <typename ConstBuffers, typename Token>
+    auto async_write_some(const ConstBuffers &buffers, Token &&token) {
+        return boost::asio::async_compose<Token, void(boost::system::error_code, std::size_t)>(
+            io_op<ConstBuffers, true>{*this, buffers}, token, socket);
+    }
+
+    // Best-effort close_notify, then close the socket.
+    void shutdown(boost::system::error_code &ec) {
+        if (ssl) {
+            ERR_clear_error();
+            SSL_shutdown(ssl);
+        }
+        socket.shutdown(Socket::shutdown_both, ec);
+        socket.close(ec);
+    }
+
+private:
+    // What an OpenSSL call asked for next.
+    enum Step { Done, WaitRead, WaitWrite, Failed };
+
+    Step classify(int result, boost::system::error_code &ec) {
+        switch (SSL_get_error(ssl, result)) {
+        case SSL_ERROR_NONE:
+            return Done;
+        case SSL_ERROR_WANT_READ:
+            return WaitRead;
+        case SSL_ERROR_WANT_WRITE:
+            return WaitWrite;
+        case SSL_ERROR_ZERO_RETURN:
+            ec = boost::asio::error::eof;
+            return Failed;
+        case SSL_ERROR_SYSCALL:
+            ec = errno ? boost::system::error_code(errno, boost::system::system_category())
+                       : boost::system::error_code(boost::asio::error::eof);
+            return Failed;
+        default:
+            ec = boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+            return Failed;
+        }
+    }
+
+    // Shared driver for the composed operations: run attempt() until it
+    // stops asking for socket readiness. A result available on the first
+    // attempt is delivered through post, never from inside the initiating call.
+    template <bool HasSize>
+    struct op_base {
+        explicit op_base(KtlsStream &stream) : stream(stream) {}
+
+        KtlsStream &stream;
+        int state = 0;
+        boost::system::error_code result_ec;
+        std::size_t result = 0;
+
+        template <typename Self, typename Attempt>
+        void drive(Self &self, boost::system::error_code ec, Attempt attempt) {
+            if (state == 2) {
+                finish(self);
+                return;
+            }
+            bool first = state == 0;
+            state = 1;
+            if (!ec) {
+                Step step = attempt(ec);
+                if (step == WaitRead || step == WaitWrite) {
+                    stream.socket.async_wait(step == WaitRead ? Socket::wait_read : Socket::wait_write,
+                                             std::move(self));
+                    return;
+                }
+            }
+            result_ec = ec;
+            if (first) {
+                state = 2;
+                boost::asio::post(stream.socket.get_executor(), std::move(self));
+                return;
+            }
+            finish(self);
+        }
+
+        template <typename Self>
+        void finish(Self &self) {
+            if constexpr (HasSize) {
+                self.complete(result_ec, result);
+            } else {
+                self.complete(result_ec);
+            }
+        }
+    };
+
+    struct handshake_op : op_base<false> {
+        explicit handshake_op(KtlsStream &stream) : op_base<false>(stream) {}
+
+        template <typename Self>
+        void operator()(Self &self, boost::system::error_code ec = {}) {
+            KtlsStream &s = this->stream;
+            this->drive(self, ec, [&s](boost::system::error_code &ec) {
+                if (!s.ssl && !s.start(ec)) {
+                    return Failed;
+                }
+                ERR_clear_error();
+                int result = SSL_do_handshake(s.ssl);
+                return result == 1 ? Done : s.classify(result, ec);
+            });
+        }
+    };
+
+    template <typename Buffers, bool IsWrite>
+    struct io_op : op_base<true> {
+        Buffers buffers;
+        io_op(KtlsStream &stream, const Buffers &buffers) : op_base<true>(stream), buffers(buffers) {}
+
+        template <typename Self>
+        void operator()(Self &self, boost::system::error_code ec = {}) {
+            KtlsStream &s = this->stream;
+            std::size_t &transferred = this->result;
+            const Buffers &bufs = buffers;
+            this->drive(self, ec, [&s, &transferred, &bufs](boost::system::error_code &ec) {
+                // One SSL call per attempt. Writes gather a short buffer
+                // sequence (Beast sends the frame header and payload as
+                // separate buffers) into one record, as beast::flat_stream
+                // does for ssl_stream; otherwise the first non-empty buffer is
+                // used, which is all a *_some operation promises.
+                const void *data = nullptr;
+                std::size_t size = 0;
+                std::size_t total = boost::asio::buffer_size(bufs);
+                if (total == 0) {
+                    transferred = 0;
+                    return Done;
+                }
+                auto first = boost::asio::buffer_sequence_begin(bufs);
+                for (; boost::asio::buffer_size(*first) == 0; ++first) {}
+                if constexpr (IsWrite) {
+                    if (boost::asio::buffer_size(*first) < total && total <= kCoalesceLimit) {
+                        s.coalesced.resize(total);
+                        boost::asio::buffer_copy(boost::asio::buffer(s.coalesced), bufs);
+                        data = s.coalesced.data();
+                        size = total;
+                    }
+                }
+                if (!data) {
+                    data = (*first).data();
+                    size = boost::asio::buffer_size(*first);
+                }
+                ERR_clear_error();
+                int length = static_cast<int>(std::min<std::size_t>(size, 1 << 30));
+                int result;
+                if constexpr (IsWrite) {
+                    result = SSL_write(s.ssl, data, length);
+                } else {
+                    result = SSL_read(s.ssl, const_cast<void *>(data), length);
+                }
+                if (result > 0) {
+                    transferred = static_cast<std::size_t>(result);
+                    return Done;
+                }
+                return s.classify(result, ec);
+            });
+        }
+    };
+
+    bool start(boost::system::error_code &ec) {
+        socket.native_non_blocking(true, ec);
+        if (ec) {
+            return false;
+        }
+        // OpenSSL writes each flight, ticket and record with its own send();
+        // with Nagle on, the reply after a session ticket would sit behind the
+        // client's delayed ACK.
+        boost::system::error_code ignored;
+        socket.set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+        ssl = SSL_new(context);
+        if (!ssl || !SSL_set_fd(ssl, static_cast<int>(socket.native_handle()))) {
+            ec = boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+            return false;
+        }
+        // Beast may hand a retried write a different buffer address.
+        SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_set_accept_state(ssl);
+        return true;
+    }
+
+    // Largest write gathered into a single record; one TLS record holds 16 KB.
+    static constexpr std::size_t kCoalesceLimit = 16 * 1024;
+
+    Socket socket;
+    SSL_CTX *context;
+    SSL *ssl;
+    std::vector<char> coalesced;
+};
+
+// websocket::stream tears its next layer down through these.
+template <typename Socket>
+void teardown(boost::beast::role_type, KtlsStream<Socket> &stream, boost::system::error_code &ec) {
+    stream.shutdown(ec);
+}
+
+template <typename Socket, typename Handler>
+void async_teardown(boost::beast::role_type, KtlsStream<Socket> &stream, Handler &&handler) {
+    boost::system::error_code ec;
+    stream.shutdown(ec);
+    boost::asio::post(stream.get_executor(),
+                      boost::beast::bind_front_handler(std::forward<Handler>(handler), boost::system::error_code()));
+}
+
+#endif // KTLS_STREAM_H
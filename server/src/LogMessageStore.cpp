@@ -0,0 +1,446 @@
+#include "LogMessageStore.h"
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace {
+
+const uint32_t kRecordMagic = 0x4c47534d; // "MSGL"
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t length; // payload bytes
+    uint32_t crc;    // CRC32 of the payload
+    uint32_t reserved;
+};
+
+struct PayloadHeader {
+    uint64_t seq;
+    int64_t createdAt;
+    uint32_t roomLength;
+    uint32_t senderLength;
+    uint32_t contentLength;
+    uint32_t timestampLength;
+};
+
+// Records start on 8-byte boundaries so headers can be read in place.
+std::size_t align8(std::size_t n) {
+    return (n + 7) & ~static_cast<std::size_t>(7);
+}
+
+uint32_t payloadCrc(const char* payload, std::size_t length) {
+    return static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef*>(payload), static_cast<uInt>(length)));
+}
+
+} // namespace
+
+LogMessageStore::LogMessageStore(const std::string &directory, const StorageConfig &storage)
+    : directory(directory), storage(storage), nextSeq(1)
+{
+    // Offsets in the room index are 32-bit.
+    this->storage.logSegmentBytes = std::min<std::size_t>(
+        std::max<std::size_t>(storage.logSegmentBytes, 4096), 0xffffffffu);
+}
+
+LogMessageStore::~LogMessageStore() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &segment : segments) {
+        msync(segment.base, segment.end, MS_SYNC);
+        closeSegment(segment, false);
+    }
+}
+
+std::string LogMessageStore::segmentPath(uint32_t number) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "segment-%08u.log", number);
+    return directory + "/" + name;
+}
+
+bool LogMessageStore::open() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        std::cerr << "Can't create log directory " << directory << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::vector<uint32_t> numbers;
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        std::cerr << "Can't open log directory " << directory << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    while (dirent* entry = readdir(dir)) {
+        unsigned number;
+        if (std::sscanf(entry->d_name, "segment-%8u.log", &number) == 1) {
+            numbers.push_back(number);
+        }
+    }
+    closedir(dir);
+    std::sort(numbers.begin(), numbers.end());
+    if (numbers.empty()) {
+        numbers.push_back(1);
+    }
+
+    for (uint32_t number : numbers) {
+        if (!openSegment(number)) {
+            return false;
+        }
+        recoverSegment(segments.back());
+    }
+    std::cout << "[Log] Opened " << segments.size() << " segment(s), next sequence " << nextSeq << "." << std::endl;
+    return true;
+}
+
+bool LogMessageStore::openSegment(uint32_t number) {
+    std::string path = segmentPath(number);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        std::cerr << "Can't open log segment " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // Segments are preallocated (sparsely) to full size so the mapping never
+    // has to grow.
+    struct stat info;
+    std::size_t capacity = storage.logSegmentBytes;
+    if (fstat(fd, &info) == 0 && static_cast<std::size_t>(info.st_size) > capacity) {
+        capacity = static_cast<std::size_t>(info.st_size);
+    }
+    if (ftruncate(fd, static_cast<off_t>(capacity)) != 0) {
+        std::cerr << "Can't size log segment " << path << ": " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+    void* base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        std::cerr << "Can't map log segment " << path << ": " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return false;
+    }
+    Segment segment = {number, fd, static_cast<char*>(base), capacity, 0, 0};
+    segments.push_back(segment);
+    return true;
+}
+
+void LogMessageStore::closeSegment(Segment &segment, bool remove) {
+    munmap(segment.base, segment.capacity);
+    ::close(segment.fd);
+    if (remove) {
+        std::remove(segmentPath(segment.number).c_str());
+    }
+}
+
+// Null if the segment is gone (dropped by retention) or never existed.
+const LogMessageStore::Segment* LogMessageStore::findSegment(uint32_t number) const {
+    if (segments.empty()) {
+        return nullptr;
+    }
+    // Numbers are normally contiguous; fall back to a search if a file went missing.
+    std::size_t guess = number - segments.front().number;
+    if (guess < segments.size() && segments[guess].number == number) {
+        return &segments[guess];
+    }
+    auto it = std::lower_bound(segments.begin(), segments.end(), number,
+                               [](const Segment &s, uint32_t n) { return s.number < n; });
+    if (it == segments.end() || it->number != number) {
+        return nullptr;
+    }
+    return &*it;
+}
+
+bool LogMessageStore::readRecord(const Segment &segment, std::size_t offset, RecordView &view, std::size_t &next) const {
+    if (offset + sizeof(RecordHeader) + sizeof(PayloadHeader) > segment.capacity) {
+        return false;
+    }
+    const RecordHeader* header = reinterpret_cast<const RecordHeader*>(segment.base + offset);
+    if (header->magic != kRecordMagic || header->length < sizeof(PayloadHeader) ||
+        header->length > segment.capacity - offset - sizeof(RecordHeader)) {
+        return false;
+    }
+    const char* payload = segment.base + offset + sizeof(RecordHeader);
+    const PayloadHeader* fields = reinterpret_cast<const PayloadHeader*>(payload);
+    uint64_t textLength = uint64_t(fields->roomLength) + fields->senderLength +
+                          fields->contentLength + fields->timestampLength;
+    if (sizeof(PayloadHeader) + textLength != header->length) {
+        return false;
+    }
+
+    const char* text = payload + sizeof(PayloadHeader);
+    view.seq = fields->seq;
+    view.createdAt = fields->createdAt;
+    view.room = boost::string_view(text, fields->roomLength);
+    text += fields->roomLength;
+    view.sender = boost::string_view(text, fields->senderLength);
+    text += fields->senderLength;
+    view.content = boost::string_view(text, fields->contentLength);
+    text += fields->contentLength;
+    view.timestamp = boost::string_view(text, fields->timestampLength);
+    next = offset + align8(sizeof(RecordHeader) + header->length);
+    return true;
+}
+
+// Index every valid record, then cut the segment at the first one that isn't.
+void LogMessageStore::recoverSegment(Segment &segment) {
+    std::size_t offset = 0;
+    RecordView view;
+    std::size_t next;
+    while (readRecord(segment, offset, view, next)) {
+        const RecordHeader* header = reinterpret_cast<const RecordHeader*>(segment.base + offset);
+        if (payloadCrc(segment.base + offset + sizeof(RecordHeader), header->length) != header->crc) {
+            break;
+        }
+        roomIndex[view.room.to_string()].push_back(Location{segment.number, static_cast<uint32_t>(offset)});
+        nextSeq = std::max(nextSeq, view.seq + 1);
+        segment.maxCreatedAt = std::max(segment.maxCreatedAt, view.createdAt);
+        offset = next;
+    }
+    segment.end = offset;
+
+    // A clean segment ends in zeroes. Anything else is a torn or corrupt
+    // record; wipe the rest so later scans can't resurrect stale data.
+    if (offset + sizeof(uint32_t) <= segment.capacity &&
+        *reinterpret_cast<const uint32_t*>(segment.base + offset) != 0) {
+        std::cerr << "[Log] Truncating " << segmentPath(segment.number) << " at offset " << offset
+                  << " after a corrupt record." << std::endl;
+        std::memset(segment.base + offset, 0, segment.capacity - offset);
+        msync(segment.base, segment.capacity, MS_SYNC);
+    }
+}
+
+bool LogMessageStore::storeMessage(const std::string &room, const std::string &sender, const std::string &content,
+                                   const std::string &timestamp, const std::string &,
+                                   int64_t &seq, bool &duplicate) {
+    duplicate = false;
+    std::size_t payloadLength = sizeof(PayloadHeader) + room.size() + sender.size() + content.size() + timestamp.size();
+    std::size_t recordLength = align8(sizeof(RecordHeader) + payloadLength);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (segments.empty()) {
+        return false;
+    }
+    if (segments.back().end + recordLength > segments.back().capacity) {
+        if (recordLength > storage.logSegmentBytes) {
+            std::cerr << "[Log] Message of " << recordLength << " bytes exceeds the segment size." << std::endl;
+            return false;
+        }
+        // Seal the full segment and start the next one.
+        Segment &full = segments.back();
+        msync(full.base, full.end, MS_SYNC);
+        if (!openSegment(full.number + 1)) {
+            return false;
+        }
+    }
+
+    Segment &segment = segments.back();
+    std::size_t offset = segment.end;
+    char* payload = segment.base + offset + sizeof(RecordHeader);
+    PayloadHeader fields = {
+        nextSeq,
+        static_cast<int64_t>(std::time(nullptr)),
+        static_cast<uint32_t>(room.size()),
+        static_cast<uint32_t>(sender.size()),
+        static_cast<uint32_t>(content.size()),
+        static_cast<uint32_t>(timestamp.size())
+    };
+    std::memcpy(payload, &fields, sizeof(fields));
+    char* text = payload + sizeof(fields);
+    std::memcpy(text, room.data(), room.size());
+    text += room.size();
+    std::memcpy(text, sender.data(), sender.size());
+    text += sender.size();
+    std::memcpy(text, content.data(), content.size());
+    text += content.size();
+    std::memcpy(text, timestamp.data(), timestamp.size());
+
+    RecordHeader header = {kRecordMagic, static_cast<uint32_t>(payloadLength), payloadCrc(payload, payloadLength), 0};
+    std::memcpy(segment.base + offset, &header, sizeof(header));
+
+    segment.end = offset + recordLength;
+    segment.maxCreatedAt = std::max(segment.maxCreatedAt, fields.createdAt);
+    roomIndex[room].push_back(Location{segment.number, static_cast<uint32_t>(offset)});
+    seq = static_cast<int64_t>(nextSeq++);
+    return true;
+}
+
+void LogMessageStore::replayRoom(const std::string &room, std::time_t since,
+                                 const std::function<void(const RecordView &)> &visit, std::size_t limit) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = roomIndex.find(room);
+    if (it == roomIndex.end() || segments.empty()) {
+        return;
+    }
+    const std::vector<Location> &locations = it->second;
+    auto first = locations.begin();
+    if (limit > 0 && locations.size() > limit) {
+        first = locations.end() - limit;
+    }
+    for (auto at = first; at != locations.end(); ++at) {
+        const Location &location = *at;
+        const Segment *segment = findSegment(location.segment);
+        // Whole segments older than since can be skipped without reading them.
+        if (!segment || segment->maxCreatedAt < since) {
+            continue;
+        }
+        RecordView view;
+        std::size_t next;
+        if (readRecord(*segment, location.offset, view, next) && view.createdAt >= since) {
+            visit(view);
+        }
+    }
+}
+
+std::vector<nlohmann::json> LogMessageStore::getMessagesForRoom(const std::string &room, std::time_t since) {
+    std::vector<nlohmann::json> messages;
+    replayRoom(room, since, [&messages, &room](const RecordView &view) {
+        messages.push_back(nlohmann::json{
+            {"type", "message"},
+            {"room", room},
+            {"from", view.sender.to_string()},
+            {"content", view.content.to_string()},
+            {"timestamp", view.timestamp.to_string()},
+            {"seq", static_cast<int64_t>(view.seq)}
+        });
+    });
+    return messages;
+}
+
+// Append text as a JSON string literal, escaped the way nlohmann::json::dump
+// does, so frames match those built from getMessagesForRoom byte for byte.
+static void appendJsonString(std::string &out, boost::string_view text) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                out += "\\u00";
+                out += hex[(c >> 4) & 0xf];
+                out += hex[c & 0xf];
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+// A record serialized with its keys in the sorted order dump() writes them.
+static std::shared_ptr<const std::string> recordFrame(const LogMessageStore::RecordView &view, const std::string &room) {
+    std::string frame;
+    frame.reserve(view.content.size() + view.sender.size() + view.timestamp.size() + room.size() + 80);
+    frame += "{\"content\":";
+    appendJsonString(frame, view.content);
+    frame += ",\"from\":";
+    appendJsonString(frame, view.sender);
+    frame += ",\"room\":";
+    appendJsonString(frame, room);
+    frame += ",\"seq\":";
+    frame += std::to_string(view.seq);
+    frame += ",\"timestamp\":";
+    appendJsonString(frame, view.timestamp);
+    frame += ",\"type\":\"message\"}";
+    return std::make_shared<const std::string>(std::move(frame));
+}
+
+std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+LogMessageStore::historyFrames(const std::string &room, std::time_t since) {
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>> frames;
+    replayRoom(room, since, [&frames, &room](const RecordView &view) {
+        frames.emplace_back(static_cast<int64_t>(view.seq), recordFrame(view, room));
+    });
+    return frames;
+}
+
+std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+LogMessageStore::recentFrames(const std::string &room, std::size_t limit) {
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>> frames;
+    if (limit == 0) {
+        return frames;
+    }
+    replayRoom(room, 0, [&frames, &room](const RecordView &view) {
+        frames.emplace_back(static_cast<int64_t>(view.seq), recordFrame(view, room));
+    }, limit);
+    return frames;
+}
+
+std::vector<std::string> LogMessageStore::activeRooms(std::size_t limit) {
+    std::vector<std::pair<std::size_t, std::string>> counts;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &room : roomIndex) {
+            counts.emplace_back(room.second.size(), room.first);
+        }
+    }
+    std::sort(counts.begin(), counts.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+    std::vector<std::string> rooms;
+    for (std::size_t i = 0; i < counts.size() && i < limit; ++i) {
+        rooms.push_back(counts[i].second);
+    }
+    return rooms;
+}
+
+std::vector<nlohmann::json> LogMessageStore::searchMessages(const std::string &, const std::string &,
+                                                            const std::string &, int, int) {
+    return std::vector<nlohmann::json>();
+}
+
+// Retention drops whole sealed segments whose newest record is past the cutoff.
+bool LogMessageStore::compact(std::time_t now, std::vector<std::string> &expiredRooms) {
+    std::time_t cutoff = retentionCutoff(storage, now);
+    if (cutoff == 0) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::size_t dropped = 0;
+    while (segments.size() > 1 && segments.front().maxCreatedAt < cutoff) {
+        std::cout << "[Log] Dropping " << segmentPath(segments.front().number) << " past retention." << std::endl;
+        closeSegment(segments.front(), true);
+        segments.pop_front();
+        ++dropped;
+    }
+    if (dropped == 0) {
+        return true;
+    }
+
+    uint32_t first = segments.front().number;
+    for (auto it = roomIndex.begin(); it != roomIndex.end(); ) {
+        std::vector<Location> &locations = it->second;
+        auto keep = std::find_if(locations.begin(), locations.end(),
+                                 [first](const Location &l) { return l.segment >= first; });
+        if (keep != locations.begin()) {
+            expiredRooms.push_back(it->first);
+        }
+        locations.erase(locations.begin(), keep);
+        if (locations.empty()) {
+            it = roomIndex.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return true;
+}
+
+// Sealed segments were synced when they filled; only the active one can be dirty.
+bool LogMessageStore::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!segments.empty() && msync(segments.back().base, segments.back().end, MS_SYNC) != 0) {
+        std::cerr << "[Log] msync failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,100 @@
+#ifndef LOG_MESSAGE_STORE_H
+#define LOG_MESSAGE_STORE_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/utility/string_view.hpp>
+#include "MessageStore.h"
+
+// Append-only message engine for high-volume rooms.
+//
+// Messages go into fixed-size segment files that are preallocated and mapped
+// with mmap, so an append is a memcpy. Each record carries a CRC32 of its
+// payload. An in-memory per-room index of (segment, offset) pairs is rebuilt
+// on open by scanning the segments. The scan stops at the first bad record,
+// and anything after it in that segment is zeroed, which recovers a torn tail
+// after a crash. Appends become durable on flush() or when a segment fills.
+// Records use native byte order; the files are not portable across
+// architectures.
+class LogMessageStore : public MessageStore {
+public:
+    // A record as it sits in the mapped segment; the views stay valid until
+    // the next compact().
+    struct RecordView {
+        uint64_t seq;
+        int64_t createdAt;
+        boost::string_view room;
+        boost::string_view sender;
+        boost::string_view content;
+        boost::string_view timestamp;
+    };
+
+    LogMessageStore(const std::string &directory, const StorageConfig &storage);
+    ~LogMessageStore();
+
+    bool open() override;
+    // The log keeps no index of client message ids, so clientMsgId is not
+    // checked here; the server's dedup window is the only guard.
+    using MessageStore::storeMessage;
+    bool storeMessage(const std::string &room, const std::string &sender, const std::string &content,
+                      const std::string &timestamp, const std::string &clientMsgId,
+                      int64_t &seq, bool &duplicate) override;
+    std::vector<nlohmann::json> getMessagesForRoom(const std::string &room, std::time_t since) override;
+    // Serialized by replayRoom straight from the mapping.
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+    historyFrames(const std::string &room, std::time_t since) override;
+    // Only the tail of the room's index is read.
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+    recentFrames(const std::string &room, std::size_t limit) override;
+    std::vector<std::string> activeRooms(std::size_t limit) override;
+    // The log keeps no text index, so search is unsupported.
+    bool supportsSearch() const override { return false; }
+    std::vector<nlohmann::json> searchMessages(const std::string &room, const std::string &sender,
+                                               const std::string &query, int limit, int offset) override;
+    bool compact(std::time_t now, std::vector<std::string> &expiredRooms) override;
+    bool flush() override;
+
+    // Zero-copy history replay: visit each of the room's records, oldest first,
+    // straight out of the mapping. A non-zero limit visits only the newest
+    // limit records. Holds the store's lock while visiting.
+    void replayRoom(const std::string &room, std::time_t since,
+                    const std::function<void(const RecordView &)> &visit, std::size_t limit = 0);
+
+private:
+    struct Segment {
+        uint32_t number;
+        int fd;
+        char* base;
+        std::size_t capacity;
+        // Offset just past the last valid record.
+        std::size_t end;
+        int64_t maxCreatedAt;
+    };
+
+    struct Location {
+        uint32_t segment;
+        uint32_t offset;
+    };
+
+    bool openSegment(uint32_t number);
+    void closeSegment(Segment &segment, bool remove);
+    void recoverSegment(Segment &segment);
+    const Segment* findSegment(uint32_t number) const;
+    bool readRecord(const Segment &segment, std::size_t offset, RecordView &view, std::size_t &next) const;
+    std::string segmentPath(uint32_t number) const;
+
+    std::string directory;
+    StorageConfig storage;
+    std::mutex mutex;
+    // Oldest first; the back segment takes appends.
+    std::deque<Segment> segments;
+    std::unordered_map<std::string, std::vector<Location>> roomIndex;
+    uint64_t nextSeq;
+};
+
+#endif // LOG_MESSAGE_STORE_H
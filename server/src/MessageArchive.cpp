@@ -0,0 +1,363 @@
+#include "MessageArchive.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <zlib.h>
+
+// Messages per compressed chunk; bounds the memory needed to read one back.
+static const std::size_t kChunkRecords = 1000;
+
+static void putU32(std::string &out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        out += static_cast<char>((v >> (8 * i)) & 0xff);
+    }
+}
+
+static void putU64(std::string &out, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        out += static_cast<char>((v >> (8 * i)) & 0xff);
+    }
+}
+
+static void putString(std::string &out, const std::string &s) {
+    putU32(out, static_cast<uint32_t>(s.size()));
+    out += s;
+}
+
+static bool getU32(const std::string &in, std::size_t &pos, uint32_t &v) {
+    if (pos + 4 > in.size()) {
+        return false;
+    }
+    v = 0;
+    for (int i = 0; i < 4; ++i) {
+        v |= static_cast<uint32_t>(static_cast<unsigned char>(in[pos + i])) << (8 * i);
+    }
+    pos += 4;
+    return true;
+}
+
+static bool getU64(const std::string &in, std::size_t &pos, uint64_t &v) {
+    if (pos + 8 > in.size()) {
+        return false;
+    }
+    v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v |= static_cast<uint64_t>(static_cast<unsigned char>(in[pos + i])) << (8 * i);
+    }
+    pos += 8;
+    return true;
+}
+
+static bool getString(const std::string &in, std::size_t &pos, std::string &s) {
+    uint32_t len;
+    if (!getU32(in, pos, len) || pos + len > in.size()) {
+        return false;
+    }
+    s.assign(in, pos, len);
+    pos += len;
+    return true;
+}
+
+// Decode one compressed chunk of room's messages onto the end of out.
+static bool decodeChunk(const Bytef* packed, int packedSize, uLongf rawSize, const std::string &room,
+                        std::vector<MessageArchive::Record> &out) {
+    std::string raw(rawSize, '\0');
+    if (uncompress(reinterpret_cast<Bytef*>(&raw[0]), &rawSize, packed, packedSize) != Z_OK) {
+        return false;
+    }
+    std::size_t pos = 0;
+    while (pos < raw.size()) {
+        MessageArchive::Record record;
+        uint64_t id, createdAt;
+        if (!getU64(raw, pos, id) || !getU64(raw, pos, createdAt) || !getString(raw, pos, record.sender) ||
+            !getString(raw, pos, record.content) || !getString(raw, pos, record.timestamp)) {
+            return false;
+        }
+        record.id = static_cast<int64_t>(id);
+        record.createdAt = static_cast<int64_t>(createdAt);
+        record.room = room;
+        out.push_back(std::move(record));
+    }
+    return true;
+}
+
+MessageArchive::MessageArchive(const std::string &basePath) : basePath(basePath) {}
+
+MessageArchive::~MessageArchive() {}
+
+std::string MessageArchive::pathFor(int month) const {
+    return basePath + ".archive-" + std::to_string(month);
+}
+
+MessageArchive::MonthWriter::MonthWriter(MessageArchive &archive, int month) {
+    if (sqlite3_open(archive.pathFor(month).c_str(), &out) != SQLITE_OK) {
+        std::cerr << "Can't open archive: " << sqlite3_errmsg(out) << std::endl;
+        return;
+    }
+    // Readers of this month wait out the commit rather than fail.
+    sqlite3_busy_timeout(out, 3000);
+
+    const char* createSQL =
+        "CREATE TABLE IF NOT EXISTS chunks ("
+        "room TEXT NOT NULL, "
+        "first_id INTEGER NOT NULL, "
+        "last_id INTEGER NOT NULL, "
+        "count INTEGER NOT NULL, "
+        "raw_size INTEGER NOT NULL, "
+        "data BLOB NOT NULL, "
+        "PRIMARY KEY (room, first_id)"
+        ") WITHOUT ROWID;"
+        "CREATE VIRTUAL TABLE IF NOT EXISTS search USING fts5(content, room, sender, content='');";
+    char* errMsg = nullptr;
+    if (sqlite3_exec(out, createSQL, nullptr, nullptr, &errMsg) != SQLITE_OK ||
+        sqlite3_exec(out, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "SQL error (archive setup): " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return;
+    }
+
+    if (sqlite3_prepare_v2(out, "INSERT OR REPLACE INTO chunks VALUES (?, ?, ?, ?, ?, ?);", -1, &insert, nullptr) != SQLITE_OK ||
+        sqlite3_prepare_v2(out, "SELECT raw_size, data FROM chunks WHERE room = ? AND first_id = ?;", -1, &existing, nullptr) != SQLITE_OK ||
+        sqlite3_prepare_v2(out, "INSERT INTO search (search, rowid, content, room, sender) VALUES (?, ?, ?, ?, ?);",
+                           -1, &index, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for archiving: " << sqlite3_errmsg(out) << std::endl;
+        return;
+    }
+    ok = true;
+}
+
+MessageArchive::MonthWriter::~MonthWriter() {
+    sqlite3_finalize(insert);
+    sqlite3_finalize(existing);
+    sqlite3_finalize(index);
+    if (!committed) {
+        sqlite3_exec(out, "ROLLBACK;", nullptr, nullptr, nullptr);
+    }
+    sqlite3_close(out);
+}
+
+bool MessageArchive::MonthWriter::append(Record record) {
+    // A chunk holds consecutive messages of a single room.
+    if (!pending.empty() && (pending.size() == kChunkRecords || pending.front().room != record.room)) {
+        flush();
+    }
+    pending.push_back(std::move(record));
+    return ok;
+}
+
+bool MessageArchive::MonthWriter::flush() {
+    if (!ok || pending.empty()) {
+        pending.clear();
+        return ok;
+    }
+
+    // The index can only forget a message given the tokens it was added
+    // with, so a chunk being archived again first takes its old rows out.
+    auto indexRecords = [this](const char* command, const std::vector<Record> &records) {
+        for (const Record &record : records) {
+            sqlite3_bind_text(index, 1, command, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(index, 2, record.id);
+            sqlite3_bind_text(index, 3, record.content.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(index, 4, record.room.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(index, 5, record.sender.c_str(), -1, SQLITE_STATIC);
+            bool stored = sqlite3_step(index) == SQLITE_DONE;
+            sqlite3_reset(index);
+            if (!stored) {
+                std::cerr << "Failed to index archived message: " << sqlite3_errmsg(out) << std::endl;
+                return false;
+            }
+        }
+        return true;
+    };
+    sqlite3_bind_text(existing, 1, pending.front().room.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(existing, 2, pending.front().id);
+    if (sqlite3_step(existing) == SQLITE_ROW) {
+        std::vector<Record> previous;
+        ok = decodeChunk(static_cast<const Bytef*>(sqlite3_column_blob(existing, 1)), sqlite3_column_bytes(existing, 1),
+                         static_cast<uLongf>(sqlite3_column_int64(existing, 0)), pending.front().room, previous) &&
+             indexRecords("delete", previous);
+    }
+    sqlite3_reset(existing);
+    // A NULL command adds the row.
+    ok = ok && indexRecords(nullptr, pending);
+    if (!ok) {
+        pending.clear();
+        return false;
+    }
+
+    std::string raw;
+    for (const Record &record : pending) {
+        putU64(raw, static_cast<uint64_t>(record.id));
+        putU64(raw, static_cast<uint64_t>(record.createdAt));
+        putString(raw, record.sender);
+        putString(raw, record.content);
+        putString(raw, record.timestamp);
+    }
+    uLongf packedSize = compressBound(raw.size());
+    std::string packed(packedSize, '\0');
+    if (compress2(reinterpret_cast<Bytef*>(&packed[0]), &packedSize,
+                  reinterpret_cast<const Bytef*>(raw.data()), raw.size(), Z_BEST_COMPRESSION) != Z_OK) {
+        std::cerr << "Failed to compress archive chunk." << std::endl;
+        ok = false;
+    } else {
+        sqlite3_bind_text(insert, 1, pending.front().room.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(insert, 2, pending.front().id);
+        sqlite3_bind_int64(insert, 3, pending.back().id);
+        sqlite3_bind_int64(insert, 4, static_cast<sqlite3_int64>(pending.size()));
+        sqlite3_bind_int64(insert, 5, static_cast<sqlite3_int64>(raw.size()));
+        sqlite3_bind_blob(insert, 6, packed.data(), static_cast<int>(packedSize), SQLITE_STATIC);
+        if (sqlite3_step(insert) != SQLITE_DONE) {
+            std::cerr << "Failed to store archive chunk: " << sqlite3_errmsg(out) << std::endl;
+            ok = false;
+        }
+        sqlite3_reset(insert);
+    }
+    pending.clear();
+    return ok;
+}
+
+bool MessageArchive::MonthWriter::commit() {
+    if (!flush()) {
+        return false;
+    }
+    char* errMsg = nullptr;
+    if (sqlite3_exec(out, "COMMIT;", nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "SQL error (archive commit): " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return ok = false;
+    }
+    committed = true;
+    return true;
+}
+
+bool MessageArchive::readRoom(int month, const std::string &room, std::vector<Record> &out) {
+    std::shared_ptr<sqlite3> handle = reader(month);
+    if (!handle) {
+        return false;
+    }
+    sqlite3* in = handle.get();
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(in, "SELECT raw_size, data FROM chunks WHERE room = ? ORDER BY first_id;", -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for reading archive: " << sqlite3_errmsg(in) << std::endl;
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
+
+    bool ok = true;
+    while (ok && sqlite3_step(stmt) == SQLITE_ROW) {
+        ok = decodeChunk(static_cast<const Bytef*>(sqlite3_column_blob(stmt, 1)), sqlite3_column_bytes(stmt, 1),
+                         static_cast<uLongf>(sqlite3_column_int64(stmt, 0)), room, out);
+        if (!ok) {
+            std::cerr << "Corrupt archive chunk in " << pathFor(month) << std::endl;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+bool MessageArchive::searchRoom(int month, const std::string &room, const std::string &sender,
+                                const std::string &match, int limit, std::vector<Hit> &out) {
+    std::shared_ptr<sqlite3> handle = reader(month);
+    if (!handle) {
+        return false;
+    }
+    sqlite3* in = handle.get();
+
+    // Only content contributes to the score, as for the live index.
+    sqlite3_stmt* hits;
+    sqlite3_stmt* chunk;
+    if (sqlite3_prepare_v2(in, "SELECT rowid, bm25(search, 1.0, 0.0, 0.0) AS rank FROM search WHERE search MATCH ? "
+                               "ORDER BY rank;", -1, &hits, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for archive search: " << sqlite3_errmsg(in) << std::endl;
+        return false;
+    }
+    if (sqlite3_prepare_v2(in, "SELECT first_id, raw_size, data FROM chunks WHERE room = ? AND first_id <= ? "
+                               "ORDER BY first_id DESC LIMIT 1;", -1, &chunk, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for archive search: " << sqlite3_errmsg(in) << std::endl;
+        sqlite3_finalize(hits);
+        return false;
+    }
+    sqlite3_bind_text(hits, 1, match.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(chunk, 1, room.c_str(), -1, SQLITE_STATIC);
+
+    // Hits cluster in time, so keep the chunks already decoded.
+    std::map<int64_t, std::vector<Record>> decoded;
+    bool ok = true;
+    int found = 0;
+    while (ok && found < limit && sqlite3_step(hits) == SQLITE_ROW) {
+        int64_t id = sqlite3_column_int64(hits, 0);
+        double rank = sqlite3_column_double(hits, 1);
+
+        sqlite3_bind_int64(chunk, 2, id);
+        const std::vector<Record>* records = nullptr;
+        if (sqlite3_step(chunk) == SQLITE_ROW) {
+            int64_t firstId = sqlite3_column_int64(chunk, 0);
+            auto it = decoded.find(firstId);
+            if (it == decoded.end()) {
+                it = decoded.emplace(firstId, std::vector<Record>()).first;
+                ok = decodeChunk(static_cast<const Bytef*>(sqlite3_column_blob(chunk, 2)), sqlite3_column_bytes(chunk, 2),
+                                 static_cast<uLongf>(sqlite3_column_int64(chunk, 1)), room, it->second);
+                if (!ok) {
+                    std::cerr << "Corrupt archive chunk in " << pathFor(month) << std::endl;
+                }
+            }
+            records = &it->second;
+        }
+        sqlite3_reset(chunk);
+        if (!ok || !records) {
+            continue; // Another room's message whose name shares our tokens.
+        }
+
+        auto record = std::lower_bound(records->begin(), records->end(), id,
+                                       [](const Record &r, int64_t target) { return r.id < target; });
+        if (record == records->end() || record->id != id || (!sender.empty() && record->sender != sender)) {
+            continue;
+        }
+        out.push_back(Hit{*record, rank});
+        ++found;
+    }
+    sqlite3_finalize(chunk);
+    sqlite3_finalize(hits);
+    return ok;
+}
+
+bool MessageArchive::dropMonth(int month) {
+    closeReader(month);
+    std::string path = pathFor(month);
+    if (std::remove(path.c_str()) != 0) {
+        // Nothing to drop is not an error.
+        FILE* existing = std::fopen(path.c_str(), "rb");
+        if (existing) {
+            std::fclose(existing);
+            std::cerr << "Failed to remove archive " << path << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::shared_ptr<sqlite3> MessageArchive::reader(int month) {
+    std::lock_guard<std::mutex> lock(readersMutex);
+    auto it = readers.find(month);
+    if (it != readers.end()) {
+        return it->second;
+    }
+    // Serialized-mode handle: concurrent readRoom calls each prepare their own statement on it.
+    sqlite3* in = nullptr;
+    if (sqlite3_open_v2(pathFor(month).c_str(), &in, SQLITE_OPEN_READONLY | SQLITE_OPEN_FULLMUTEX, nullptr) != SQLITE_OK) {
+        std::cerr << "Can't open archive " << pathFor(month) << ": " << sqlite3_errmsg(in) << std::endl;
+        sqlite3_close(in);
+        return nullptr;
+    }
+    // Compaction may be rewriting this month; wait for it rather than read nothing.
+    sqlite3_busy_timeout(in, 3000);
+    std::shared_ptr<sqlite3> handle(in, sqlite3_close);
+    readers[month] = handle;
+    return handle;
+}
+
+void MessageArchive::closeReader(int month) {
+    std::lock_guard<std::mutex> lock(readersMutex);
+    readers.erase(month);
+}
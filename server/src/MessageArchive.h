@@ -0,0 +1,91 @@
+#ifndef MESSAGE_ARCHIVE_H
+#define MESSAGE_ARCHIVE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+
+// Read-only, compressed storage for months that have aged out of the live
+// messages table. Each month is its own SQLite file next to the main database
+// ("<dbFile>.archive-YYYYMM"), holding zlib-compressed chunks of one room's
+// messages keyed by (room, first_id), so reading a room touches only its own
+// chunks. A contentless full-text index beside the chunks holds each
+// message's tokens (not its text) under its id, so archived months stay
+// searchable. readRoom may run on any number of threads at once; MonthWriter and
+// dropMonth come from compaction, one at a time.
+class MessageArchive {
+public:
+    struct Record {
+        int64_t id;
+        int64_t createdAt;
+        std::string room;
+        std::string sender;
+        std::string content;
+        std::string timestamp;
+    };
+
+    // Streams one month into its archive file, holding at most one chunk in
+    // memory. Records must arrive sorted by room then id; none are visible to
+    // readers until commit() has synced the file, and a writer destroyed
+    // without committing leaves the file as it was. Rewriting the same
+    // messages replaces their chunks, so a month is safe to archive again.
+    class MonthWriter {
+    public:
+        MonthWriter(MessageArchive &archive, int month);
+        ~MonthWriter();
+        MonthWriter(const MonthWriter &) = delete;
+        MonthWriter &operator=(const MonthWriter &) = delete;
+
+        bool append(Record record);
+        bool commit();
+
+    private:
+        bool flush();
+
+        sqlite3* out = nullptr;
+        sqlite3_stmt* insert = nullptr;
+        sqlite3_stmt* existing = nullptr;
+        sqlite3_stmt* index = nullptr;
+        std::vector<Record> pending;
+        bool ok = false;
+        bool committed = false;
+    };
+
+    struct Hit {
+        Record record;
+        double rank;
+    };
+
+    explicit MessageArchive(const std::string &basePath);
+    ~MessageArchive();
+
+    // Append one room's archived messages for a month to out, in id order.
+    bool readRoom(int month, const std::string &room, std::vector<Record> &out);
+
+    // Append up to limit of a month's messages matching an FTS5 query to out,
+    // best bm25 rank first. The query sees columns content, room and sender;
+    // hits outside room, or from another sender when one is given, are dropped.
+    bool searchRoom(int month, const std::string &room, const std::string &sender, const std::string &match,
+                    int limit, std::vector<Hit> &out);
+
+    // Delete a month's archive file.
+    bool dropMonth(int month);
+
+    std::string pathFor(int month) const;
+
+private:
+    std::shared_ptr<sqlite3> reader(int month);
+    void closeReader(int month);
+
+    std::string basePath;
+    // Lazily opened read-only handles, one per month. A handle closes once
+    // dropped from the map and no read is still using it.
+    std::mutex readersMutex;
+    std::map<int, std::shared_ptr<sqlite3>> readers;
+};
+
+#endif // MESSAGE_ARCHIVE_H
@@ -0,0 +1,143 @@
+#ifndef MESSAGE_STORE_H
+#define MESSAGE_STORE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+// Tuning for whichever engine holds chat messages.
+struct StorageConfig {
+    enum Engine {
+        // Messages live in SQLite next to users, partitioned by month (SqliteMessageStore).
+        Sqlite,
+        // Messages live in an append-only segmented log (LogMessageStore).
+        Log
+    };
+    Engine engine = Sqlite;
+
+    // Sqlite: messages are partitioned by calendar month (UTC) of the time the
+    // server stored them. Recent months stay in the live messages table; older
+    // months are compacted into per-month archives.
+    // Months, counting the current one, kept in the live messages table.
+    int hotMonths = 3;
+    // Months of history kept at all; 0 keeps everything. Applies to both engines.
+    int retentionMonths = 0;
+    // Bytes of the live database SQLite may memory-map.
+    long long mmapBytes = 256LL * 1024 * 1024;
+    // Read-only connections for queries (history, search, logins), so they
+    // don't wait on the connection that writes. Used with either engine for users.
+    int readConnections = 4;
+
+    // Log: directory holding the segments; empty means "<dbFile>.log".
+    std::string logDirectory;
+    // Size each segment file is preallocated and mapped at.
+    std::size_t logSegmentBytes = 64 * 1024 * 1024;
+};
+
+// Calendar month helpers shared by the engines; months are written as YYYYMM
+// integers, in UTC.
+inline int monthOf(std::time_t t) {
+    std::tm parts;
+    gmtime_r(&t, &parts);
+    return (parts.tm_year + 1900) * 100 + parts.tm_mon + 1;
+}
+
+inline int addMonths(int month, int delta) {
+    int index = (month / 100) * 12 + (month % 100 - 1) + delta;
+    return (index / 12) * 100 + index % 12 + 1;
+}
+
+inline std::time_t monthStart(int month) {
+    std::tm parts = {};
+    parts.tm_year = month / 100 - 1900;
+    parts.tm_mon = month % 100 - 1;
+    parts.tm_mday = 1;
+    return timegm(&parts);
+}
+
+// First instant still inside the retention window, or 0 if everything is kept.
+inline std::time_t retentionCutoff(const StorageConfig &storage, std::time_t now) {
+    if (storage.retentionMonths <= 0) {
+        return 0;
+    }
+    return monthStart(addMonths(monthOf(now), -(storage.retentionMonths - 1)));
+}
+
+// Storage engine for chat messages. DatabaseManager forwards its message
+// functions here; users and authentication always stay in SQLite.
+// Implementations are safe to call from any thread.
+class MessageStore {
+public:
+    virtual ~MessageStore() {}
+
+    // Create or recover on-disk state. Called once from DatabaseManager::initDB.
+    virtual bool open() = 0;
+
+    // Store a message and report its sequence number (the engine's message
+    // id) in seq. A non-empty clientMsgId is the sender's idempotency key:
+    // if the sender already stored a message under it, nothing is stored and
+    // seq is that message's, with duplicate set.
+    virtual bool storeMessage(const std::string &room, const std::string &sender, const std::string &content,
+                              const std::string &timestamp, const std::string &clientMsgId,
+                              int64_t &seq, bool &duplicate) = 0;
+
+    bool storeMessage(const std::string &room, const std::string &sender,
+                      const std::string &content, const std::string &timestamp) {
+        int64_t seq;
+        bool duplicate;
+        return storeMessage(room, sender, content, timestamp, std::string(), seq, duplicate);
+    }
+
+    // Messages stored at or after since (unix seconds), oldest first. Each
+    // carries its sequence number as "seq".
+    virtual std::vector<nlohmann::json> getMessagesForRoom(const std::string &room, std::time_t since) = 0;
+
+    // The same messages, each serialized as it is sent to clients and paired
+    // with its sequence number. Engines that can write these straight out of
+    // storage override this to skip the JSON objects.
+    virtual std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+    historyFrames(const std::string &room, std::time_t since) {
+        std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>> frames;
+        for (const auto &message : getMessagesForRoom(room, since)) {
+            frames.emplace_back(message["seq"].get<int64_t>(), std::make_shared<const std::string>(message.dump()));
+        }
+        return frames;
+    }
+
+    // The room's newest limit messages as historyFrames returns them, oldest
+    // first. Engines override this to read only the tail.
+    virtual std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+    recentFrames(const std::string &room, std::size_t limit) {
+        auto frames = historyFrames(room, 0);
+        if (frames.size() > limit) {
+            frames.erase(frames.begin(), frames.end() - limit);
+        }
+        return frames;
+    }
+
+    // Up to limit rooms holding the most messages outside the archive,
+    // busiest first.
+    virtual std::vector<std::string> activeRooms(std::size_t limit) = 0;
+
+    // Whether searchMessages can find anything with this engine.
+    virtual bool supportsSearch() const { return true; }
+
+    // Ranked full-text search; engines without an index return nothing.
+    virtual std::vector<nlohmann::json> searchMessages(const std::string &room, const std::string &sender,
+                                                       const std::string &query, int limit, int offset) = 0;
+
+    // Age data out according to StorageConfig. Rooms that lost messages to
+    // retention are added to expiredRooms; archiving alone changes nothing
+    // a reader sees.
+    virtual bool compact(std::time_t now, std::vector<std::string> &expiredRooms) = 0;
+
+    // Make everything stored so far durable.
+    virtual bool flush() = 0;
+};
+
+#endif // MESSAGE_STORE_H
@@ -0,0 +1,94 @@
+#include "PresenceCoalescer.h"
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+PresenceCoalescer::PresenceCoalescer(int typing_timeout_ms) : typing_timeout_ms(typing_timeout_ms) {}
+
+void PresenceCoalescer::typing(const std::string &room, const std::string &user, bool active, int64_t now_ms) {
+    event_count++;
+    std::lock_guard<std::mutex> lock(mutex);
+    Room &state = rooms[room];
+    if (active) {
+        // A refresh only extends the indicator; it isn't news to anyone.
+        auto inserted = state.typing.emplace(user, now_ms + typing_timeout_ms);
+        if (inserted.second) {
+            state.typing_changed = true;
+            dirty.insert(room);
+            typing_rooms.insert(room);
+        } else {
+            inserted.first->second = now_ms + typing_timeout_ms;
+        }
+    } else if (state.typing.erase(user)) {
+        state.typing_changed = true;
+        dirty.insert(room);
+    }
+}
+
+void PresenceCoalescer::presence(const std::string &room, const std::string &user, bool online) {
+    event_count++;
+    std::lock_guard<std::mutex> lock(mutex);
+    Room &state = rooms[room];
+    // Coming and going within one window cancels out.
+    if (online) {
+        if (!state.went_offline.erase(user)) {
+            state.came_online.insert(user);
+        }
+    } else {
+        if (!state.came_online.erase(user)) {
+            state.went_offline.insert(user);
+        }
+        if (state.typing.erase(user)) {
+            state.typing_changed = true;
+        }
+    }
+    dirty.insert(room);
+}
+
+std::vector<std::pair<std::string, std::string>> PresenceCoalescer::flush(int64_t now_ms) {
+    std::vector<std::pair<std::string, std::string>> out;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = typing_rooms.begin(); it != typing_rooms.end(); ) {
+        Room &state = rooms[*it];
+        auto &typing = state.typing;
+        for (auto entry = typing.begin(); entry != typing.end(); ) {
+            if (entry->second <= now_ms) {
+                entry = typing.erase(entry);
+                state.typing_changed = true;
+                dirty.insert(*it);
+            } else {
+                ++entry;
+            }
+        }
+        it = typing.empty() ? typing_rooms.erase(it) : std::next(it);
+    }
+
+    out.reserve(dirty.size());
+    for (const auto &room : dirty) {
+        auto it = rooms.find(room);
+        Room &state = it->second;
+        // Presence that cancelled out within the window leaves nothing to send.
+        if (state.typing_changed || !state.came_online.empty() || !state.went_offline.empty()) {
+            json frame = {
+                {"type", "presence"},
+                {"room", room},
+                {"typing", json::array()},
+                {"online", state.came_online},
+                {"offline", state.went_offline}
+            };
+            for (const auto &entry : state.typing) {
+                frame["typing"].push_back(entry.first);
+            }
+            out.emplace_back(room, frame.dump());
+        }
+        state.typing_changed = false;
+        state.came_online.clear();
+        state.went_offline.clear();
+        if (state.typing.empty()) {
+            rooms.erase(it);
+        }
+    }
+    dirty.clear();
+    frame_count += out.size();
+    return out;
+}
@@ -0,0 +1,56 @@
+#ifndef PRESENCE_COALESCER_H
+#define PRESENCE_COALESCER_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Collects ephemeral room events (typing, online/offline) between flushes so
+// each room that changed gets one aggregated frame per flush, however many
+// events arrived. Nothing here is persisted. Thread-safe.
+//
+// A flushed frame looks like
+//   {"type":"presence","room":R,"typing":[...],"online":[...],"offline":[...]}
+// where "typing" is everyone typing in the room right now and "online" /
+// "offline" list who came and went since the previous frame.
+class PresenceCoalescer {
+public:
+    // Typing indicators lapse after this long without a refresh.
+    explicit PresenceCoalescer(int typing_timeout_ms = 5000);
+
+    void typing(const std::string &room, const std::string &user, bool active, int64_t now_ms);
+    void presence(const std::string &room, const std::string &user, bool online);
+
+    // One (room, frame) for each room with changes since the last flush.
+    std::vector<std::pair<std::string, std::string>> flush(int64_t now_ms);
+
+    // Events recorded and frames produced so far.
+    uint64_t events() const { return event_count; }
+    uint64_t frames() const { return frame_count; }
+
+private:
+    struct Room {
+        // User -> time their typing indicator lapses.
+        std::unordered_map<std::string, int64_t> typing;
+        std::set<std::string> came_online;
+        std::set<std::string> went_offline;
+        bool typing_changed = false;
+    };
+
+    int typing_timeout_ms;
+    std::mutex mutex;
+    std::unordered_map<std::string, Room> rooms;
+    std::unordered_set<std::string> dirty;
+    // Rooms with any typing indicator, checked for lapses on every flush.
+    std::unordered_set<std::string> typing_rooms;
+    std::atomic<uint64_t> event_count{0};
+    std::atomic<uint64_t> frame_count{0};
+};
+
+#endif // PRESENCE_COALESCER_H
@@ -0,0 +1,99 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Token bucket refilled at `rate` tokens per second and holding at most
+// `burst`. It is kept as a single timestamp (the time the bucket will next be
+// full, i.e. GCRA), so take() is one compare-and-swap and the bucket can be
+// shared across threads without a lock.
+class TokenBucket {
+public:
+    TokenBucket(double rate, int burst)
+        : interval_us(static_cast<int64_t>(1e6 / rate)),
+          tolerance_us(interval_us * (std::max(burst, 1) - 1)),
+          next_us(0) {}
+
+    // Take one token at now_us. Returns 0 on success, otherwise how many
+    // microseconds until a token will be available.
+    int64_t take(int64_t now_us) {
+        int64_t next = next_us.load(std::memory_order_relaxed);
+        for (;;) {
+            int64_t base = std::max(next, now_us);
+            if (base - now_us > tolerance_us) {
+                return base - now_us - tolerance_us;
+            }
+            if (next_us.compare_exchange_weak(next, base + interval_us, std::memory_order_relaxed)) {
+                return 0;
+            }
+        }
+    }
+
+    // True once the bucket has refilled completely.
+    bool full(int64_t now_us) const { return next_us.load(std::memory_order_relaxed) <= now_us; }
+
+private:
+    const int64_t interval_us;
+    const int64_t tolerance_us;
+    std::atomic<int64_t> next_us;
+};
+
+// Buckets shared by key (a username or a room), all with the same limits.
+// Lookups take a shard lock, so callers look a bucket up once and keep the
+// shared_ptr; the per-message take() stays lock-free. Buckets nobody holds
+// that have refilled are dropped as a shard grows.
+class RateLimiter {
+public:
+    // A rate of 0 disables the limiter; bucket() then returns null.
+    RateLimiter(double rate, int burst) : rate(rate), burst(burst), shards(kShards) {}
+
+    bool enabled() const { return rate > 0; }
+
+    std::shared_ptr<TokenBucket> bucket(const std::string &key, int64_t now_us) {
+        if (!enabled()) {
+            return nullptr;
+        }
+        Shard &shard = shards[std::hash<std::string>()(key) % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.buckets.find(key);
+        if (it != shard.buckets.end()) {
+            return it->second;
+        }
+        if (shard.buckets.size() >= shard.prune_at) {
+            for (auto entry = shard.buckets.begin(); entry != shard.buckets.end(); ) {
+                if (entry->second.use_count() == 1 && entry->second->full(now_us)) {
+                    entry = shard.buckets.erase(entry);
+                } else {
+                    ++entry;
+                }
+            }
+            shard.prune_at = std::max<std::size_t>(kPruneThreshold, shard.buckets.size() * 2);
+        }
+        auto created = std::make_shared<TokenBucket>(rate, burst);
+        shard.buckets.emplace(key, created);
+        return created;
+    }
+
+private:
+    static const std::size_t kShards = 16;
+    static const std::size_t kPruneThreshold = 1024;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<TokenBucket>> buckets;
+        std::size_t prune_at = kPruneThreshold;
+    };
+
+    double rate;
+    int burst;
+    std::vector<Shard> shards;
+};
+
+#endif // RATE_LIMITER_H
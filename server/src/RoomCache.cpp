@@ -0,0 +1,165 @@
+#include "RoomCache.h"
+#include <algorithm>
+#include <iterator>
+
+uint64_t RoomCache::generation() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return current_generation;
+}
+
+bool RoomCache::begin_load(const std::string &room, uint64_t generation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (generation != current_generation || total_bytes >= budget_bytes || room_map.count(room)) {
+        return false;
+    }
+    Room &entry = room_map[room];
+    entry.generation = generation;
+    entry.last_used = ++use_clock;
+    return true;
+}
+
+bool RoomCache::finish_load(const std::string &room, uint64_t generation,
+                            std::vector<std::pair<int64_t, Frame>> frames) {
+    std::size_t loaded_bytes = 0;
+    for (const auto &frame : frames) {
+        loaded_bytes += frame.second->size() + kFrameOverhead;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = room_map.find(room);
+    if (it == room_map.end() || it->second.loaded || it->second.generation != generation) {
+        return false;
+    }
+    Room &entry = it->second;
+    if (entry.stale || total_bytes + loaded_bytes > budget_bytes) {
+        total_bytes -= entry.bytes;
+        room_map.erase(it);
+        return false;
+    }
+    // Appends that arrived during the read; the read may already hold some.
+    std::deque<std::pair<int64_t, Frame>> appended;
+    appended.swap(entry.frames);
+    entry.frames.assign(std::make_move_iterator(frames.begin()), std::make_move_iterator(frames.end()));
+    entry.bytes += loaded_bytes;
+    total_bytes += loaded_bytes;
+    for (auto &frame : appended) {
+        auto at = std::lower_bound(entry.frames.begin(), entry.frames.end(), frame.first,
+                                   [](const std::pair<int64_t, Frame> &held, int64_t seq) { return held.first < seq; });
+        if (at != entry.frames.end() && at->first == frame.first) {
+            std::size_t size = frame.second->size() + kFrameOverhead;
+            entry.bytes -= size;
+            total_bytes -= size;
+            continue;
+        }
+        entry.frames.emplace(at, frame.first, std::move(frame.second));
+    }
+    trim(entry);
+    entry.loaded = true;
+    return true;
+}
+
+bool RoomCache::snapshot(const std::string &room, std::vector<Frame> &frames) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = room_map.find(room);
+    if (it == room_map.end() || !it->second.loaded) {
+        return false;
+    }
+    it->second.last_used = ++use_clock;
+    frames.reserve(frames.size() + it->second.frames.size());
+    for (const auto &frame : it->second.frames) {
+        frames.push_back(frame.second);
+    }
+    return true;
+}
+
+bool RoomCache::tracks(const std::string &room) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return room_map.count(room) > 0;
+}
+
+void RoomCache::append(const std::string &room, int64_t seq, Frame frame) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = room_map.find(room);
+    if (it == room_map.end()) {
+        return;
+    }
+    std::size_t size = frame->size() + kFrameOverhead;
+    it->second.bytes += size;
+    total_bytes += size;
+    insert_ordered(it->second, seq, std::move(frame));
+    if (it->second.loaded) {
+        trim(it->second);
+    }
+    evict_over_budget();
+}
+
+uint64_t RoomCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    room_map.clear();
+    total_bytes = 0;
+    return ++current_generation;
+}
+
+bool RoomCache::invalidate(const std::string &room) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = room_map.find(room);
+    if (it == room_map.end()) {
+        return false;
+    }
+    if (!it->second.loaded) {
+        it->second.stale = true;
+        return false;
+    }
+    total_bytes -= it->second.bytes;
+    room_map.erase(it);
+    return true;
+}
+
+std::size_t RoomCache::bytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return total_bytes;
+}
+
+std::size_t RoomCache::rooms() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::size_t loaded = 0;
+    for (const auto &room : room_map) {
+        loaded += room.second.loaded;
+    }
+    return loaded;
+}
+
+// Messages stored concurrently can be appended slightly out of order; they
+// land within a few slots of the back.
+void RoomCache::insert_ordered(Room &room, int64_t seq, Frame frame) {
+    auto position = room.frames.end();
+    while (position != room.frames.begin() && std::prev(position)->first > seq) {
+        --position;
+    }
+    room.frames.emplace(position, seq, std::move(frame));
+}
+
+void RoomCache::trim(Room &room) {
+    while (max_frames > 0 && room.frames.size() > max_frames) {
+        std::size_t size = room.frames.front().second->size() + kFrameOverhead;
+        room.bytes -= size;
+        total_bytes -= size;
+        room.frames.pop_front();
+    }
+}
+
+void RoomCache::evict_over_budget() {
+    while (total_bytes > budget_bytes) {
+        auto victim = room_map.end();
+        for (auto it = room_map.begin(); it != room_map.end(); ++it) {
+            if (it->second.loaded && (victim == room_map.end() || it->second.last_used < victim->second.last_used)) {
+                victim = it;
+            }
+        }
+        if (victim == room_map.end()) {
+            return;
+        }
+        total_bytes -= victim->second.bytes;
+        room_map.erase(victim);
+    }
+}
@@ -0,0 +1,90 @@
+#ifndef ROOM_CACHE_H
+#define ROOM_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Rooms' recent history held as ready-to-send frames, so a join into a busy
+// room is answered from memory instead of a database read. Rooms are loaded
+// at startup (WebSocketServer::start_preload) and then kept current by
+// appending each message the server stores in them. Each room keeps at most
+// its newest max_frames frames (0: all of them), dropping the oldest as new
+// ones arrive. Total frame bytes stay under a budget; appends that push past
+// it evict the least recently joined rooms, which fall back to the database.
+// Thread-safe.
+class RoomCache {
+public:
+    using Frame = std::shared_ptr<const std::string>;
+
+    explicit RoomCache(std::size_t budget_bytes, std::size_t max_frames = 0)
+        : budget_bytes(budget_bytes), max_frames(max_frames) {}
+
+    // Bumped by every clear(). A load belongs to the generation it began in,
+    // so a preload overtaken by a clear can neither claim nor install rooms.
+    uint64_t generation();
+
+    // Claim a room before reading it from the store, so messages stored
+    // meanwhile are kept for finish_load. False if the room is already
+    // claimed, the budget is spent or generation is no longer current.
+    bool begin_load(const std::string &room, uint64_t generation);
+    // Install what was read after begin_load, oldest first, merging anything
+    // appended since by seq. False, and the room is dropped, if it doesn't
+    // fit the budget; false too if it was cleared in the meantime.
+    bool finish_load(const std::string &room, uint64_t generation, std::vector<std::pair<int64_t, Frame>> frames);
+
+    // A loaded room's frames, oldest first. False if the room isn't loaded.
+    bool snapshot(const std::string &room, std::vector<Frame> &frames);
+
+    // Whether messages stored in this room should be appended.
+    bool tracks(const std::string &room);
+    void append(const std::string &room, int64_t seq, Frame frame);
+
+    // Drops every room and returns the new generation.
+    uint64_t clear();
+    // Drops one room whose stored history changed under it. True if it was
+    // loaded, so the caller can load it again; a load still in flight is
+    // discarded by its finish_load instead.
+    bool invalidate(const std::string &room);
+
+    std::size_t bytes();
+    std::size_t rooms();
+
+private:
+    // Rough heap cost of a cached frame beyond its text: the string and
+    // shared_ptr control block plus the deque slot.
+    static const std::size_t kFrameOverhead = 80;
+
+    struct Room {
+        bool loaded = false;
+        // Set by invalidate() while loading: finish_load drops the room.
+        bool stale = false;
+        uint64_t generation = 0;
+        // (seq, frame), ascending seq.
+        std::deque<std::pair<int64_t, Frame>> frames;
+        std::size_t bytes = 0;
+        uint64_t last_used = 0;
+    };
+
+    static void insert_ordered(Room &room, int64_t seq, Frame frame);
+    // Drop the room's oldest frames beyond max_frames.
+    void trim(Room &room);
+    void evict_over_budget();
+
+    std::size_t budget_bytes;
+    std::size_t max_frames;
+    std::mutex mutex;
+    std::unordered_map<std::string, Room> room_map;
+    std::size_t total_bytes = 0;
+    uint64_t use_clock = 0;
+    uint64_t current_generation = 0;
+};
+
+#endif // ROOM_CACHE_H
@@ -0,0 +1,752 @@
+#include "SqliteMessageStore.h"
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <cctype>
+#include <limits>
+#include <algorithm>
+#include <set>
+
+// Rows read per page while streaming a month into its archive.
+static const int kCompactPageRows = 1000;
+
+// A stored message as clients receive it.
+static nlohmann::json messageJson(const std::string &room, int64_t seq, const char* sender, const char* content,
+                                  const char* timestamp) {
+    return nlohmann::json{
+        {"type", "message"},
+        {"room", room},
+        {"from", sender},
+        {"content", content},
+        {"timestamp", timestamp},
+        {"seq", seq}
+    };
+}
+
+// Turn free-form user input into an FTS5 query that ANDs each word as a
+// literal phrase, so operators and stray quotes can't cause syntax errors.
+static std::string toFtsQuery(const std::string &text) {
+    std::string query;
+    std::istringstream words(text);
+    std::string word;
+    while (words >> word) {
+        if (!query.empty()) {
+            query += ' ';
+        }
+        query += '"';
+        for (char c : word) {
+            if (c == '"') {
+                query += '"';
+            }
+            query += c;
+        }
+        query += '"';
+    }
+    return query;
+}
+
+// Quote a whole value as one FTS5 phrase scoped to a column, or return an
+// empty string if the tokenizer would find no tokens in it.
+static std::string toFtsColumnFilter(const std::string &column, const std::string &value) {
+    bool hasToken = false;
+    std::string phrase = "\"";
+    for (char c : value) {
+        unsigned char u = static_cast<unsigned char>(c);
+        if (std::isalnum(u) || u >= 0x80) {
+            hasToken = true;
+        }
+        if (c == '"') {
+            phrase += '"';
+        }
+        phrase += c;
+    }
+    phrase += '"';
+    return hasToken ? " AND " + column + " : " + phrase : "";
+}
+
+SqliteMessageStore::SqliteMessageStore(sqlite3 *&db, std::mutex &dbMutex, SqliteReadPool &readers,
+                                       const std::string &dbFile, const StorageConfig &storage)
+    : db(db), dbMutex(dbMutex), readers(readers), storage(storage), archive(dbFile) {}
+
+bool SqliteMessageStore::open() {
+    std::lock_guard<std::mutex> lock(dbMutex);
+
+    // Recent partitions are the hot set; let SQLite map them instead of copying pages.
+    std::string mmapSQL = "PRAGMA mmap_size=" + std::to_string(storage.mmapBytes) + ";";
+    sqlite3_exec(db, mmapSQL.c_str(), nullptr, nullptr, nullptr);
+
+    char* errMsg = nullptr;
+    const int maxRetries = 3;
+
+    // Helper lambda for executing a query with retry logic
+    auto execWithRetry = [&](const char* sql) -> int {
+        int result;
+        for (int i = 0; i < maxRetries; i++) {
+            result = sqlite3_exec(db, sql, nullptr, nullptr, &errMsg);
+            if (result == SQLITE_BUSY) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            } else {
+                break;
+            }
+        }
+        return result;
+    };
+
+    int rc = execWithRetry("BEGIN TRANSACTION;");
+    if (rc != SQLITE_OK) {
+        std::cerr << "SQL error (begin transaction): " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return false;
+    }
+
+    // Create the messages table
+    const char* createMessagesSQL =
+        "CREATE TABLE IF NOT EXISTS messages ("
+        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "room TEXT NOT NULL, "
+        "sender TEXT NOT NULL, "
+        "content TEXT NOT NULL, "
+        "timestamp TEXT NOT NULL, "
+        "created_at INTEGER NOT NULL DEFAULT 0, "
+        "client_msg_id TEXT"
+        ");";
+    rc = execWithRetry(createMessagesSQL);
+    if (rc != SQLITE_OK) {
+        std::cerr << "SQL error (messages table creation): " << errMsg << std::endl;
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_free(errMsg);
+        return false;
+    }
+
+    // Databases from before partitioning lack created_at; add it and backfill
+    // from the client timestamp where that parses, else from now.
+    bool hasCreatedAt = false;
+    bool hasClientMsgId = false;
+    sqlite3_stmt* columns;
+    if (sqlite3_prepare_v2(db, "PRAGMA table_info(messages);", -1, &columns, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(columns) == SQLITE_ROW) {
+            std::string column = reinterpret_cast<const char*>(sqlite3_column_text(columns, 1));
+            hasCreatedAt = hasCreatedAt || column == "created_at";
+            hasClientMsgId = hasClientMsgId || column == "client_msg_id";
+        }
+        sqlite3_finalize(columns);
+    }
+    if (!hasCreatedAt) {
+        rc = execWithRetry(
+            "ALTER TABLE messages ADD COLUMN created_at INTEGER NOT NULL DEFAULT 0;"
+            "UPDATE messages SET created_at = COALESCE(CAST(strftime('%s', timestamp) AS INTEGER), "
+            "CAST(strftime('%s', 'now') AS INTEGER));");
+    }
+    // Older databases also predate idempotent submission.
+    if (rc == SQLITE_OK && !hasClientMsgId) {
+        rc = execWithRetry("ALTER TABLE messages ADD COLUMN client_msg_id TEXT;");
+    }
+
+    // Room reads walk (room, id); partition moves walk created_at. The
+    // archive index records which archived months hold each room.
+    if (rc == SQLITE_OK) {
+        rc = execWithRetry(
+            "CREATE INDEX IF NOT EXISTS messages_room_id ON messages (room, id);"
+            "CREATE INDEX IF NOT EXISTS messages_created_at ON messages (created_at);"
+            // A sender's client message id names one message; messages sent
+            // without one are exempt.
+            "CREATE UNIQUE INDEX IF NOT EXISTS messages_client_msg_id ON messages (sender, client_msg_id) "
+            "WHERE client_msg_id IS NOT NULL;"
+            "CREATE TABLE IF NOT EXISTS archive_index ("
+            "room TEXT NOT NULL, "
+            "month INTEGER NOT NULL, "
+            "PRIMARY KEY (room, month)"
+            ") WITHOUT ROWID;");
+    }
+    if (rc != SQLITE_OK) {
+        std::cerr << "SQL error (partition setup): " << errMsg << std::endl;
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_free(errMsg);
+        return false;
+    }
+
+    // Full-text index over message content. It is an external-content table,
+    // so the text lives only in messages; triggers keep the two in sync.
+    bool ftsExists = false;
+    sqlite3_stmt* probe;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'messages_fts';",
+                           -1, &probe, nullptr) == SQLITE_OK) {
+        ftsExists = sqlite3_step(probe) == SQLITE_ROW;
+        sqlite3_finalize(probe);
+    }
+    const char* createSearchSQL =
+        "CREATE VIRTUAL TABLE IF NOT EXISTS messages_fts USING fts5("
+        "content, room, sender, content='messages', content_rowid='id'"
+        ");"
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_insert AFTER INSERT ON messages BEGIN "
+        "INSERT INTO messages_fts(rowid, content, room, sender) VALUES (new.id, new.content, new.room, new.sender); "
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_delete AFTER DELETE ON messages BEGIN "
+        "INSERT INTO messages_fts(messages_fts, rowid, content, room, sender) "
+        "VALUES ('delete', old.id, old.content, old.room, old.sender); "
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS messages_fts_update AFTER UPDATE ON messages BEGIN "
+        "INSERT INTO messages_fts(messages_fts, rowid, content, room, sender) "
+        "VALUES ('delete', old.id, old.content, old.room, old.sender); "
+        "INSERT INTO messages_fts(rowid, content, room, sender) VALUES (new.id, new.content, new.room, new.sender); "
+        "END;";
+    rc = execWithRetry(createSearchSQL);
+    if (rc == SQLITE_OK && !ftsExists) {
+        // Index whatever history predates the search table.
+        rc = execWithRetry("INSERT INTO messages_fts(messages_fts) VALUES ('rebuild');");
+    }
+    if (rc != SQLITE_OK) {
+        std::cerr << "SQL error (search index creation): " << errMsg << std::endl;
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_free(errMsg);
+        return false;
+    }
+
+    rc = execWithRetry("COMMIT;");
+    if (rc != SQLITE_OK) {
+        std::cerr << "SQL error (commit transaction): " << errMsg << std::endl;
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_free(errMsg);
+        return false;
+    }
+    return true;
+}
+
+bool SqliteMessageStore::storeMessage(const std::string &room, const std::string &sender, const std::string &content,
+                                      const std::string &timestamp, const std::string &clientMsgId,
+                                      int64_t &seq, bool &duplicate) {
+    std::lock_guard<std::mutex> lock(dbMutex);
+    duplicate = false;
+    sqlite3_busy_timeout(db, 3000);
+
+    const int maxRetries = 3;
+    const int retryDelayMs = 100;
+
+    for (int attempt = 0; attempt < maxRetries; ++attempt) {
+        char* errMsg = nullptr;
+
+        int rc = sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg);
+        if (rc == SQLITE_BUSY) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
+            continue;
+        } else if (rc != SQLITE_OK) {
+            std::cerr << "SQL error (begin transaction): " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+
+        const char* sql = "INSERT INTO messages (room, sender, content, timestamp, created_at, client_msg_id) "
+                          "VALUES (?, ?, ?, ?, ?, ?);";
+        sqlite3_stmt* stmt;
+        rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
+        if (rc != SQLITE_OK) {
+            std::cerr << "Failed to prepare statement for storing message: " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+
+        sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, sender.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, content.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 4, timestamp.c_str(), -1, SQLITE_STATIC);
+        // The partition key is server time; client timestamps can't be trusted to be monotonic.
+        sqlite3_bind_int64(stmt, 5, static_cast<sqlite3_int64>(std::time(nullptr)));
+        if (clientMsgId.empty()) {
+            sqlite3_bind_null(stmt, 6);
+        } else {
+            sqlite3_bind_text(stmt, 6, clientMsgId.c_str(), -1, SQLITE_STATIC);
+        }
+
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+
+        // The unique index caught a resubmission: answer with the original.
+        if (rc == SQLITE_CONSTRAINT && !clientMsgId.empty()) {
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            sqlite3_stmt* existing;
+            if (sqlite3_prepare_v2(db, "SELECT id FROM messages WHERE sender = ? AND client_msg_id = ?;",
+                                   -1, &existing, nullptr) != SQLITE_OK) {
+                std::cerr << "Failed to prepare duplicate lookup: " << sqlite3_errmsg(db) << std::endl;
+                return false;
+            }
+            sqlite3_bind_text(existing, 1, sender.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(existing, 2, clientMsgId.c_str(), -1, SQLITE_STATIC);
+            bool found = sqlite3_step(existing) == SQLITE_ROW;
+            if (found) {
+                seq = sqlite3_column_int64(existing, 0);
+                duplicate = true;
+            }
+            sqlite3_finalize(existing);
+            return found;
+        }
+
+        if (rc == SQLITE_BUSY) {
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
+            continue;
+        } else if (rc != SQLITE_DONE) {
+            std::cerr << "Failed to store message: " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        seq = sqlite3_last_insert_rowid(db);
+
+        rc = sqlite3_exec(db, "COMMIT;", nullptr, nullptr, &errMsg);
+        if (rc == SQLITE_BUSY) {
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            std::this_thread::sleep_for(std::chrono::milliseconds(retryDelayMs));
+            continue;
+        } else if (rc != SQLITE_OK) {
+            std::cerr << "SQL error (commit transaction): " << errMsg << std::endl;
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            sqlite3_free(errMsg);
+            return false;
+        }
+
+        return true;
+    }
+
+    std::cerr << "Failed to store message after multiple retries due to database lock." << std::endl;
+    return false;
+}
+
+std::vector<nlohmann::json> SqliteMessageStore::getMessagesForRoom(const std::string &room, std::time_t since) {
+    SqliteReadPool::Lease lease = readers.acquire();
+    sqlite3* reader = lease.get();
+    std::vector<nlohmann::json> messages;
+
+    char* errMsg = nullptr;
+    int rc = sqlite3_exec(reader, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg);
+    if (rc != SQLITE_OK) {
+        std::cerr << "SQL error (begin transaction): " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return messages;
+    }
+
+    // Archived months first: the index names only the months holding this room.
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(reader, "SELECT month FROM archive_index WHERE room = ? AND month >= ? ORDER BY month;",
+                            -1, &stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for loading archives: " << sqlite3_errmsg(reader) << std::endl;
+        sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return messages;
+    }
+    sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, since > 0 ? monthOf(since) : 0);
+    std::vector<int> months;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        months.push_back(sqlite3_column_int(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+    for (int month : months) {
+        std::vector<MessageArchive::Record> records;
+        archive.readRoom(month, room, records);
+        for (const auto &record : records) {
+            if (record.createdAt >= since) {
+                messages.push_back(messageJson(room, record.id, record.sender.c_str(), record.content.c_str(),
+                                          record.timestamp.c_str()));
+            }
+        }
+    }
+
+    const char* sql = "SELECT id, sender, content, timestamp FROM messages WHERE room = ? AND created_at >= ? ORDER BY id ASC;";
+    rc = sqlite3_prepare_v2(reader, sql, -1, &stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for loading messages: " << sqlite3_errmsg(reader) << std::endl;
+        sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return messages;
+    }
+
+    sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(since));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char* senderText = sqlite3_column_text(stmt, 1);
+        const unsigned char* contentText = sqlite3_column_text(stmt, 2);
+        const unsigned char* timestampText = sqlite3_column_text(stmt, 3);
+        messages.push_back(messageJson(room, sqlite3_column_int64(stmt, 0),
+                                  reinterpret_cast<const char*>(senderText),
+                                  reinterpret_cast<const char*>(contentText),
+                                  reinterpret_cast<const char*>(timestampText)));
+    }
+    sqlite3_finalize(stmt);
+
+    rc = sqlite3_exec(reader, "COMMIT;", nullptr, nullptr, &errMsg);
+    if (rc != SQLITE_OK) {
+        std::cerr << "SQL error (commit transaction): " << errMsg << std::endl;
+        sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_free(errMsg);
+        return messages;
+    }
+    return messages;
+}
+
+std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+SqliteMessageStore::recentFrames(const std::string &room, std::size_t limit) {
+    SqliteReadPool::Lease lease = readers.acquire();
+    sqlite3* reader = lease.get();
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>> frames;
+    if (limit == 0) {
+        return frames;
+    }
+    auto frame = [&room](int64_t seq, const char* sender, const char* content, const char* timestamp) {
+        return std::make_pair(seq, std::make_shared<const std::string>(
+                                       messageJson(room, seq, sender, content, timestamp).dump()));
+    };
+
+    char* errMsg = nullptr;
+    if (sqlite3_exec(reader, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "SQL error (begin transaction): " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        return frames;
+    }
+
+    // Collected newest first, then reversed.
+    sqlite3_stmt* stmt;
+    const char* sql = "SELECT id, sender, content, timestamp FROM messages WHERE room = ? ORDER BY id DESC LIMIT ?;";
+    if (sqlite3_prepare_v2(reader, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for recent messages: " << sqlite3_errmsg(reader) << std::endl;
+        sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return frames;
+    }
+    sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(std::min<std::size_t>(limit, std::numeric_limits<sqlite3_int64>::max())));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        frames.push_back(frame(sqlite3_column_int64(stmt, 0),
+                               reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)),
+                               reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)),
+                               reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3))));
+    }
+    sqlite3_finalize(stmt);
+
+    // Archived months, newest first, until the limit is met.
+    if (frames.size() < limit &&
+        sqlite3_prepare_v2(reader, "SELECT month FROM archive_index WHERE room = ? ORDER BY month DESC;",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
+        std::vector<int> months;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            months.push_back(sqlite3_column_int(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+        for (int month : months) {
+            std::vector<MessageArchive::Record> records;
+            archive.readRoom(month, room, records);
+            for (auto it = records.rbegin(); it != records.rend() && frames.size() < limit; ++it) {
+                frames.push_back(frame(it->id, it->sender.c_str(), it->content.c_str(), it->timestamp.c_str()));
+            }
+            if (frames.size() == limit) {
+                break;
+            }
+        }
+    }
+
+    sqlite3_exec(reader, "COMMIT;", nullptr, nullptr, nullptr);
+    std::reverse(frames.begin(), frames.end());
+    return frames;
+}
+
+std::vector<std::string> SqliteMessageStore::activeRooms(std::size_t limit) {
+    SqliteReadPool::Lease lease = readers.acquire();
+    sqlite3* reader = lease.get();
+    std::vector<std::string> rooms;
+    sqlite3_stmt* stmt;
+    // Counted off the (room, id) index without touching the table.
+    if (sqlite3_prepare_v2(reader, "SELECT room FROM messages GROUP BY room ORDER BY COUNT(*) DESC LIMIT ?;",
+                           -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for active rooms: " << sqlite3_errmsg(reader) << std::endl;
+        return rooms;
+    }
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(limit));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        rooms.push_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+    }
+    sqlite3_finalize(stmt);
+    return rooms;
+}
+
+bool SqliteMessageStore::compact(std::time_t now, std::vector<std::string> &expiredRooms) {
+    int current = monthOf(now);
+    int hotFrom = addMonths(current, -(std::max(storage.hotMonths, 1) - 1));
+    int keepFrom = storage.retentionMonths > 0 ? addMonths(current, -(storage.retentionMonths - 1)) : 0;
+
+    // Months in the live table that have left the hot window, oldest first.
+    std::vector<int> coldMonths;
+    {
+        SqliteReadPool::Lease lease = readers.acquire();
+        sqlite3* reader = lease.get();
+        sqlite3_stmt* stmt;
+        const char* sql =
+            "SELECT DISTINCT CAST(strftime('%Y%m', created_at, 'unixepoch') AS INTEGER) "
+            "FROM messages WHERE created_at < ? ORDER BY 1;";
+        if (sqlite3_prepare_v2(reader, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "Failed to prepare statement for compaction: " << sqlite3_errmsg(reader) << std::endl;
+            return false;
+        }
+        sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(monthStart(hotFrom)));
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            coldMonths.push_back(sqlite3_column_int(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    for (int month : coldMonths) {
+        if (month < keepFrom) {
+            continue; // Past retention; deleted below rather than archived.
+        }
+        sqlite3_int64 from = monthStart(month);
+        sqlite3_int64 to = monthStart(addMonths(month, 1));
+
+        // Stream the month into its archive a page at a time off a read
+        // connection, so neither the rows nor the writer's lock are held while
+        // compressing and syncing. New messages are stamped with the current
+        // time and never land in a cold month, so pages see a stable set.
+        MessageArchive::MonthWriter writer(archive, month);
+        std::set<std::string> rooms;
+        std::string lastRoom;
+        sqlite3_int64 lastId = 0;
+        std::size_t archived = 0;
+        for (;;) {
+            SqliteReadPool::Lease lease = readers.acquire();
+            sqlite3* reader = lease.get();
+            sqlite3_stmt* stmt;
+            const char* sql =
+                "SELECT id, created_at, room, sender, content, timestamp FROM messages "
+                "WHERE created_at >= ?1 AND created_at < ?2 AND (room > ?3 OR (room = ?3 AND id > ?4)) "
+                "ORDER BY room, id LIMIT ?5;";
+            if (sqlite3_prepare_v2(reader, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+                std::cerr << "Failed to prepare statement for compaction: " << sqlite3_errmsg(reader) << std::endl;
+                return false;
+            }
+            sqlite3_bind_int64(stmt, 1, from);
+            sqlite3_bind_int64(stmt, 2, to);
+            sqlite3_bind_text(stmt, 3, lastRoom.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(stmt, 4, lastId);
+            sqlite3_bind_int(stmt, 5, kCompactPageRows);
+            int rows = 0;
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                MessageArchive::Record record;
+                record.id = sqlite3_column_int64(stmt, 0);
+                record.createdAt = sqlite3_column_int64(stmt, 1);
+                record.room = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+                record.sender = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+                record.content = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4));
+                record.timestamp = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5));
+                if (record.room != lastRoom) {
+                    rooms.insert(record.room);
+                    lastRoom = record.room;
+                }
+                lastId = record.id;
+                ++rows;
+                if (!writer.append(std::move(record))) {
+                    sqlite3_finalize(stmt);
+                    return false;
+                }
+            }
+            sqlite3_finalize(stmt);
+            archived += rows;
+            if (rows < kCompactPageRows) {
+                break;
+            }
+        }
+
+        // The archive is written and synced before the live rows go, so a crash
+        // in between only means this month is archived again next time.
+        if (!writer.commit()) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(dbMutex);
+        char* errMsg = nullptr;
+        if (sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, &errMsg) != SQLITE_OK) {
+            std::cerr << "SQL error (begin transaction): " << errMsg << std::endl;
+            sqlite3_free(errMsg);
+            return false;
+        }
+        sqlite3_stmt* stmt;
+        bool ok = sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO archive_index (room, month) VALUES (?, ?);",
+                                     -1, &stmt, nullptr) == SQLITE_OK;
+        for (auto it = rooms.begin(); ok && it != rooms.end(); ++it) {
+            sqlite3_bind_text(stmt, 1, it->c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 2, month);
+            ok = sqlite3_step(stmt) == SQLITE_DONE;
+            sqlite3_reset(stmt);
+        }
+        sqlite3_finalize(stmt);
+        if (ok) {
+            ok = sqlite3_prepare_v2(db, "DELETE FROM messages WHERE created_at >= ? AND created_at < ?;",
+                                    -1, &stmt, nullptr) == SQLITE_OK;
+            if (ok) {
+                sqlite3_bind_int64(stmt, 1, from);
+                sqlite3_bind_int64(stmt, 2, to);
+                ok = sqlite3_step(stmt) == SQLITE_DONE;
+                sqlite3_finalize(stmt);
+            }
+        }
+        if (!ok || sqlite3_exec(db, "COMMIT;", nullptr, nullptr, &errMsg) != SQLITE_OK) {
+            std::cerr << "Failed to compact month " << month << ": " << sqlite3_errmsg(db) << std::endl;
+            sqlite3_free(errMsg);
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        std::cout << "[Storage] Archived " << archived << " messages from " << month << "." << std::endl;
+    }
+
+    if (keepFrom == 0) {
+        return true;
+    }
+
+    // Retention: drop whole archived months, then any live rows older than the window.
+    std::lock_guard<std::mutex> lock(dbMutex);
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "SELECT DISTINCT month FROM archive_index WHERE month < ?;", -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for retention: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    sqlite3_bind_int(stmt, 1, keepFrom);
+    std::vector<int> expired;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        expired.push_back(sqlite3_column_int(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+
+    // The rooms about to lose messages, for callers holding copies of them.
+    const char* roomsSQL =
+        "SELECT room FROM archive_index WHERE month < ?1 "
+        "UNION SELECT DISTINCT room FROM messages WHERE created_at < ?2;";
+    if (sqlite3_prepare_v2(db, roomsSQL, -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for retention: " << sqlite3_errmsg(db) << std::endl;
+        return false;
+    }
+    sqlite3_bind_int(stmt, 1, keepFrom);
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(monthStart(keepFrom)));
+    std::vector<std::string> rooms;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        rooms.push_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
+    }
+    sqlite3_finalize(stmt);
+
+    std::string retentionSQL =
+        "BEGIN TRANSACTION;"
+        "DELETE FROM archive_index WHERE month < " + std::to_string(keepFrom) + ";"
+        "DELETE FROM messages WHERE created_at < " + std::to_string(static_cast<long long>(monthStart(keepFrom))) + ";"
+        "COMMIT;";
+    char* errMsg = nullptr;
+    if (sqlite3_exec(db, retentionSQL.c_str(), nullptr, nullptr, &errMsg) != SQLITE_OK) {
+        std::cerr << "SQL error (retention): " << errMsg << std::endl;
+        sqlite3_free(errMsg);
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return false;
+    }
+    expiredRooms.insert(expiredRooms.end(), rooms.begin(), rooms.end());
+    for (int month : expired) {
+        archive.dropMonth(month);
+        std::cout << "[Storage] Dropped archived month " << month << " past retention." << std::endl;
+    }
+    return true;
+}
+
+std::vector<nlohmann::json> SqliteMessageStore::searchMessages(const std::string &room, const std::string &sender,
+                                                            const std::string &query, int limit, int offset) {
+    SqliteReadPool::Lease lease = readers.acquire();
+    sqlite3* reader = lease.get();
+    std::vector<nlohmann::json> results;
+
+    std::string match = toFtsQuery(query);
+    if (match.empty() || limit <= 0) {
+        return results;
+    }
+    // Narrow the match with the room and sender tokens inside the index; the
+    // exact comparison against messages below rejects partial token matches.
+    match = "content : (" + match + ")" + toFtsColumnFilter("room", room);
+    if (!sender.empty()) {
+        match += toFtsColumnFilter("sender", sender);
+    }
+    offset = std::max(offset, 0);
+    // Each source yields its best limit + offset; the page is cut after merging.
+    int wanted = static_cast<int>(std::min<int64_t>(int64_t(limit) + offset, std::numeric_limits<int>::max()));
+
+    // One read transaction, so a month moving into the archive meanwhile is
+    // seen either live or archived, never both or neither.
+    if (sqlite3_exec(reader, "BEGIN TRANSACTION;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to begin search: " << sqlite3_errmsg(reader) << std::endl;
+        return results;
+    }
+
+    // Only content contributes to the score.
+    const char* sql =
+        "SELECT m.id, m.sender, m.content, m.timestamp, bm25(messages_fts, 1.0, 0.0, 0.0) AS rank "
+        "FROM messages_fts JOIN messages m ON m.id = messages_fts.rowid "
+        "WHERE messages_fts MATCH ?1 AND m.room = ?2 AND (?3 = '' OR m.sender = ?3) "
+        "ORDER BY rank LIMIT ?4;";
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(reader, sql, -1, &stmt, nullptr);
+    if (rc != SQLITE_OK) {
+        std::cerr << "Failed to prepare statement for search: " << sqlite3_errmsg(reader) << std::endl;
+        sqlite3_exec(reader, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return results;
+    }
+
+    sqlite3_bind_text(stmt, 1, match.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, room.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, sender.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, wanted);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        nlohmann::json result = {
+            {"id", sqlite3_column_int64(stmt, 0)},
+            {"from", reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1))},
+            {"content", reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2))},
+            {"timestamp", reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3))},
+            {"rank", sqlite3_column_double(stmt, 4)}
+        };
+        results.push_back(result);
+    }
+    if (rc != SQLITE_DONE) {
+        std::cerr << "Search failed: " << sqlite3_errmsg(reader) << std::endl;
+    }
+    sqlite3_finalize(stmt);
+
+    // Archived months each carry their own index. Their bm25 scores are
+    // relative to that month's statistics rather than the whole history,
+    // which is close enough to interleave with live results.
+    std::vector<int> months;
+    if (sqlite3_prepare_v2(reader, "SELECT month FROM archive_index WHERE room = ? ORDER BY month;",
+                           -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, room.c_str(), -1, SQLITE_STATIC);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            months.push_back(sqlite3_column_int(stmt, 0));
+        }
+        sqlite3_finalize(stmt);
+    }
+    std::vector<MessageArchive::Hit> hits;
+    for (int month : months) {
+        archive.searchRoom(month, room, sender, match, wanted, hits);
+    }
+    sqlite3_exec(reader, "COMMIT;", nullptr, nullptr, nullptr);
+
+    if (!hits.empty()) {
+        for (const MessageArchive::Hit &hit : hits) {
+            results.push_back({
+                {"id", hit.record.id},
+                {"from", hit.record.sender},
+                {"content", hit.record.content},
+                {"timestamp", hit.record.timestamp},
+                {"rank", hit.rank}
+            });
+        }
+        std::stable_sort(results.begin(), results.end(), [](const nlohmann::json &a, const nlohmann::json &b) {
+            return a["rank"].get<double>() < b["rank"].get<double>();
+        });
+    }
+    results.erase(results.begin(), results.begin() + std::min<std::size_t>(offset, results.size()));
+    if (results.size() > static_cast<std::size_t>(limit)) {
+        results.resize(limit);
+    }
+    return results;
+}
+
+bool SqliteMessageStore::flush() {
+    // Committed rows are already durable; DatabaseManager checkpoints the WAL.
+    return true;
+}
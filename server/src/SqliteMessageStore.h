@@ -0,0 +1,47 @@
+#ifndef SQLITE_MESSAGE_STORE_H
+#define SQLITE_MESSAGE_STORE_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+#include "MessageStore.h"
+#include "MessageArchive.h"
+#include "SqliteReadPool.h"
+
+// The default engine: messages are written through DatabaseManager's SQLite
+// connection under its lock and read through its pool of read-only
+// connections. Recent months live in the messages table with an FTS5 index;
+// compact() moves older months into MessageArchive files and applies retention.
+class SqliteMessageStore : public MessageStore {
+public:
+    // db is DatabaseManager's handle and readers its read pool, both opened
+    // before open() is called.
+    SqliteMessageStore(sqlite3 *&db, std::mutex &dbMutex, SqliteReadPool &readers, const std::string &dbFile,
+                       const StorageConfig &storage);
+
+    bool open() override;
+    using MessageStore::storeMessage;
+    bool storeMessage(const std::string &room, const std::string &sender, const std::string &content,
+                      const std::string &timestamp, const std::string &clientMsgId,
+                      int64_t &seq, bool &duplicate) override;
+    std::vector<nlohmann::json> getMessagesForRoom(const std::string &room, std::time_t since) override;
+    // Newest first off the (room, id) index, reaching into archived months
+    // only if the live table holds fewer than limit.
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+    recentFrames(const std::string &room, std::size_t limit) override;
+    std::vector<std::string> activeRooms(std::size_t limit) override;
+    std::vector<nlohmann::json> searchMessages(const std::string &room, const std::string &sender,
+                                               const std::string &query, int limit, int offset) override;
+    bool compact(std::time_t now, std::vector<std::string> &expiredRooms) override;
+    bool flush() override;
+
+private:
+    sqlite3 *&db;
+    std::mutex &dbMutex;
+    SqliteReadPool &readers;
+    StorageConfig storage;
+    MessageArchive archive;
+};
+
+#endif // SQLITE_MESSAGE_STORE_H
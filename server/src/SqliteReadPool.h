@@ -0,0 +1,93 @@
+#ifndef SQLITE_READ_POOL_H
+#define SQLITE_READ_POOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+
+// Read-only connections to the database, so queries (history, search, login
+// lookups) run beside the writer instead of queuing on its lock. In WAL mode
+// each read sees the last committed state and never blocks a write. A thread
+// leases a connection for one query sequence and waits if all are in use.
+class SqliteReadPool {
+public:
+    // Returns its connection to the pool when destroyed.
+    class Lease {
+    public:
+        Lease(SqliteReadPool &pool, sqlite3 *db) : pool(pool), db(db) {}
+        ~Lease() { pool.release(db); }
+        Lease(const Lease &) = delete;
+        Lease &operator=(const Lease &) = delete;
+
+        sqlite3 *get() const { return db; }
+
+    private:
+        SqliteReadPool &pool;
+        sqlite3 *db;
+    };
+
+    SqliteReadPool() {}
+    ~SqliteReadPool() { close(); }
+    SqliteReadPool(const SqliteReadPool &) = delete;
+    SqliteReadPool &operator=(const SqliteReadPool &) = delete;
+
+    // Open size connections to an existing WAL database. Must succeed before
+    // the first acquire().
+    bool open(const std::string &dbFile, std::size_t size, long long mmapBytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (std::size_t i = 0; i < std::max<std::size_t>(size, 1); ++i) {
+            sqlite3 *db = nullptr;
+            if (sqlite3_open_v2(dbFile.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+                std::cerr << "Can't open read connection: " << sqlite3_errmsg(db) << std::endl;
+                sqlite3_close(db);
+                return false;
+            }
+            sqlite3_busy_timeout(db, 3000);
+            std::string mmapSQL = "PRAGMA mmap_size=" + std::to_string(mmapBytes) + ";";
+            sqlite3_exec(db, mmapSQL.c_str(), nullptr, nullptr, nullptr);
+            all.push_back(db);
+            idle.push_back(db);
+        }
+        return true;
+    }
+
+    // Waits for every lease to come back, then closes the connections.
+    void close() {
+        std::unique_lock<std::mutex> lock(mutex);
+        returned.wait(lock, [this]() { return idle.size() == all.size(); });
+        for (sqlite3 *db : all) {
+            sqlite3_close(db);
+        }
+        all.clear();
+        idle.clear();
+    }
+
+    Lease acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        returned.wait(lock, [this]() { return !idle.empty(); });
+        sqlite3 *db = idle.back();
+        idle.pop_back();
+        return Lease(*this, db);
+    }
+
+private:
+    void release(sqlite3 *db) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle.push_back(db);
+        }
+        returned.notify_all();
+    }
+
+    std::mutex mutex;
+    std::condition_variable returned;
+    std::vector<sqlite3 *> all;
+    std::vector<sqlite3 *> idle;
+};
+
+#endif // SQLITE_READ_POOL_H
@@ -0,0 +1,102 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Hierarchical timing wheel driven by a coarse tick.
+//
+// Entries are bucketed by expiry tick into 4 levels of 64 slots, so scheduling
+// and expiring are O(1) no matter how many entries are pending. Entries that
+// land in an upper level are cascaded down as the lower level wraps. The wheel
+// is not thread-safe; the owner serializes access.
+template <typename T>
+class TimerWheel {
+public:
+    static const int kSlotBits = 6;
+    static const int kSlots = 1 << kSlotBits;
+    static const int kLevels = 4;
+
+    explicit TimerWheel(uint64_t startTick = 0) : current(startTick), count(0) {
+        for (int level = 0; level < kLevels; ++level) {
+            slots[level].resize(kSlots);
+        }
+    }
+
+    uint64_t now() const { return current; }
+    std::size_t size() const { return count; }
+
+    // Schedule an item to expire at the given absolute tick. Ticks in the past
+    // expire on the next advance().
+    void schedule(uint64_t expiryTick, T item) {
+        if (expiryTick <= current) {
+            expiryTick = current + 1;
+        }
+        place(Entry{expiryTick, std::move(item)});
+        ++count;
+    }
+
+    // Advance the wheel up to (and including) nowTick, invoking onExpire for
+    // every entry whose expiry has been reached.
+    template <typename F>
+    void advance(uint64_t nowTick, F onExpire) {
+        while (current < nowTick) {
+            ++current;
+            // Cascade upper levels whenever the level below wraps around,
+            // highest first so entries can fall more than one level.
+            int top = 0;
+            while (top < kLevels - 1 && (current & mask(top)) == 0) {
+                ++top;
+            }
+            for (int level = top; level >= 1; --level) {
+                std::vector<Entry> moved;
+                moved.swap(slots[level][index(current, level)]);
+                for (auto &entry : moved) {
+                    place(std::move(entry));
+                }
+            }
+            std::vector<Entry> expired;
+            expired.swap(slots[0][index(current, 0)]);
+            for (auto &entry : expired) {
+                if (entry.expiry <= current) {
+                    --count;
+                    onExpire(entry.item);
+                } else {
+                    place(std::move(entry));
+                }
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        uint64_t expiry;
+        T item;
+    };
+
+    static uint64_t mask(int level) {
+        return (uint64_t(1) << (kSlotBits * (level + 1))) - 1;
+    }
+
+    static std::size_t index(uint64_t tick, int level) {
+        return static_cast<std::size_t>((tick >> (kSlotBits * level)) & (kSlots - 1));
+    }
+
+    void place(Entry entry) {
+        uint64_t delta = entry.expiry - current;
+        int level = 0;
+        while (level < kLevels - 1 && delta > mask(level)) {
+            ++level;
+        }
+        // Anything beyond the wheel's range parks in the top level and is
+        // re-placed each time that slot comes around.
+        slots[level][index(entry.expiry, level)].push_back(std::move(entry));
+    }
+
+    uint64_t current;
+    std::size_t count;
+    std::vector<std::vector<Entry>> slots[kLevels];
+};
+
+#endif // TIMER_WHEEL_H
@@ -0,0 +1,128 @@
+#include "Tracer.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+thread_local uint64_t TraceContext::current_id = 0;
+
+// Trace-event times are microseconds; keep nanosecond precision.
+static void write_us(std::ostream &out, int64_t ns) {
+    char digits[4] = {char('0' + ns % 1000 / 100), char('0' + ns % 100 / 10), char('0' + ns % 10), '\0'};
+    out << ns / 1000 << "." << digits;
+}
+
+Tracer &Tracer::global() {
+    static Tracer tracer;
+    return tracer;
+}
+
+void Tracer::enable(std::size_t events_per_thread) {
+    if (events_per_thread > 0) {
+        std::size_t unset = 0;
+        capacity.compare_exchange_strong(unset, events_per_thread);
+    }
+    on = CHAT_TRACING && events_per_thread > 0;
+}
+
+Tracer::Ring *Tracer::local_ring() {
+    // Rings live as long as the tracer, so a dump can still read the events
+    // of threads that have exited.
+    thread_local Ring *ring = nullptr;
+    if (!ring) {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        rings.emplace_back(new Ring(capacity.load(), static_cast<int>(rings.size()) + 1));
+        ring = rings.back().get();
+    }
+    return ring;
+}
+
+void Tracer::append(const char *name, uint64_t id, int64_t start_ns, int64_t end_ns) {
+    Ring *ring = local_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    Event &event = ring->events[head % ring->events.size()];
+    // Pairs with the acquire fence in write_json: a dump that sees any of
+    // these stores also sees the head published before them.
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name.store(name, std::memory_order_relaxed);
+    event.id.store(id, std::memory_order_relaxed);
+    event.start_ns.store(start_ns, std::memory_order_relaxed);
+    event.end_ns.store(end_ns, std::memory_order_relaxed);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+uint64_t Tracer::recorded() {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    uint64_t total = 0;
+    for (const auto &ring : rings) {
+        total += ring->head.load(std::memory_order_acquire);
+    }
+    return total;
+}
+
+void Tracer::write_json(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&]() {
+        out << (first ? "\n" : ",\n");
+        first = false;
+    };
+    for (const auto &ring : rings) {
+        separator();
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->tid
+            << ",\"args\":{\"name\":\"thread " << ring->tid << "\"}}";
+
+        // The owning thread may keep writing while this runs; copy the
+        // window, then drop whatever was overwritten during the copy.
+        std::size_t size = ring->events.size();
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t begin = head > size ? head - size : 0;
+        struct Copy {
+            const char *name;
+            uint64_t id;
+            int64_t start_ns;
+            int64_t end_ns;
+        };
+        std::vector<Copy> copies;
+        copies.reserve(head - begin);
+        for (uint64_t i = begin; i < head; ++i) {
+            const Event &event = ring->events[i % size];
+            copies.push_back({event.name.load(std::memory_order_relaxed), event.id.load(std::memory_order_relaxed),
+                              event.start_ns.load(std::memory_order_relaxed),
+                              event.end_ns.load(std::memory_order_relaxed)});
+        }
+        // Seqlock-style check: keep the copies above from being reordered
+        // after this re-read of head. The slot for index `after` may be
+        // mid-write too.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = ring->head.load(std::memory_order_relaxed) + 1;
+        uint64_t valid_from = after > size ? after - size : 0;
+
+        for (uint64_t i = std::max(begin, valid_from); i < head; ++i) {
+            const Copy &event = copies[i - begin];
+            separator();
+            out << "{\"name\":\"" << event.name << "\",\"cat\":\"chat\",\"pid\":1,\"tid\":" << ring->tid
+                << ",\"ts\":";
+            write_us(out, event.start_ns);
+            if (event.end_ns < 0) {
+                out << ",\"ph\":\"i\",\"s\":\"t\"";
+            } else {
+                out << ",\"ph\":\"X\",\"dur\":";
+                write_us(out, event.end_ns - event.start_ns);
+            }
+            out << ",\"args\":{\"msg\":" << event.id << "}}";
+        }
+    }
+    out << "\n]}\n";
+}
+
+bool Tracer::dump(const std::string &path) {
+    std::ofstream out(path);
+    if (!out) {
+        std::cerr << "[Trace] Cannot write " << path << std::endl;
+        return false;
+    }
+    write_json(out);
+    std::cout << "[Trace] Wrote " << path << std::endl;
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,123 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Building with -DCHAT_TRACING=0 compiles every trace point down to nothing.
+#ifndef CHAT_TRACING
+#define CHAT_TRACING 1
+#endif
+
+// Per-message tracing for hot-path profiling.
+//
+// Each inbound frame gets a trace id when it is read; the id follows the
+// message on the handling thread (see TraceContext) and is stamped on every
+// frame it causes to be queued, so a trace shows where one message's time
+// went: receive, parse, persist, enqueue per recipient, time queued and the
+// socket write. Events go into a fixed-size ring per thread that only that
+// thread writes, so recording is a clock read, a release fence (free on
+// x86) and a few relaxed stores. The rings are dumped as Chrome trace-event
+// JSON, which chrome://tracing and Perfetto open directly. Off until
+// enable() is called.
+class Tracer {
+public:
+    static Tracer &global();
+
+    // Turn tracing on with rings of this many events per thread, or off with
+    // 0. A thread's ring is sized the first time it records.
+    void enable(std::size_t events_per_thread);
+    bool enabled() const { return CHAT_TRACING && on.load(std::memory_order_relaxed); }
+
+    // A fresh message id; 0 means "not traced".
+    uint64_t next_id() { return next_trace_id.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // A span from start_ns to end_ns, or a point event when end_ns < 0.
+    void record(const char *name, uint64_t id, int64_t start_ns, int64_t end_ns = -1) {
+        if (enabled() && id != 0) {
+            append(name, id, start_ns, end_ns);
+        }
+    }
+
+    // Write everything still held in the rings as Chrome trace-event JSON.
+    void write_json(std::ostream &out);
+    bool dump(const std::string &path);
+
+    // Events recorded so far, including ones since overwritten.
+    uint64_t recorded();
+
+private:
+    struct Event {
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint64_t> id{0};
+        std::atomic<int64_t> start_ns{0};
+        std::atomic<int64_t> end_ns{0};
+    };
+
+    struct Ring {
+        Ring(std::size_t capacity, int tid) : events(capacity), tid(tid) {}
+        std::vector<Event> events;
+        // Events ever written; the next one goes to head % capacity.
+        std::atomic<uint64_t> head{0};
+        int tid;
+    };
+
+    void append(const char *name, uint64_t id, int64_t start_ns, int64_t end_ns);
+    Ring *local_ring();
+
+    std::atomic<bool> on{false};
+    std::atomic<std::size_t> capacity{0};
+    std::atomic<uint64_t> next_trace_id{0};
+    std::mutex rings_mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+};
+
+// The message being handled on this thread, so code below the read loop can
+// tag what it does without threading an id through every call.
+class TraceContext {
+public:
+    explicit TraceContext(uint64_t id) : previous(current_id) { current_id = id; }
+    ~TraceContext() { current_id = previous; }
+    TraceContext(const TraceContext &) = delete;
+    TraceContext &operator=(const TraceContext &) = delete;
+
+    static uint64_t current() { return CHAT_TRACING ? current_id : 0; }
+
+private:
+    static thread_local uint64_t current_id;
+    uint64_t previous;
+};
+
+// Records a span covering its own lifetime for the current message.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name)
+        : name(name), id(Tracer::global().enabled() ? TraceContext::current() : 0),
+          start_ns(id ? Tracer::now_ns() : 0) {}
+    ~TraceSpan() {
+        if (id) {
+            Tracer::global().record(name, id, start_ns, Tracer::now_ns());
+        }
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+private:
+    const char *name;
+    uint64_t id;
+    int64_t start_ns;
+};
+
+#endif // TRACER_H
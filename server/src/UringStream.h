@@ -0,0 +1,226 @@
+#ifndef URING_STREAM_H
+#define URING_STREAM_H
+
+#include "IoUring.h"
+#include <boost/asio.hpp>
+#include <boost/beast/core/bind_handler.hpp>
+#include <boost/beast/websocket/teardown.hpp>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <utility>
+
+// A TCP connection whose reads and writes go through an IoUring instead of
+// the Asio reactor, for use as the next layer of a websocket::stream.
+//
+// The socket is accepted as usual; the first read or write takes its
+// descriptor out of the reactor, so the connection no longer costs epoll
+// wakeups. Reads receive through the ring's registered buffers and writes
+// are sendmsg requests gathering Beast's frame header and payload, batched
+// with every other session's into the ring's next flush. Each operation
+// completes through a post to the socket's executor, like Asio's own.
+template <typename Socket>
+class UringStream {
+public:
+    using executor_type = typename Socket::executor_type;
+    using next_layer_type = Socket;
+
+    UringStream(const executor_type &executor, IoUring &ring) : socket(executor), ring(ring) {}
+
+    ~UringStream() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    UringStream(const UringStream &) = delete;
+    UringStream &operator=(const UringStream &) = delete;
+
+    executor_type get_executor() { return socket.get_executor(); }
+    Socket &next_layer() { return socket; }
+    const Socket &next_layer() const { return socket; }
+
+    template <typename MutableBuffers, typename Token>
+    auto async_read_some(const MutableBuffers &buffers, Token &&token) {
+        return boost::asio::async_compose<Token, void(boost::system::error_code, std::size_t)>(
+            io_op<MutableBuffers, false>{*this, buffers}, token, socket);
+    }
+
+    template <typename ConstBuffers, typename Token>
+    auto async_write_some(const ConstBuffers &buffers, Token &&token) {
+        return boost::asio::async_compose<Token, void(boost::system::error_code, std::size_t)>(
+            io_op<ConstBuffers, true>{*this, buffers}, token, socket);
+    }
+
+    // Shut the connection down, which completes whatever the kernel still
+    // holds for it, and close the descriptor once nothing is in flight: a
+    // request still queued for the ring names it by number.
+    void close(boost::system::error_code &ec) {
+        if (fd < 0) {
+            socket.close(ec);
+            closed = true;
+            return;
+        }
+        ::shutdown(fd, SHUT_RDWR);
+        closed = true;
+        if (pending == 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+private:
+    // Most buffers one write gathers; Beast sends a header and a payload.
+    static constexpr std::size_t kMaxWriteBuffers = 16;
+
+    // Take the descriptor from the reactor, blocking: io_uring waits for
+    // readiness itself, but reports EAGAIN on a non-blocking descriptor.
+    bool attach(boost::system::error_code &ec) {
+        if (fd >= 0) {
+            return true;
+        }
+        if (closed) {
+            ec = boost::asio::error::bad_descriptor;
+            return false;
+        }
+        fd = socket.release(ec);
+        if (ec) {
+            fd = -1;
+            return false;
+        }
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0 && (flags & O_NONBLOCK)) {
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+        return true;
+    }
+
+    // The request handed to the ring: holds the suspended operation, a copy
+    // of its buffers and, for writes, the message naming them.
+    template <typename Buffers, bool IsWrite, typename Self>
+    struct request : IoUring::Request {
+        request(UringStream &stream, int fd, const Buffers &buffers, Self &&self)
+            : stream(stream), fd(fd), buffers(buffers), self(std::move(self)) {}
+
+        void submit() {
+            if constexpr (IsWrite) {
+                std::size_t count = 0;
+                for (auto it = boost::asio::buffer_sequence_begin(buffers);
+                     it != boost::asio::buffer_sequence_end(buffers) && count < kMaxWriteBuffers; ++it) {
+                    boost::asio::const_buffer buffer(*it);
+                    if (buffer.size() > 0) {
+                        iov[count].iov_base = const_cast<void *>(buffer.data());
+                        iov[count].iov_len = buffer.size();
+                        ++count;
+                    }
+                }
+                message = msghdr();
+                message.msg_iov = iov;
+                message.msg_iovlen = count;
+                stream.ring.send(fd, &message, this);
+            } else if (stream.ring.selects_buffers()) {
+                stream.ring.receive(fd, boost::asio::buffer_size(buffers), this);
+            } else {
+                receive_direct();
+            }
+        }
+
+        // The first non-empty buffer, which is all a read_some promises to fill.
+        void receive_direct() {
+            auto it = boost::asio::buffer_sequence_begin(buffers);
+            for (; boost::asio::buffer_size(*it) == 0; ++it) {}
+            boost::asio::mutable_buffer buffer(*it);
+            stream.ring.receive(fd, buffer.data(), buffer.size(), this);
+        }
+
+        bool complete(int result, unsigned flags) override {
+            boost::system::error_code ec;
+            std::size_t transferred = 0;
+            if constexpr (!IsWrite) {
+                if (result == -ENOBUFS) {
+                    // Every registered buffer is taken; read into ours instead.
+                    receive_direct();
+                    return false;
+                }
+            }
+            if (result < 0) {
+                ec.assign(-result, boost::system::system_category());
+            } else if constexpr (IsWrite) {
+                transferred = static_cast<std::size_t>(result);
+            } else if (result == 0) {
+                ec = boost::asio::error::eof;
+            } else if (flags & IORING_CQE_F_BUFFER) {
+                transferred = stream.ring.take_buffer(flags, result, buffers);
+            } else {
+                transferred = static_cast<std::size_t>(result);
+            }
+            boost::asio::post(stream.socket.get_executor(),
+                              boost::beast::bind_front_handler(std::move(self), ec, transferred));
+            return true;
+        }
+
+        UringStream &stream;
+        int fd;
+        Buffers buffers;
+        Self self;
+        msghdr message;
+        iovec iov[IsWrite ? kMaxWriteBuffers : 1];
+    };
+
+    template <typename Buffers, bool IsWrite>
+    struct io_op {
+        UringStream &stream;
+        Buffers buffers;
+        bool started = false;
+
+        template <typename Self>
+        void operator()(Self &self, boost::system::error_code ec = {}, std::size_t transferred = 0) {
+            UringStream &s = stream;
+            if (started) {
+                if (--s.pending == 0 && s.closed && s.fd >= 0) {
+                    ::close(s.fd);
+                    s.fd = -1;
+                }
+                self.complete(ec, transferred);
+                return;
+            }
+            started = true;
+            ++s.pending;
+            if (boost::asio::buffer_size(buffers) == 0 || !s.attach(ec)) {
+                boost::asio::post(s.socket.get_executor(),
+                                  boost::beast::bind_front_handler(std::move(self), ec, std::size_t(0)));
+                return;
+            }
+            // Owned by the ring from here; buffers are copied before self moves.
+            auto *pending_request = new request<Buffers, IsWrite, Self>(s, s.fd, buffers, std::move(self));
+            pending_request->submit();
+        }
+    };
+
+    Socket socket;
+    IoUring &ring;
+    // The released descriptor, or -1 before the first operation and after close.
+    int fd = -1;
+    bool closed = false;
+    // Operations started and not yet completed; at most a read and a write.
+    int pending = 0;
+};
+
+// websocket::stream tears its next layer down through these.
+template <typename Socket>
+void teardown(boost::beast::role_type, UringStream<Socket> &stream, boost::system::error_code &ec) {
+    stream.close(ec);
+}
+
+template <typename Socket, typename Handler>
+void async_teardown(boost::beast::role_type, UringStream<Socket> &stream, Handler &&handler) {
+    boost::system::error_code ec;
+    stream.close(ec);
+    boost::asio::post(stream.get_executor(),
+                      boost::beast::bind_front_handler(std::forward<Handler>(handler), boost::system::error_code()));
+}
+
+#endif // URING_STREAM_H
@@ -1,36 +1,157 @@
 #include "websocket_server.h"
 #include "DatabaseManager.h"
+#include "BrokerBackplane.h"
 #include <boost/asio.hpp>
 #include <iostream>
 #include <thread>
 #include <vector>
+#include <memory>
+#include <string>
+#include <csignal>
+#include <cstdlib>
+#include <functional>
 
-int main() {
+// Usage:
+//   websocket_server [port [broker-address]]   run a chat node, clustered through the broker if given
+//   websocket_server --broker <address>        run the stand-in pub/sub broker
+// Broker addresses are "host:port" or "unix:/path/to/socket".
+// Setting CHAT_TLS_CERT and CHAT_TLS_KEY (PEM files) serves wss:// instead of
+// ws://; CHAT_KTLS=1 additionally asks for kernel TLS. CHAT_IO_URING=1 runs
+// ws:// sockets on io_uring instead of epoll.
+// CHAT_TRACE=<events per thread> turns on per-message tracing; SIGUSR1 then
+// writes the trace to CHAT_TRACE_FILE (default chat-trace.json) for
+// chrome://tracing or Perfetto. CHAT_PRELOAD_ROOMS=<n> warms the history
+// cache with the n busiest rooms at startup.
+// Storage (see StorageConfig): CHAT_STORAGE_ENGINE=log keeps messages in an
+// append-only log under CHAT_LOG_DIR (default local.db.log) instead of SQLite.
+// CHAT_HOT_MONTHS=<n> months stay in the live table, CHAT_RETENTION_MONTHS=<n>
+// months are kept at all (0 keeps everything), CHAT_MMAP_BYTES=<n> bytes of the
+// database may be mapped, and CHAT_READ_CONNECTIONS=<n> read-only connections
+// serve queries.
+int main(int argc, char* argv[]) {
     // Create an io_context object
     boost::asio::io_context ioContext;
 
+    if (argc == 3 && std::string(argv[1]) == "--broker") {
+        Broker broker(ioContext, argv[2]);
+        if (!broker.start()) {
+            return 1;
+        }
+        boost::asio::signal_set signals(ioContext, SIGINT, SIGTERM);
+        signals.async_wait([&](boost::system::error_code, int) {
+            broker.stop();
+            ioContext.stop();
+        });
+        ioContext.run();
+        return 0;
+    }
+    int port = argc > 1 ? std::atoi(argv[1]) : 9000;
+
     // Create a work guard to prevent ioContext from stopping when there are no immediate tasks.
     auto workGuard = boost::asio::make_work_guard(ioContext);
 
+    StorageConfig storage;
+    if (const char *engine = std::getenv("CHAT_STORAGE_ENGINE")) {
+        if (std::string(engine) == "log") {
+            storage.engine = StorageConfig::Log;
+        } else if (std::string(engine) != "sqlite") {
+            std::cerr << "Unknown CHAT_STORAGE_ENGINE '" << engine << "'; expected sqlite or log." << std::endl;
+            return 1;
+        }
+    }
+    if (const char *logDir = std::getenv("CHAT_LOG_DIR")) {
+        storage.logDirectory = logDir;
+    }
+    if (const char *hot = std::getenv("CHAT_HOT_MONTHS")) {
+        storage.hotMonths = std::atoi(hot);
+    }
+    if (const char *retention = std::getenv("CHAT_RETENTION_MONTHS")) {
+        storage.retentionMonths = std::atoi(retention);
+    }
+    if (const char *mmap = std::getenv("CHAT_MMAP_BYTES")) {
+        storage.mmapBytes = std::atoll(mmap);
+    }
+    if (const char *readers = std::getenv("CHAT_READ_CONNECTIONS")) {
+        storage.readConnections = std::atoi(readers);
+    }
+
     // Initialize the database.
-    DatabaseManager dbManager("local.db");
+    DatabaseManager dbManager("local.db", storage);
     if (!dbManager.initDB()) {
         std::cerr << "Database initialization failed." << std::endl;
         return 1;
     }
 
+    // Join the cluster when a broker address is given.
+    std::unique_ptr<BrokerBackplane> backplane;
+    if (argc > 2) {
+        backplane.reset(new BrokerBackplane(ioContext, argv[2]));
+    }
+
+    ServerConfig config;
+    if (const char *cert = std::getenv("CHAT_TLS_CERT")) {
+        config.tls_certificate_file = cert;
+    }
+    if (const char *key = std::getenv("CHAT_TLS_KEY")) {
+        config.tls_private_key_file = key;
+    }
+    if (const char *ktls = std::getenv("CHAT_KTLS")) {
+        config.tls_ktls = std::string(ktls) == "1";
+    }
+    if (const char *uring = std::getenv("CHAT_IO_URING")) {
+        config.io_uring = std::string(uring) == "1";
+    }
+    if (const char *trace = std::getenv("CHAT_TRACE")) {
+        config.trace_events_per_thread = std::strtoul(trace, nullptr, 10);
+    }
+    if (const char *preload = std::getenv("CHAT_PRELOAD_ROOMS")) {
+        config.preload_rooms = std::atoi(preload);
+    }
+    if (const char *preloadMessages = std::getenv("CHAT_PRELOAD_MESSAGES")) {
+        config.preload_messages_per_room = std::strtoul(preloadMessages, nullptr, 10);
+    }
+    const char *traceFileEnv = std::getenv("CHAT_TRACE_FILE");
+    std::string traceFile = traceFileEnv ? traceFileEnv : "chat-trace.json";
+
     // Create the WebSocket server instance.
     // Note: Use a method that only starts accepting connections (instead of calling ioContext.run() inside)
-    WebSocketServer server(ioContext, 9000, dbManager);
+    WebSocketServer server(ioContext, port, dbManager, config, backplane.get());
     server.start_accept();  // Start accepting connections
 
+    // On SIGINT/SIGTERM, drain sessions and flush the database, then let the threads exit.
+    boost::asio::signal_set signals(ioContext, SIGINT, SIGTERM);
+    signals.async_wait([&](boost::system::error_code ec, int signo) {
+        if (ec) {
+            return;
+        }
+        std::cout << "Received signal " << signo << ", shutting down." << std::endl;
+        server.shutdown([&]() {
+            if (backplane) {
+                backplane->stop();
+            }
+            workGuard.reset();
+            ioContext.stop();
+        });
+    });
+
+    // SIGUSR1 dumps the trace without stopping the server.
+    boost::asio::signal_set traceSignal(ioContext, SIGUSR1);
+    std::function<void(boost::system::error_code, int)> onTraceSignal = [&](boost::system::error_code ec, int) {
+        if (ec) {
+            return;
+        }
+        Tracer::global().dump(traceFile);
+        traceSignal.async_wait(onTraceSignal);
+    };
+    traceSignal.async_wait(onTraceSignal);
+
     // Determine the number of threads to use in the thread pool.
     unsigned int threadCount = std::thread::hardware_concurrency();
     if (threadCount == 0) { // Fallback if hardware_concurrency() can't determine the number of cores.
         threadCount = 2;
     }
 
-    std::cout << "Starting io_context on " << threadCount << " threads." << std::endl;
+    std::cout << "Starting io_context on " << threadCount << " threads (" << io_backend_name() << ")." << std::endl;
 
     // Create and launch the thread pool.
     std::vector<std::thread> threadPool;
@@ -45,5 +166,7 @@ int main() {
         thread.join();
     }
 
+    std::cout << "Server stopped." << std::endl;
+
     return 0;
 }
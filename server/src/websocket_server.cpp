@@ -2,6 +2,11 @@
 #include <nlohmann/json.hpp>
 #include <iostream>
 #include <functional>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <fstream>
+#include <stdexcept>
 
 namespace beast = boost::beast;
 namespace websocket = beast::websocket;
@@ -10,208 +15,1244 @@ using tcp = asio::ip::tcp;
 using flat_buffer = beast::flat_buffer;
 using json = nlohmann::json;
 
+static int64_t steady_now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t steady_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //----------------------
 // Session member functions
 //----------------------
-void Session::write(const std::string &msg) {
+Session::Session(asio::io_context &context, asio::ssl::context *tls, bool ktls, IoUring *uring)
+    : strand(context.get_executor()),
+      write_signal(strand),
+      created_ms(steady_now_ms()),
+      last_activity_ms(created_ms) {
+    if (tls && ktls) {
+        kwss = std::make_shared<websocket::stream<KtlsStream<session_socket>>>(strand, tls->native_handle());
+    } else if (tls) {
+        wss = std::make_shared<websocket::stream<beast::ssl_stream<session_socket>>>(strand, *tls);
+    } else if (uring) {
+        uws = std::make_shared<websocket::stream<UringStream<session_socket>>>(strand, *uring);
+    } else {
+        ws = std::make_shared<websocket::stream<session_socket>>(session_socket(strand));
+    }
+}
+
+void Session::touch() {
+    last_activity_ms = steady_now_ms();
+}
+
+void Session::close(websocket::close_code code) {
     auto self = shared_from_this();
-    boost::asio::post(strand, [this, self, msg]() {
-        bool write_in_progress = !write_queue.empty();
-        write_queue.push_back(msg);
-        if (!write_in_progress) {
-            do_write();
+    boost::asio::post(strand, [this, self, code]() {
+        if (state != Open || close_requested) {
+            return;
         }
+        close_requested = true;
+        close_code = code;
+        write_signal.cancel();
     });
 }
 
-void Session::do_write() {
+void Session::close_socket() {
+    state = Closed;
+    boost::system::error_code ec;
+    if (uws) {
+        // The descriptor may have left the socket for the ring.
+        uws->next_layer().close(ec);
+    } else {
+        socket().close(ec);
+    }
+    write_signal.cancel();
+}
+
+void Session::write(const std::string &msg, Lane lane) {
+    write(std::make_shared<const std::string>(msg), lane);
+}
+
+void Session::write(std::shared_ptr<const std::string> msg, Lane lane) {
     auto self = shared_from_this();
-    ws->async_write(boost::asio::buffer(write_queue.front()),
-        boost::asio::bind_executor(strand,
-            [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-                if (!ec) {
-                    write_queue.pop_front();
-                    if (!write_queue.empty()) {
-                        do_write();
-                    }
-                } else {
-                    std::cerr << "Write error: " << ec.message() << std::endl;
+    Outbound frame{std::move(msg), 0, 0};
+    if (Tracer::global().enabled() && (frame.trace_id = TraceContext::current()) != 0) {
+        frame.enqueued_ns = Tracer::now_ns();
+        Tracer::global().record("enqueue", frame.trace_id, frame.enqueued_ns);
+    }
+    boost::asio::post(strand, [this, self, frame = std::move(frame), lane]() {
+        // Writing to a stream that is not open trips Beast's write lock, so drop instead.
+        if (state != Open) {
+            return;
+        }
+        write_queues[lane].push_back(frame);
+        write_signal.cancel();
+    });
+}
+
+void Session::write(std::vector<std::shared_ptr<const std::string>> msgs, Lane lane) {
+    auto self = shared_from_this();
+    boost::asio::post(strand, [this, self, msgs = std::move(msgs), lane]() mutable {
+        if (state != Open) {
+            return;
+        }
+        for (auto &msg : msgs) {
+            write_queues[lane].push_back(Outbound{std::move(msg), 0, 0});
+        }
+        write_signal.cancel();
+    });
+}
+
+// Drains the write lanes one frame at a time. Between bursts it parks on
+// write_signal, which write(), close() and close_socket() cancel to wake it.
+session_awaitable<void> Session::write_loop() {
+    auto self = shared_from_this();
+    boost::system::error_code ec;
+    while (state == Open) {
+        // Control first, then live, except that bulk gets a turn after
+        // kLiveFramesPerBulk frames of anything else.
+        std::deque<Outbound> *queue = nullptr;
+        if (!write_queues[Bulk].empty() && frames_since_bulk >= kLiveFramesPerBulk) {
+            queue = &write_queues[Bulk];
+        } else {
+            for (auto &lane : write_queues) {
+                if (!lane.empty()) {
+                    queue = &lane;
+                    break;
+                }
+            }
+        }
+
+        if (!queue) {
+            if (close_requested) {
+                state = Closing;
+                co_await with_stream([this, &ec](auto &stream) {
+                    return stream.async_close(close_code, asio::redirect_error(use_session_awaitable, ec));
+                });
+                if (ec) {
+                    close_socket();
                 }
-            }));
+                co_return;
+            }
+            write_signal.expires_at(session_timer::time_point::max());
+            co_await write_signal.async_wait(asio::redirect_error(use_session_awaitable, ec));
+            continue;
+        }
+
+        write_started_ms = steady_now_ms();
+        frames_since_bulk = queue == &write_queues[Bulk] ? 0 : frames_since_bulk + 1;
+        uint64_t trace_id = queue->front().trace_id;
+        int64_t write_ns = trace_id ? Tracer::now_ns() : 0;
+        if (trace_id) {
+            Tracer::global().record("queued", trace_id, queue->front().enqueued_ns, write_ns);
+        }
+        co_await with_stream([queue, &ec](auto &stream) {
+            return stream.async_write(asio::buffer(*queue->front().payload),
+                                      asio::redirect_error(use_session_awaitable, ec));
+        });
+        write_started_ms = 0;
+        if (trace_id) {
+            Tracer::global().record("write", trace_id, write_ns, Tracer::now_ns());
+        }
+        if (ec) {
+            std::cerr << "Write error: " << ec.message() << std::endl;
+            for (auto &lane : write_queues) {
+                lane.clear();
+            }
+            close_socket();
+            co_return;
+        }
+        queue->pop_front();
+    }
 }
 
 
 //----------------------
 // WebSocketServer member functions
 //----------------------
-WebSocketServer::WebSocketServer(asio::io_context& context, int port, DatabaseManager &dbManager)
-    : context(context), acceptor(context, tcp::endpoint(tcp::v4(), port)), dbManager(dbManager)
+WebSocketServer::WebSocketServer(asio::io_context& context, int port, DatabaseManager &dbManager,
+                                 const ServerConfig &config, Backplane *backplane)
+    : context(context), acceptor(asio::make_strand(context)), dbManager(dbManager),
+      config(config), backplane(backplane), timer_wheel(steady_now_ms() / std::max(config.tick_ms, 1)), tick_timer(context),
+      drain_timer(context), db_pool(std::max(config.db_threads, 1)),
+      compaction_timer(context),
+      user_limiter(config.user_rate, config.user_burst),
+      room_limiter(config.room_rate, config.room_burst),
+      presence(config.typing_timeout_ms),
+      presence_timer(context),
+      dedup(config.dedup_window_ms, static_cast<std::size_t>(std::max(config.dedup_max_per_user, 1))),
+      room_cache(config.preload_budget_bytes, config.preload_messages_per_room)
 {
+    tcp::endpoint endpoint(tcp::v4(), port);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.bind(endpoint);
+    acceptor.listen(config.listen_backlog);
+
+    if (config.trace_events_per_thread > 0) {
+        Tracer::global().enable(config.trace_events_per_thread);
+    }
+    if (!config.tls_certificate_file.empty() && !config.tls_private_key_file.empty() && !setup_tls()) {
+        throw std::runtime_error("TLS setup failed");
+    }
+    if (config.io_uring) {
+        if (tls_context) {
+            std::cout << "[io_uring] wss:// sessions stay on the reactor." << std::endl;
+        } else {
+            uring = std::make_unique<IoUring>(context, config.io_uring_entries, config.io_uring_read_buffers,
+                                              config.read_buffer_bytes);
+            if (!uring->open()) {
+                throw std::runtime_error("io_uring setup failed");
+            }
+        }
+    }
+    if (backplane) {
+        backplane->start([this](const std::string &room, const std::string &payload) {
+            deliver_remote(room, payload);
+        });
+    }
+}
+
+WebSocketServer::~WebSocketServer() {
+    if (drain_thread.joinable()) {
+        drain_thread.join();
+    }
+}
+
+// Builds the server context: TLS 1.2 minimum, stateless TLS 1.3 session
+// tickets for resumption, and SSL_OP_ENABLE_KTLS when kTLS was asked for.
+bool WebSocketServer::setup_tls() {
+    boost::system::error_code ec;
+    tls_context = std::make_unique<asio::ssl::context>(asio::ssl::context::tls_server);
+    tls_context->set_options(asio::ssl::context::default_workarounds | asio::ssl::context::no_sslv2 |
+                             asio::ssl::context::no_sslv3 | asio::ssl::context::no_tlsv1 |
+                             asio::ssl::context::no_tlsv1_1, ec);
+    if (!ec) {
+        tls_context->use_certificate_chain_file(config.tls_certificate_file, ec);
+    }
+    if (!ec) {
+        tls_context->use_private_key_file(config.tls_private_key_file, asio::ssl::context::pem, ec);
+    }
+    if (ec) {
+        std::cerr << "[TLS] Failed to load certificate or key: " << ec.message() << std::endl;
+        tls_context.reset();
+        return false;
+    }
+
+    SSL_CTX *native = tls_context->native_handle();
+    static const unsigned char session_context[] = "messaging-server";
+    SSL_CTX_set_session_id_context(native, session_context, sizeof(session_context) - 1);
+    SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_SERVER);
+    if (config.tls_session_tickets > 0) {
+        SSL_CTX_set_num_tickets(native, static_cast<std::size_t>(config.tls_session_tickets));
+    } else {
+        SSL_CTX_set_num_tickets(native, 0);
+        SSL_CTX_set_options(native, SSL_OP_NO_TICKET);
+        SSL_CTX_set_session_cache_mode(native, SSL_SESS_CACHE_OFF);
+    }
+
+    if (config.tls_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(native, SSL_OP_ENABLE_KTLS);
+        use_ktls = true;
+        // OpenSSL quietly stays in user space when the kernel can't take the
+        // keys; say so up front rather than leave it to ktls_connections.
+        std::ifstream ulp("/proc/sys/net/ipv4/tcp_available_ulp");
+        std::string modules;
+        std::getline(ulp, modules);
+        if (modules.find("tls") == std::string::npos) {
+            std::cout << "[TLS] Kernel TLS not available (load the tls module); encrypting in user space." << std::endl;
+        }
+#else
+        std::cout << "[TLS] This OpenSSL has no kTLS support; encrypting in user space." << std::endl;
+#endif
+    }
+    return true;
 }
 
 void WebSocketServer::run() {
-    std::cout << "WebSocket Server running on port " << acceptor.local_endpoint().port() << std::endl;
+    std::cout << "WebSocket Server running on port " << acceptor.local_endpoint().port()
+              << " (" << io_backend_name() << (tls_context ? ", wss" : "") << (use_ktls ? " + kTLS" : "")
+              << (uring ? " + io_uring sockets" : "") << ")" << std::endl;
     start_accept();
     context.run();
 }
 
 void WebSocketServer::start_accept() {
-    auto ws = std::make_shared<websocket::stream<tcp::socket>>(tcp::socket(context));
-    auto session = std::make_shared<Session>(ws, context);
-    acceptor.async_accept(ws->next_layer(), [this, session](boost::system::error_code ec) {
+    start_timers();
+    // Archive whatever aged out while the server was down in the background,
+    // like the periodic pass; the cache is loaded once that is done.
+    if (config.compaction_interval_ms > 0) {
+        compact(true);
+    } else if (config.preload_rooms > 0) {
+        start_preload(room_cache.generation());
+    }
+    asio::post(acceptor.get_executor(), [this]() {
+        for (int i = 0; i < std::max(config.accept_batch, 1); ++i) {
+            accept_next();
+        }
+    });
+}
+
+// Keeps one accept pending; start_accept runs accept_batch of these side by
+// side so a burst of connections is picked up without a round trip through
+// the handler for each. Runs on the acceptor's strand.
+void WebSocketServer::accept_next() {
+    if (stopping) {
+        return;
+    }
+    if (config.max_handshakes > 0 && server_stats.handshakes_in_flight >= config.max_handshakes) {
+        // Resumed by handshake_finished(); until then the kernel backlog holds new connections.
+        ++parked_accepts;
+        server_stats.accepts_paused++;
+        return;
+    }
+    auto session = std::make_shared<Session>(context, tls_context.get(), use_ktls, uring.get());
+    acceptor.async_accept(session->socket(), [this, session](boost::system::error_code ec) {
+        if (stopping) {
+            return;
+        }
         if (!ec) {
-            std::cout << "Client connected!" << std::endl;
-            sessions.insert(session);
-            handle_session(session);
+            if (config.max_connections > 0 && server_stats.connections >= config.max_connections) {
+                // Reset rather than close, so a rejected client costs no TIME_WAIT.
+                server_stats.connections_rejected++;
+                boost::system::error_code ignored;
+                session->socket().set_option(asio::socket_base::linger(true, 0), ignored);
+                session->socket().close(ignored);
+            } else {
+                server_stats.connections++;
+                server_stats.handshakes_in_flight++;
+                // Frames are written whole, so Nagle only adds delay: a reply
+                // queued behind an unacknowledged broadcast would wait out the
+                // client's delayed ACK.
+                boost::system::error_code option_ec;
+                session->socket().set_option(tcp::no_delay(true), option_ec);
+                handle_session(session);
+            }
         } else {
             std::cerr << "Accept error: " << ec.message() << std::endl;
         }
-        start_accept();
+        accept_next();
     });
 }
 
+void WebSocketServer::resume_accept() {
+    asio::post(acceptor.get_executor(), [this]() {
+        if (parked_accepts > 0) {
+            --parked_accepts;
+            accept_next();
+        }
+    });
+}
+
+// Called once per accepted connection when its handshake succeeds or fails.
+void WebSocketServer::handshake_finished() {
+    server_stats.handshakes_in_flight--;
+    if (config.max_handshakes > 0) {
+        resume_accept();
+    }
+}
 
 void WebSocketServer::handle_session(std::shared_ptr<Session> session) {
-    session->ws->async_accept([this, session](boost::system::error_code ec) {
-        if (!ec) {
-            auto buffer = std::make_shared<flat_buffer>();
-            handle_read(session, buffer);
+    if (config.handshake_timeout_ms > 0) {
+        schedule_check(session, session->created_ms + config.handshake_timeout_ms);
+    }
+    asio::co_spawn(session->strand, run_session(session), asio::detached);
+}
+
+// One connection from handshake to disconnect. The coroutine runs on the
+// session's strand, as does the writer it starts, so the read side needs no
+// per-operation handlers or captured shared_ptrs.
+session_awaitable<void> WebSocketServer::run_session(std::shared_ptr<Session> session) {
+    // Any inbound frame, including pongs to our keepalive pings, counts as activity.
+    std::weak_ptr<Session> weak = session;
+    session->with_stream([weak](auto &stream) {
+        stream.control_callback([weak](websocket::frame_type kind, beast::string_view) {
+            if (auto s = weak.lock()) {
+                s->touch();
+                if (kind == websocket::frame_type::pong) {
+                    s->ping_outstanding = false;
+                }
+                // Beast answers the peer's close itself; starting another write
+                // while it does trips its write lock, so stop writing now.
+                if (kind == websocket::frame_type::close) {
+                    s->state = Session::Closed;
+                }
+            }
+        });
+    });
+
+    boost::system::error_code ec;
+    // wss:// connections finish the TLS handshake first; the handshake
+    // timeout covers both.
+    SSL *ssl = nullptr;
+    if (session->wss) {
+        co_await session->wss->next_layer().async_handshake(asio::ssl::stream_base::server,
+                                                            asio::redirect_error(use_session_awaitable, ec));
+        ssl = session->wss->next_layer().native_handle();
+    } else if (session->kwss) {
+        co_await session->kwss->next_layer().async_handshake(asio::redirect_error(use_session_awaitable, ec));
+        ssl = session->kwss->next_layer().native_handle();
+        if (!ec && session->kwss->next_layer().ktls_send()) {
+            server_stats.ktls_connections++;
+        }
+    }
+    if (ssl && ec) {
+        std::cout << "TLS handshake error: " << ec.message() << std::endl;
+        handshake_finished();
+        server_stats.connections--;
+        remove_session(session);
+        co_return;
+    }
+    if (ssl) {
+        server_stats.tls_handshakes++;
+        if (SSL_session_reused(ssl)) {
+            server_stats.tls_resumed++;
+        }
+    }
+
+    co_await session->with_stream([&ec](auto &stream) {
+        return stream.async_accept(asio::redirect_error(use_session_awaitable, ec));
+    });
+    handshake_finished();
+    if (ec || session->state == Session::Closed) {
+        std::cout << "Handshake error: " << ec.message() << std::endl;
+        server_stats.connections--;
+        remove_session(session);
+        co_return;
+    }
+    session->state = Session::Open;
+    session->touch();
+    if (config.connection_rate > 0) {
+        session->connection_bucket.reset(new TokenBucket(config.connection_rate, config.connection_burst));
+    }
+    // Only sessions that completed the handshake receive broadcasts. One that
+    // finishes after shutdown() took its snapshot would never be told to go
+    // away, so it is turned back here instead.
+    bool refused;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        refused = stopping;
+        if (!refused) {
+            sessions.insert(session);
+        }
+    }
+    if (refused) {
+        co_await session->with_stream([&ec](auto &stream) {
+            return stream.async_close(websocket::close_code::going_away,
+                                      asio::redirect_error(use_session_awaitable, ec));
+        });
+        server_stats.connections--;
+        remove_session(session);
+        co_return;
+    }
+    schedule_check(session, session->last_activity_ms + std::max(config.tick_ms, 1));
+    asio::co_spawn(session->strand, session->write_loop(), asio::detached);
+
+    flat_buffer buffer;
+    buffer.reserve(config.read_buffer_bytes);
+    for (;;) {
+        co_await session->with_stream([&buffer, &ec](auto &stream) {
+            return stream.async_read(buffer, asio::redirect_error(use_session_awaitable, ec));
+        });
+        if (ec) {
+            break;
+        }
+        session->touch();
+        if (!admit_frame(session)) {
+            buffer.consume(buffer.size());
+            continue;
+        }
+        // Tag the frame for tracing; the id follows it through handle_message.
+        uint64_t trace_id = 0;
+        if (Tracer::global().enabled()) {
+            trace_id = Tracer::global().next_id();
+            Tracer::global().record("receive", trace_id, Tracer::now_ns());
+        }
+        TraceContext trace(trace_id);
+        // The frame is copied once; broadcasts share this copy with every recipient.
+        auto received = std::make_shared<const std::string>(beast::buffers_to_string(buffer.data()));
+        buffer.consume(buffer.size());
+        handle_message(session, received);
+    }
+    std::cout << "[Disconnect] Client disconnected. Reason: " << ec.message() << std::endl;
+    server_stats.connections--;
+    remove_session(session);
+    // Wakes the writer so it can finish.
+    session->close_socket();
+}
+
+//----------------------
+// Rate limiting
+//----------------------
+// Connection and user limits, checked for every frame before it is copied or
+// parsed. Runs on the session's strand.
+bool WebSocketServer::admit_frame(const std::shared_ptr<Session> &session) {
+    if (!session->connection_bucket && !session->user_bucket) {
+        return true;
+    }
+    int64_t now = steady_now_us();
+    if (session->connection_bucket) {
+        if (int64_t wait = session->connection_bucket->take(now)) {
+            reject_rate_limited(session, "connection", wait);
+            return false;
+        }
+    }
+    if (session->user_bucket) {
+        if (int64_t wait = session->user_bucket->take(now)) {
+            reject_rate_limited(session, "user", wait);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Room limit for a chat message, checked before it is stored or broadcast.
+bool WebSocketServer::admit_room_message(const std::shared_ptr<Session> &session, const std::string &room) {
+    if (!room_limiter.enabled()) {
+        return true;
+    }
+    int64_t now = steady_now_us();
+    auto it = session->room_buckets.find(room);
+    if (it == session->room_buckets.end()) {
+        // Bound the cache for clients that spray messages across many rooms.
+        if (session->room_buckets.size() >= 256) {
+            session->room_buckets.clear();
+        }
+        it = session->room_buckets.emplace(room, room_limiter.bucket(room, now)).first;
+    }
+    if (int64_t wait = it->second->take(now)) {
+        reject_rate_limited(session, "room", wait, room);
+        return false;
+    }
+    return true;
+}
+
+// At most one notice per retry window, so a client that keeps flooding
+// can't grow its own write queue with them.
+void WebSocketServer::reject_rate_limited(const std::shared_ptr<Session> &session, const char *scope,
+                                          int64_t wait_us, const std::string &room) {
+    server_stats.rate_limited++;
+    int64_t now = steady_now_us();
+    if (now < session->rate_notice_until_us) {
+        return;
+    }
+    session->rate_notice_until_us = now + wait_us;
+    json response = {
+        {"type", "rate_limited"},
+        {"scope", scope},
+        {"retry_after_ms", (wait_us + 999) / 1000}
+    };
+    if (!room.empty()) {
+        response["room"] = room;
+    }
+    session->write(response.dump(), Session::Control);
+}
+
+void WebSocketServer::send_ack(const std::shared_ptr<Session> &session, const std::string &client_msg_id,
+                               const std::string &room, int64_t seq, bool duplicate) {
+    json response = {
+        {"type", "ack"},
+        {"client_msg_id", client_msg_id},
+        {"room", room},
+        {"seq", seq},
+        {"duplicate", duplicate}
+    };
+    session->write(response.dump(), Session::Control);
+}
+
+void WebSocketServer::remove_session(std::shared_ptr<Session> session) {
+    session->state = Session::Closed;
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    for (auto it = user_sessions.begin(); it != user_sessions.end(); ) {
+        if (it->second == session) {
+            std::cout << "[Cleanup] Removing user: " << it->first << std::endl;
+            it = user_sessions.erase(it);
         } else {
-            std::cout << "Handshake error: " << ec.message() << std::endl;
-            sessions.erase(session);
+            ++it;
+        }
+    }
+    for (const auto &room : session->rooms) {
+        auto it = room_members.find(room);
+        if (it == room_members.end()) {
+            continue;
+        }
+        it->second.erase(session);
+        // Offline once the user's last connection in the room is gone.
+        if (!session->username.empty() &&
+            std::none_of(it->second.begin(), it->second.end(), [&session](const std::shared_ptr<Session> &member) {
+                return member->username == session->username;
+            })) {
+            presence.presence(room, session->username, false);
+        }
+        if (it->second.empty()) {
+            room_members.erase(it);
+            if (backplane) {
+                backplane->unsubscribe(room);
+            }
+        }
+    }
+    session->rooms.clear();
+    sessions.erase(session);
+}
+
+// Subscribing under the lock keeps subscribe/unsubscribe for a room in the
+// same order as the membership changes behind them.
+std::vector<std::string> WebSocketServer::join_room(const std::string &room, std::shared_ptr<Session> session) {
+    std::lock_guard<std::mutex> lock(sessions_mutex);
+    std::vector<std::string> online;
+    if (session->state == Session::Closed) {
+        return online;
+    }
+    session->rooms.insert(room);
+    auto &members = room_members[room];
+    bool already_online = false;
+    for (const auto &member : members) {
+        if (!member->username.empty() && member != session) {
+            already_online = already_online || member->username == session->username;
+            online.push_back(member->username);
+        }
+    }
+    if (members.insert(session).second) {
+        if (members.size() == 1 && backplane) {
+            backplane->subscribe(room);
+        }
+        if (!session->username.empty() && !already_online) {
+            presence.presence(room, session->username, true);
+        }
+    }
+    if (!session->username.empty()) {
+        online.push_back(session->username);
+    }
+    std::sort(online.begin(), online.end());
+    online.erase(std::unique(online.begin(), online.end()), online.end());
+    return online;
+}
+
+// A message another node published: hand it to this node's members of the room.
+void WebSocketServer::deliver_remote(const std::string &room, const std::string &payload) {
+    deliver_to_room(room, std::make_shared<const std::string>(payload));
+}
+
+void WebSocketServer::deliver_to_room(const std::string &room, const std::shared_ptr<const std::string> &payload) {
+    std::vector<std::shared_ptr<Session>> recipients;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        auto it = room_members.find(room);
+        if (it == room_members.end()) {
+            return;
+        }
+        recipients.assign(it->second.begin(), it->second.end());
+    }
+    for (auto &s : recipients) {
+        s->write(payload);
+    }
+}
+
+//----------------------
+// Graceful shutdown
+//----------------------
+void WebSocketServer::shutdown(std::function<void()> on_drained) {
+    if (stopping.exchange(true)) {
+        return;
+    }
+    asio::post(acceptor.get_executor(), [this]() {
+        boost::system::error_code ec;
+        acceptor.close(ec);
+    });
+
+    std::vector<std::shared_ptr<Session>> open_sessions;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        open_sessions.assign(sessions.begin(), sessions.end());
+    }
+    std::cout << "[Shutdown] Draining " << open_sessions.size() << " sessions." << std::endl;
+    for (auto &session : open_sessions) {
+        session->close(websocket::close_code::going_away);
+    }
+
+    asio::post(drain_timer.get_executor(), [this, on_drained]() {
+        this->on_drained = on_drained;
+        drain_deadline_ms = steady_now_ms() + config.drain_timeout_ms;
+        poll_drain();
+    });
+}
+
+// Sessions leave the set as their close handshakes finish; whatever is left at
+// the deadline is closed hard. Only then is pending database work flushed.
+void WebSocketServer::poll_drain() {
+    std::vector<std::shared_ptr<Session>> remaining;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        remaining.assign(sessions.begin(), sessions.end());
+    }
+    if (!remaining.empty() && steady_now_ms() < drain_deadline_ms) {
+        drain_timer.expires_after(std::chrono::milliseconds(10));
+        drain_timer.async_wait([this](boost::system::error_code ec) {
+            if (!ec) {
+                poll_drain();
+            }
+        });
+        return;
+    }
+
+    for (auto &session : remaining) {
+        std::cout << "[Shutdown] Drain timed out, closing connection." << std::endl;
+        asio::post(session->strand, [session]() { session->close_socket(); });
+    }
+    // Let queued database work finish before the final checkpoint. That can
+    // take a while (a preload, a compaction pass), so wait for it on a thread
+    // of its own rather than stall this io thread's sessions.
+    drain_thread = std::thread([this]() {
+        db_pool.join();
+        if (!dbManager.checkpoint()) {
+            std::cerr << "[Shutdown] Failed to checkpoint the database." << std::endl;
+        }
+        std::cout << "[Shutdown] Drain complete." << std::endl;
+        if (on_drained) {
+            on_drained();
+        }
+    });
+}
+
+//----------------------
+// Timeouts and keepalive
+//----------------------
+void WebSocketServer::start_timers() {
+    bool expected = false;
+    if (!timers_started.compare_exchange_strong(expected, true)) {
+        return;
+    }
+    if (config.tick_ms > 0) {
+        arm_tick();
+    }
+    if (config.compaction_interval_ms > 0) {
+        arm_compaction();
+    }
+    if (config.presence_flush_ms > 0) {
+        arm_presence_flush();
+    }
+}
+
+void WebSocketServer::arm_compaction() {
+    compaction_timer.expires_after(std::chrono::milliseconds(config.compaction_interval_ms));
+    compaction_timer.async_wait([this](boost::system::error_code ec) {
+        if (ec || stopping) {
+            return;
+        }
+        compact();
+        arm_compaction();
+    });
+}
+
+void WebSocketServer::compact(bool start_cache) {
+    asio::post(db_pool, [this, start_cache]() {
+        if (stopping) {
+            return;
+        }
+        std::vector<std::string> expired;
+        dbManager.compactPartitions(std::time(nullptr), expired);
+        if (config.preload_rooms <= 0) {
+            return;
+        }
+        if (start_cache) {
+            start_preload(room_cache.generation());
+            return;
+        }
+        // Archiving leaves history as readers see it; only rooms retention
+        // cut into hold messages that are gone. Reload those that were
+        // cached; one still loading is dropped when its read lands.
+        uint64_t generation = room_cache.generation();
+        for (const auto &room : expired) {
+            if (room_cache.invalidate(room)) {
+                asio::post(db_pool, [this, room, generation]() {
+                    if (!stopping) {
+                        load_room(room, generation);
+                    }
+                });
+            }
         }
     });
 }
 
+// Sends each room whose typing or presence changed one frame for the window,
+// locally and through the backplane.
+void WebSocketServer::arm_presence_flush() {
+    presence_timer.expires_after(std::chrono::milliseconds(config.presence_flush_ms));
+    presence_timer.async_wait([this](boost::system::error_code ec) {
+        if (ec || stopping) {
+            return;
+        }
+        for (auto &frame : presence.flush(steady_now_ms())) {
+            auto payload = std::make_shared<const std::string>(std::move(frame.second));
+            deliver_to_room(frame.first, payload);
+            if (backplane) {
+                backplane->publish(frame.first, *payload);
+            }
+        }
+        arm_presence_flush();
+    });
+}
+
+void WebSocketServer::arm_tick() {
+    tick_timer.expires_after(std::chrono::milliseconds(config.tick_ms));
+    tick_timer.async_wait([this](boost::system::error_code ec) {
+        if (!ec && !stopping) {
+            on_tick();
+        }
+    });
+}
+
+void WebSocketServer::on_tick() {
+    std::vector<std::shared_ptr<Session>> due;
+    {
+        std::lock_guard<std::mutex> lock(timer_mutex);
+        timer_wheel.advance(steady_now_ms() / config.tick_ms, [&due](const std::weak_ptr<Session> &weak) {
+            if (auto session = weak.lock()) {
+                due.push_back(session);
+            }
+        });
+    }
+    for (auto &session : due) {
+        asio::post(session->strand, [this, session]() { check_session(session); });
+    }
+    arm_tick();
+}
+
+void WebSocketServer::schedule_check(const std::shared_ptr<Session> &session, int64_t deadline_ms) {
+    if (config.tick_ms <= 0) {
+        return;
+    }
+    // Round up so a check never fires before its deadline.
+    uint64_t tick = static_cast<uint64_t>((deadline_ms + config.tick_ms - 1) / config.tick_ms);
+    std::lock_guard<std::mutex> lock(timer_mutex);
+    timer_wheel.schedule(tick, session);
+}
+
+// Runs on the session's strand whenever its next deadline comes due. Each
+// session has at most one pending wheel entry; activity in between only
+// updates timestamps and the entry is re-armed here for the next deadline.
+void WebSocketServer::check_session(std::shared_ptr<Session> session) {
+    if (session->state == Session::Closing || session->state == Session::Closed) {
+        return;
+    }
+    int64_t now = steady_now_ms();
+
+    if (session->state == Session::Handshake) {
+        int64_t deadline = session->created_ms + config.handshake_timeout_ms;
+        if (now >= deadline) {
+            std::cout << "[Timeout] Handshake not completed, closing connection." << std::endl;
+            server_stats.reaped_handshake++;
+            session->close_socket();
+        } else {
+            schedule_check(session, deadline);
+        }
+        return;
+    }
+
+    int64_t next = INT64_MAX;
+    int64_t write_started = session->write_started_ms;
+    if (config.write_timeout_ms > 0 && write_started != 0) {
+        if (now - write_started >= config.write_timeout_ms) {
+            std::cout << "[Timeout] Write stalled, closing connection." << std::endl;
+            server_stats.reaped_write++;
+            session->close_socket();
+            return;
+        }
+        next = std::min(next, write_started + config.write_timeout_ms);
+    } else if (config.write_timeout_ms > 0) {
+        // Writes may start at any time; look again within one timeout window.
+        next = std::min(next, now + config.write_timeout_ms);
+    }
+
+    int64_t last_activity = session->last_activity_ms;
+    if (config.idle_timeout_ms > 0) {
+        if (now - last_activity >= config.idle_timeout_ms) {
+            std::cout << "[Timeout] Connection idle, closing connection." << std::endl;
+            server_stats.reaped_idle++;
+            session->close_socket();
+            return;
+        }
+        next = std::min(next, last_activity + config.idle_timeout_ms);
+    }
+
+    if (config.ping_interval_ms > 0) {
+        if (now - last_activity >= config.ping_interval_ms && !session->ping_outstanding) {
+            session->ping_outstanding = true;
+            server_stats.pings_sent++;
+            session->with_stream([&session](auto &stream) {
+                // A pong may never come; once the ping is written, the next
+                // check may send another.
+                stream.async_ping({}, [session](boost::system::error_code ec) {
+                    if (ec) {
+                        session->close_socket();
+                    } else {
+                        session->ping_outstanding = false;
+                    }
+                });
+            });
+        }
+        if (!session->ping_outstanding) {
+            next = std::min(next, last_activity + config.ping_interval_ms);
+        }
+    }
+
+    if (next != INT64_MAX) {
+        schedule_check(session, next);
+    }
+}
+
 void WebSocketServer::handle_login(const std::string& username, std::shared_ptr<Session> session) {
+    if (session->username != username) {
+        session->username = username;
+        session->user_bucket = user_limiter.bucket(username, steady_now_us());
+    }
+    std::lock_guard<std::mutex> lock(sessions_mutex);
     user_sessions[username] = session;
     std::cout << "[Login] User '" << username << "' logged in." << std::endl;
     std::cout << "[Login] Total logged-in users: " << user_sessions.size() << std::endl;
 }
 
-void WebSocketServer::handle_read(std::shared_ptr<Session> session, std::shared_ptr<flat_buffer> buffer) {
-    session->ws->async_read(*buffer, [this, session, buffer](boost::system::error_code ec, std::size_t) {
-        if (!ec) {
-            std::string received = beast::buffers_to_string(buffer->data());
-            std::cout << "Received message: " << received << std::endl;
-            try {
-                auto j = json::parse(received);
-                if (j.contains("type")) {
-                    std::string msgType = j["type"];
-
-                    // LOGIN handling: verify credentials against the database
-                    if (msgType == "login" && j.contains("username") && j.contains("password")) {
-                        std::string username = j["username"];
-                        std::string password = j["password"];
-                        if (dbManager.authenticateUser(username, password)) {
-                            handle_login(username, session);
-                            json response = {
-                                {"type", "login_response"},
-                                {"status", "success"},
-                                {"message", "Login successful"}
-                            };
-                            session->write(response.dump());
-                        } else {
-                            json response = {
-                                {"type", "login_response"},
-                                {"status", "error"},
-                                {"message", "Invalid credentials"}
-                            };
-                            session->write(response.dump());
-                        }
+void WebSocketServer::start_preload(uint64_t generation) {
+    int64_t started_ms = steady_now_ms();
+    asio::post(db_pool, [this, generation, started_ms]() {
+        if (stopping || room_cache.generation() != generation) {
+            return;
+        }
+        auto rooms = std::make_shared<std::vector<std::string>>(
+            dbManager.activeRooms(static_cast<std::size_t>(config.preload_rooms)));
+        auto remaining = std::make_shared<std::atomic<std::size_t>>(rooms->size());
+        auto finish = [this, generation, started_ms]() {
+            // A preload cancelled by clear() leaves the report to its successor.
+            if (room_cache.generation() != generation) {
+                return;
+            }
+            server_stats.preload_ms = std::max<int64_t>(steady_now_ms() - started_ms, 1);
+            std::cout << "[Preload] " << room_cache.rooms() << " rooms, " << room_cache.bytes() / 1024
+                      << " KB in " << server_stats.preload_ms << " ms" << std::endl;
+        };
+        if (rooms->empty()) {
+            finish();
+            return;
+        }
+        // One task per room, so every database thread takes part and other
+        // database work still gets a turn between rooms.
+        for (std::size_t i = 0; i < rooms->size(); ++i) {
+            asio::post(db_pool, [this, generation, rooms, remaining, finish, i]() {
+                if (!stopping && load_room((*rooms)[i], generation)) {
+                    server_stats.preload_rooms_loaded++;
+                }
+                if (--*remaining == 0) {
+                    finish();
+                }
+            });
+        }
+    });
+}
+
+bool WebSocketServer::load_room(const std::string &room, uint64_t generation) {
+    return room_cache.begin_load(room, generation) &&
+           room_cache.finish_load(room, generation, history_frames(room));
+}
+
+std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>>
+WebSocketServer::history_frames(const std::string &room) {
+    if (config.preload_rooms > 0 && config.preload_messages_per_room > 0) {
+        return dbManager.recentFrames(room, config.preload_messages_per_room);
+    }
+    return dbManager.historyFrames(room);
+}
+
+void WebSocketServer::send_history(std::shared_ptr<Session> session, const std::string &room) {
+    std::vector<RoomCache::Frame> cached;
+    if (room_cache.snapshot(room, cached)) {
+        server_stats.history_cache_hits++;
+        if (!cached.empty()) {
+            session->write(std::move(cached), Session::Bulk);
+        }
+        return;
+    }
+    server_stats.history_cache_misses++;
+
+    // Loaded on the database pool and queued in one batch on the bulk lane,
+    // so a large room's backlog neither blocks the session's strand nor
+    // holds up its control and live frames.
+    asio::post(db_pool, [this, session, room]() {
+        std::vector<std::shared_ptr<const std::string>> frames;
+        for (auto &entry : history_frames(room)) {
+            frames.push_back(std::move(entry.second));
+        }
+        if (!frames.empty()) {
+            session->write(std::move(frames), Session::Bulk);
+        }
+    });
+}
+
+void WebSocketServer::handle_search(std::shared_ptr<Session> session, const json &request) {
+    std::string room = request["room"];
+    std::string query = request["query"];
+    std::string sender = request.contains("sender") ? request["sender"].get<std::string>() : "";
+    int64_t requested_limit = request.contains("limit") ? request["limit"].get<int64_t>() : config.search_page_size;
+    int64_t requested_offset = request.contains("offset") ? request["offset"].get<int64_t>() : 0;
+    int limit = static_cast<int>(std::clamp<int64_t>(requested_limit, 1, config.search_max_results));
+    // Keep offset + limit, echoed back as next_offset, within int.
+    int offset = static_cast<int>(
+        std::clamp<int64_t>(requested_offset, 0, int64_t(std::numeric_limits<int>::max()) - limit));
+
+    // Say so rather than answer with an empty page that reads as "no matches".
+    if (!dbManager.supportsSearch()) {
+        json response = {
+            {"type", "search_results"},
+            {"room", room},
+            {"query", query},
+            {"status", "error"},
+            {"error", "unsupported"},
+            {"message", "Search is not supported by this server's storage engine"},
+            {"results", json::array()},
+            {"done", true}
+        };
+        session->write(response.dump(), Session::Control);
+        return;
+    }
+
+    asio::post(db_pool, [this, session, room, query, sender, limit, offset]() {
+        // Ask for one extra row to learn whether another page exists.
+        auto results = dbManager.searchMessages(room, sender, query, limit + 1, offset);
+        bool more = results.size() > static_cast<std::size_t>(limit);
+        if (more) {
+            results.pop_back();
+        }
+
+        // Stream the page back in bounded frames; the last one carries "done".
+        std::size_t index = 0;
+        do {
+            json frame = {
+                {"type", "search_results"},
+                {"room", room},
+                {"query", query},
+                {"offset", offset + static_cast<int>(index)},
+                {"results", json::array()}
+            };
+            std::size_t frame_bytes = 0;
+            while (index < results.size() &&
+                   frame["results"].size() < static_cast<std::size_t>(config.search_frame_results) &&
+                   (frame["results"].empty() || frame_bytes < config.search_frame_bytes)) {
+                frame_bytes += results[index]["content"].get_ref<const std::string&>().size();
+                frame["results"].push_back(std::move(results[index]));
+                ++index;
+            }
+            bool done = index == results.size();
+            frame["done"] = done;
+            if (done && more) {
+                frame["next_offset"] = offset + limit;
+            }
+            // Result pages can be large; keep them out of the way of live chat.
+            session->write(frame.dump(), Session::Bulk);
+        } while (index < results.size());
+    });
+}
+
+// Dispatch one text frame from the client. Runs on the session's strand.
+void WebSocketServer::handle_message(const std::shared_ptr<Session> &session,
+                                     const std::shared_ptr<const std::string> &payload) {
+    const std::string &received = *payload;
+    std::cout << "Received message: " << received << std::endl;
+    try {
+        json j;
+        {
+            TraceSpan span("parse");
+            j = json::parse(received);
+        }
+        if (j.contains("type")) {
+            std::string msgType = j["type"];
+
+            // LOGIN handling: verify credentials against the database
+            if (msgType == "login" && j.contains("username") && j.contains("password")) {
+                std::string username = j["username"];
+                std::string password = j["password"];
+                if (dbManager.authenticateUser(username, password)) {
+                    handle_login(username, session);
+                    json response = {
+                        {"type", "login_response"},
+                        {"status", "success"},
+                        {"message", "Login successful"}
+                    };
+                    session->write(response.dump(), Session::Control);
+                } else {
+                    json response = {
+                        {"type", "login_response"},
+                        {"status", "error"},
+                        {"message", "Invalid credentials"}
+                    };
+                    session->write(response.dump(), Session::Control);
+                }
+            }
+            // JOIN handling: associate user with room and send history sequentially
+            else if (msgType == "join" && j.contains("username") && j.contains("room")) {
+                std::string username = j["username"];
+                std::string room = j["room"];
+                handle_login(username, session);
+                auto online = join_room(room, session);
+                std::cout << "[Join] User '" << username << "' joined room '" << room << "'" << std::endl;
+                json response = {
+                    {"type", "join_response"},
+                    {"status", "success"},
+                    {"message", "Joined room successfully"},
+                    {"online", online}
+                };
+                session->write(response.dump(), Session::Control);
+                send_history(session, room);
+            }
+            // TYPING handling: ephemeral, never stored; coalesced into the room's next presence frame
+            else if (msgType == "typing" && j.contains("room") && !session->username.empty()) {
+                std::string room = j["room"];
+                bool active = j.contains("typing") ? j["typing"].get<bool>() : true;
+                bool member;
+                {
+                    std::lock_guard<std::mutex> lock(sessions_mutex);
+                    member = session->rooms.count(room) > 0;
+                }
+                if (member) {
+                    presence.typing(room, session->username, active, steady_now_ms());
+                }
+            }
+            // SEARCH handling: ranked full-text search, run on the database pool
+            else if (msgType == "search" && j.contains("room") && j.contains("query")) {
+                handle_search(session, j);
+            }
+            // SIGNUP handling: register the user in the database
+            else if (msgType == "signup" && j.contains("username") && j.contains("password")) {
+                std::string username = j["username"];
+                std::string password = j["password"];
+                if (dbManager.registerUser(username, password)) {
+                    json response = {
+                        {"type", "signup_response"},
+                        {"status", "success"},
+                        {"message", "Registration successful"}
+                    };
+                    session->write(response.dump(), Session::Control);
+                } else {
+                    json response = {
+                        {"type", "signup_response"},
+                        {"status", "error"},
+                        {"message", "Registration failed, username may already exist"}
+                    };
+                    session->write(response.dump(), Session::Control);
+                }
+            }
+            // Message handling: broadcast or route messages and store them in the database
+            else if (msgType == "message" && j.contains("from") && j.contains("room") &&
+                     (j.contains("text") || j.contains("content"))) {
+                std::string room = j["room"];
+                std::string text = j.contains("text") ? j["text"].get<std::string>() : j["content"].get<std::string>();
+                std::string timestamp = j.contains("timestamp") ? j["timestamp"].get<std::string>() : "";
+
+                std::string client_msg_id = j.contains("client_msg_id") ? j["client_msg_id"].get<std::string>() : "";
+
+                // The sender is whoever this connection logged in or joined
+                // as. Dedup and the stored (sender, client_msg_id) key use
+                // that name, so one client can't answer or block another's
+                // retries by claiming its "from".
+                if (session->username.empty() || j["from"] != session->username) {
+                    json response = {
+                        {"type", "message_response"},
+                        {"status", "error"},
+                        {"error", session->username.empty() ? "not_logged_in" : "sender_mismatch"},
+                        {"message", "Messages must be sent as the user this connection logged in as"},
+                        {"room", room}
+                    };
+                    if (!client_msg_id.empty()) {
+                        response["client_msg_id"] = client_msg_id;
                     }
-                    // JOIN handling: associate user with room and send history sequentially
-                    else if (msgType == "join" && j.contains("username") && j.contains("room")) {
-                        std::string username = j["username"];
-                        std::string room = j["room"];
-                        handle_login(username, session);
-                        std::cout << "[Join] User '" << username << "' joined room '" << room << "'" << std::endl;
-                        json response = {
-                            {"type", "join_response"},
-                            {"status", "success"},
-                            {"message", "Joined room successfully"}
-                        };
-                        session->write(response.dump());
-                        // Load previous messages for the room and send them sequentially.
-                        auto history = dbManager.getMessagesForRoom(room);
-                        std::function<void(std::size_t)> send_history;
-                        send_history = [session, history, &send_history](std::size_t index) mutable {
-                            if (index < history.size()) {
-                                session->write(history[index].dump());
-                                send_history(index + 1);
-                            }
-                        };
-                        send_history(0);
+                    session->write(response.dump(), Session::Control);
+                    return;
+                }
+                std::string from = session->username;
+
+                if (!admit_room_message(session, room)) {
+                    return;
+                }
+
+                // A resend of a message we already have: acknowledge it with
+                // the original sequence and don't store or broadcast it again.
+                int64_t now_ms = steady_now_ms();
+                int64_t seq = 0;
+                if (!client_msg_id.empty() && (seq = dedup.find(from, client_msg_id, now_ms)) != 0) {
+                    server_stats.duplicates++;
+                    server_stats.duplicates_from_index++;
+                    send_ack(session, client_msg_id, room, seq, true);
+                    return;
+                }
+
+                // Store the message in the database.
+                bool duplicate = false;
+                bool stored;
+                {
+                    TraceSpan span("persist");
+                    stored = dbManager.storeMessage(room, from, text, timestamp, client_msg_id, seq, duplicate);
+                }
+                if (!stored) {
+                    std::cerr << "[DB] Failed to store message from '" << from << "' in room '" << room << "'" << std::endl;
+                } else if (!duplicate && room_cache.tracks(room)) {
+                    // As getMessagesForRoom would return it.
+                    json entry = {
+                        {"type", "message"},
+                        {"room", room},
+                        {"from", from},
+                        {"content", text},
+                        {"timestamp", timestamp},
+                        {"seq", seq}
+                    };
+                    room_cache.append(room, seq, std::make_shared<const std::string>(entry.dump()));
+                }
+                if (!client_msg_id.empty()) {
+                    if (duplicate) {
+                        server_stats.duplicates++;
+                        dedup.insert(from, client_msg_id, seq, now_ms);
+                        send_ack(session, client_msg_id, room, seq, true);
+                        return;
                     }
-                    // SIGNUP handling: register the user in the database
-                    else if (msgType == "signup" && j.contains("username") && j.contains("password")) {
-                        std::string username = j["username"];
-                        std::string password = j["password"];
-                        if (dbManager.registerUser(username, password)) {
-                            json response = {
-                                {"type", "signup_response"},
-                                {"status", "success"},
-                                {"message", "Registration successful"}
-                            };
-                            session->write(response.dump());
-                        } else {
-                            json response = {
-                                {"type", "signup_response"},
-                                {"status", "error"},
-                                {"message", "Registration failed, username may already exist"}
-                            };
-                            session->write(response.dump());
-                        }
+                    if (seq != 0) {
+                        dedup.insert(from, client_msg_id, seq, now_ms);
                     }
-                    // Message handling: broadcast or route messages and store them in the database
-                    else if (msgType == "message" && j.contains("from") && j.contains("room") &&
-                             (j.contains("text") || j.contains("content"))) {
-                        std::string from = j["from"];
-                        std::string room = j["room"];
-                        std::string text = j.contains("text") ? j["text"].get<std::string>() : j["content"].get<std::string>();
-                        std::string timestamp = j.contains("timestamp") ? j["timestamp"].get<std::string>() : "";
-
-                        // Store the message in the database.
-                        if (!dbManager.storeMessage(room, from, text, timestamp)) {
-                            std::cerr << "[DB] Failed to store message from '" << from << "' in room '" << room << "'" << std::endl;
-                        }
+                }
 
-                        if (true) {
-                            std::cout << "[Broadcast] Message from '" << from << "' to chat room '" << room << "': " << text << std::endl;
-                            // Broadcast the message to all sessions.
-                            for (auto &s : sessions) {
-                                s->write(received);
-                            }
-                        } else {
-                            std::cout << "[Routing] Message from '" << from << "' to '" << room << "': " << text << std::endl;
-                            if (user_sessions.find(room) != user_sessions.end()) {
-                                auto target_session = user_sessions[room];
-                                target_session->write(received);
-                            } else {
-                                std::cerr << "[Routing] Recipient '" << room << "' not found. Message from '"
-                                          << from << "' not delivered." << std::endl;
-                            }
+                if (true) {
+                    std::cout << "[Broadcast] Message from '" << from << "' to chat room '" << room << "': " << text << std::endl;
+                    // Members of the room on this node, as for remote messages.
+                    deliver_to_room(room, payload);
+                    // Members on other nodes get it through the backplane.
+                    if (backplane) {
+                        backplane->publish(room, received);
+                    }
+                    if (!client_msg_id.empty() && seq != 0) {
+                        send_ack(session, client_msg_id, room, seq, false);
+                    }
+                } else {
+                    std::cout << "[Routing] Message from '" << from << "' to '" << room << "': " << text << std::endl;
+                    std::shared_ptr<Session> target_session;
+                    {
+                        std::lock_guard<std::mutex> lock(sessions_mutex);
+                        auto it = user_sessions.find(room);
+                        if (it != user_sessions.end()) {
+                            target_session = it->second;
                         }
+                    }
+                    if (target_session) {
+                        target_session->write(received);
                     } else {
-                        std::cout << "[Info] Unknown or improperly formatted message type received." << std::endl;
+                        std::cerr << "[Routing] Recipient '" << room << "' not found. Message from '"
+                                  << from << "' not delivered." << std::endl;
                     }
                 }
-            } catch (const std::exception& e) {
-                std::cerr << "[Error] JSON parse error: " << e.what() << std::endl;
+            } else {
+                std::cout << "[Info] Unknown or improperly formatted message type received." << std::endl;
             }
-            buffer->consume(buffer->size());
-            handle_read(session, buffer); // Continue reading messages
-        } else {
-            std::cout << "[Disconnect] Client disconnected. Reason: " << ec.message() << std::endl;
-            for (auto it = user_sessions.begin(); it != user_sessions.end(); ) {
-                if (it->second == session) {
-                    std::cout << "[Cleanup] Removing user: " << it->first << std::endl;
-                    it = user_sessions.erase(it);
-                } else {
-                    ++it;
-                }
-            }
-            sessions.erase(session);
         }
-    });
+    } catch (const std::exception& e) {
+        std::cerr << "[Error] JSON parse error: " << e.what() << std::endl;
+    }
 }
@@ -1,14 +1,37 @@
 #ifndef WEBSOCKET_SERVER_H
 #define WEBSOCKET_SERVER_H
 
+#include "IoBackend.h"
 #include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/ssl.hpp>
 #include <boost/beast.hpp>
+#include <boost/beast/ssl.hpp>
 #include <set>
 #include <unordered_map>
 #include <memory>
 #include <deque>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <functional>
+#include <chrono>
+#include <thread>
 #include "DatabaseManager.h"
+#include "TimerWheel.h"
+#include "Backplane.h"
+#include "KtlsStream.h"
+#include "UringStream.h"
+#include "RateLimiter.h"
+#include "PresenceCoalescer.h"
+#include "DedupIndex.h"
+#include "Tracer.h"
+#include "RoomCache.h"
 
 namespace asio = boost::asio;
 namespace beast = boost::beast;
@@ -18,16 +41,182 @@ using tcp = asio::ip::tcp;
 // Forward declaration of Session.
 struct Session;
 
+// Every session's I/O runs on its own strand. The socket, timer and coroutines
+// name the strand type directly rather than the type-erased any_io_executor,
+// whose copies of a strand allocate on every asynchronous operation.
+using session_executor = asio::strand<asio::io_context::executor_type>;
+using session_socket = asio::basic_stream_socket<tcp, session_executor>;
+using session_timer = asio::basic_waitable_timer<std::chrono::steady_clock,
+                                                 asio::wait_traits<std::chrono::steady_clock>, session_executor>;
+template <typename T>
+using session_awaitable = asio::awaitable<T, session_executor>;
+// Completion token for operations awaited inside session coroutines.
+constexpr asio::use_awaitable_t<session_executor> use_session_awaitable;
+
+// Connection timeouts, in milliseconds. A value of 0 disables that check.
+struct ServerConfig {
+    // Time allowed between TCP accept and a completed WebSocket handshake.
+    int handshake_timeout_ms = 10000;
+    // Close connections that have sent nothing (not even a pong) for this long.
+    int idle_timeout_ms = 60000;
+    // Ping connections that have been quiet for this long.
+    int ping_interval_ms = 20000;
+    // Close connections whose in-flight write has not completed in this long.
+    int write_timeout_ms = 30000;
+    // Granularity of the timer wheel that drives all of the above; 0 turns
+    // the wheel off, and with it every timeout and keepalive ping.
+    int tick_ms = 250;
+    // How long shutdown() waits for write queues to drain before forcing connections closed.
+    int drain_timeout_ms = 5000;
+
+    // Threads that run blocking database queries (search) off the io threads.
+    int db_threads = 2;
+    // Default and maximum page size for "search" requests.
+    int search_page_size = 20;
+    int search_max_results = 100;
+    // Results are streamed back in frames of at most this many results / bytes.
+    int search_frame_results = 25;
+    std::size_t search_frame_bytes = 64 * 1024;
+
+    // Admission control for connect storms. The listener keeps accept_batch
+    // accepts pending at once, stops accepting while max_handshakes TLS or
+    // WebSocket handshakes are in flight (new connections wait in the listen
+    // backlog meanwhile), and resets connections beyond max_connections
+    // straight away. 0 disables the handshake and connection caps.
+    int listen_backlog = asio::socket_base::max_listen_connections;
+    int accept_batch = 4;
+    int max_handshakes = 256;
+    int max_connections = 10000;
+
+    // Each session's read buffer is allocated at this size up front, so one
+    // read picks up every frame the client has already sent.
+    std::size_t read_buffer_bytes = 16 * 1024;
+
+    // Run plain ws:// sockets on an io_uring of io_uring_entries submission
+    // slots rather than Asio's epoll reactor (see UringStream). Reads land in
+    // io_uring_read_buffers buffers of read_buffer_bytes registered with the
+    // kernel, and the sends of one broadcast go out in a single system call.
+    // wss:// sessions stay on the reactor.
+    bool io_uring = false;
+    unsigned io_uring_entries = 4096;
+    std::size_t io_uring_read_buffers = 256;
+
+    // Typing and presence events are not stored; each room's events are
+    // gathered for this long and sent to its members as one "presence" frame.
+    int presence_flush_ms = 100;
+    // A typing indicator lapses if the client doesn't refresh it in this long.
+    int typing_timeout_ms = 5000;
+
+    // How often cold message partitions are archived (DatabaseManager::compactPartitions).
+    int compaction_interval_ms = 60 * 60 * 1000;
+
+    // PEM certificate chain and private key. When both are set the listener
+    // speaks wss:// only; TLS 1.2 is the minimum.
+    std::string tls_certificate_file;
+    std::string tls_private_key_file;
+    // TLS 1.3 session tickets issued after each full handshake, so reconnecting
+    // clients can resume without the certificate exchange. 0 disables resumption.
+    int tls_session_tickets = 2;
+    // Hand record encryption to the kernel (kTLS) after the handshake. Falls
+    // back to user-space TLS when the kernel or cipher doesn't support it.
+    bool tls_ktls = false;
+
+    // Token-bucket limits on inbound frames, as sustained frames per second
+    // and burst size: per connection, per logged-in user across all of their
+    // connections, and per room for chat messages. A rate of 0 disables that
+    // limit. Frames over a limit are dropped before they are parsed or stored.
+    double connection_rate = 200;
+    int connection_burst = 500;
+    double user_rate = 200;
+    int user_burst = 500;
+    double room_rate = 2000;
+    int room_burst = 5000;
+
+    // Chat messages may carry a "client_msg_id". A resend of an id the
+    // server has already accepted is acknowledged with the original sequence
+    // number instead of being stored and broadcast again. Ids are remembered
+    // in memory for this long, up to this many per user; past that the
+    // database's unique index still catches the duplicate.
+    int dedup_window_ms = 10 * 60 * 1000;
+    int dedup_max_per_user = 1024;
+
+    // Record per-message tracing spans (see Tracer) into rings of this many
+    // events per thread. 0 leaves tracing as it is; the trace is written on
+    // demand with Tracer::global().dump().
+    std::size_t trace_events_per_thread = 0;
+
+    // Warm history cache: at startup, load the recent history of up to this
+    // many of the busiest rooms into memory on the database threads, so the
+    // first joins after a restart don't wait on cold SQLite reads. Connections
+    // are accepted while it runs; joins into rooms not loaded yet read the
+    // database as usual. Cached rooms are kept current as messages arrive and,
+    // past the byte budget, the least recently joined are dropped. 0 disables.
+    int preload_rooms = 0;
+    std::size_t preload_budget_bytes = 256 * 1024 * 1024;
+    // With the cache on, a join replays only the room's newest this many
+    // messages, cached or not, and each cached room holds no more. 0 keeps
+    // and replays whole histories.
+    std::size_t preload_messages_per_room = 1000;
+};
+
+// Counters for connections the server closed on its own.
+struct ServerStats {
+    std::atomic<uint64_t> reaped_handshake{0};
+    std::atomic<uint64_t> reaped_idle{0};
+    std::atomic<uint64_t> reaped_write{0};
+    std::atomic<uint64_t> pings_sent{0};
+    // Completed TLS handshakes, how many of them resumed a session, and how
+    // many connections ended up with kernel TLS on the send side.
+    std::atomic<uint64_t> tls_handshakes{0};
+    std::atomic<uint64_t> tls_resumed{0};
+    std::atomic<uint64_t> ktls_connections{0};
+    // Frames dropped by a rate limit.
+    std::atomic<uint64_t> rate_limited{0};
+    // Resent messages acknowledged without a second broadcast, and how many
+    // of those the in-memory index answered.
+    std::atomic<uint64_t> duplicates{0};
+    std::atomic<uint64_t> duplicates_from_index{0};
+    // Joins answered from the warm history cache and from the database.
+    std::atomic<uint64_t> history_cache_hits{0};
+    std::atomic<uint64_t> history_cache_misses{0};
+    // Rooms the startup preload loaded, and how long it took from
+    // start_accept(); 0 until it finishes.
+    std::atomic<uint64_t> preload_rooms_loaded{0};
+    std::atomic<int64_t> preload_ms{0};
+    // Connections reset because max_connections was reached, and how often
+    // accepting paused on max_handshakes.
+    std::atomic<uint64_t> connections_rejected{0};
+    std::atomic<uint64_t> accepts_paused{0};
+    // Current accepted connections and handshakes in progress.
+    std::atomic<int64_t> connections{0};
+    std::atomic<int64_t> handshakes_in_flight{0};
+};
+
 // WebSocketServer now uses Session objects.
 class WebSocketServer {
 public:
-    WebSocketServer(asio::io_context& context, int port, DatabaseManager &dbManager);
+    // With a backplane, room messages are shared with the other nodes on it;
+    // the backplane must outlive the server.
+    WebSocketServer(asio::io_context& context, int port, DatabaseManager &dbManager,
+                    const ServerConfig &config = ServerConfig(), Backplane *backplane = nullptr);
+    ~WebSocketServer();
     // Add start_accept() here so it's accessible from main.cpp
     void start_accept();
 
     // You may also leave run() if it's still needed.
     void run();
 
+    // Stop accepting, flush every session's write queue and close it with
+    // "going away", then checkpoint the database. on_drained runs once all
+    // sessions are gone or the drain timeout expires. Safe to call from any thread.
+    void shutdown(std::function<void()> on_drained);
+
+    const ServerStats &stats() const { return server_stats; }
+    // With io_uring on, the io_uring_enter calls that submitted work and the
+    // reads and writes they carried; 0 otherwise.
+    uint64_t uring_submit_calls() const { return uring ? uring->submit_calls() : 0; }
+    uint64_t uring_submitted() const { return uring ? uring->submitted() : 0; }
+
 private:
     asio::io_context &context;
     tcp::acceptor acceptor;
@@ -35,31 +224,209 @@ private:
     std::set<std::shared_ptr<Session>> sessions;
     // Map of username to session for logged-in users.
     std::unordered_map<std::string, std::shared_ptr<Session>> user_sessions;
+    // Sessions that joined each room; the backplane is subscribed to exactly
+    // the rooms listed here.
+    std::unordered_map<std::string, std::set<std::shared_ptr<Session>>> room_members;
+    // Guards sessions, user_sessions, room_members and Session::rooms, which
+    // are touched from every session strand.
+    std::mutex sessions_mutex;
     DatabaseManager &dbManager;
+    ServerConfig config;
+    ServerStats server_stats;
+    Backplane *backplane;
+
+    // One timer wheel for every connection's deadlines, advanced by a single
+    // steady_timer rather than one timer per connection.
+    TimerWheel<std::weak_ptr<Session>> timer_wheel;
+    std::mutex timer_mutex;
+    asio::steady_timer tick_timer;
+    std::atomic<bool> timers_started{false};
 
+    std::atomic<bool> stopping{false};
+    asio::steady_timer drain_timer;
+    int64_t drain_deadline_ms = 0;
+    std::function<void()> on_drained;
+    // Waits out db_pool and checkpoints once the sessions are gone.
+    std::thread drain_thread;
 
+    asio::thread_pool db_pool;
+    asio::steady_timer compaction_timer;
+
+    // Set when TLS is configured.
+    std::unique_ptr<asio::ssl::context> tls_context;
+    bool use_ktls = false;
+    // Set when io_uring was asked for.
+    std::unique_ptr<IoUring> uring;
+
+    bool setup_tls();
+
+    // Shared per-user and per-room buckets; each session caches the ones it uses.
+    RateLimiter user_limiter;
+    RateLimiter room_limiter;
+
+    PresenceCoalescer presence;
+    asio::steady_timer presence_timer;
+
+    DedupIndex dedup;
+
+    RoomCache room_cache;
+    // Load the busiest rooms into room_cache on the database pool, for the
+    // given cache generation. A later clear() cancels it: its remaining rooms
+    // are skipped and whatever it already read is not installed.
+    void start_preload(uint64_t generation);
+    // Read one room into room_cache, if it can still be claimed for generation.
+    bool load_room(const std::string &room, uint64_t generation);
+    // The frames a join replays: the whole history, or its newest
+    // preload_messages_per_room messages while the cache is on.
+    std::vector<std::pair<int64_t, std::shared_ptr<const std::string>>> history_frames(const std::string &room);
+
+    bool admit_frame(const std::shared_ptr<Session> &session);
+    bool admit_room_message(const std::shared_ptr<Session> &session, const std::string &room);
+    void reject_rate_limited(const std::shared_ptr<Session> &session, const char *scope, int64_t wait_us,
+                             const std::string &room = std::string());
+    // {"type":"ack"} for a message sent with a client_msg_id.
+    void send_ack(const std::shared_ptr<Session> &session, const std::string &client_msg_id,
+                  const std::string &room, int64_t seq, bool duplicate);
+
+    // Accepts pending on the acceptor, and those parked by max_handshakes.
+    // Both only change on the acceptor's strand.
+    int parked_accepts = 0;
+
+    void accept_next();
+    void resume_accept();
+    void handshake_finished();
     void handle_session(std::shared_ptr<Session> session);
-    void handle_read(std::shared_ptr<Session> session, std::shared_ptr<beast::flat_buffer> buffer);
+    session_awaitable<void> run_session(std::shared_ptr<Session> session);
+    void handle_message(const std::shared_ptr<Session> &session, const std::shared_ptr<const std::string> &payload);
     void handle_login(const std::string &username, std::shared_ptr<Session> session);
+    // Returns the users online in the room, the new member included.
+    std::vector<std::string> join_room(const std::string &room, std::shared_ptr<Session> session);
+    void deliver_remote(const std::string &room, const std::string &payload);
+    void deliver_to_room(const std::string &room, const std::shared_ptr<const std::string> &payload);
+    // Queue a room's stored messages, oldest first, on the session's bulk lane.
+    void send_history(std::shared_ptr<Session> session, const std::string &room);
+    void handle_search(std::shared_ptr<Session> session, const nlohmann::json &request);
+    void remove_session(std::shared_ptr<Session> session);
+
+    void start_timers();
+    void arm_tick();
+    void arm_compaction();
+    // Runs DatabaseManager::compactPartitions on db_pool, then reloads the
+    // cached rooms retention cut into. The first pass starts the preload.
+    void compact(bool start_cache = false);
+    void arm_presence_flush();
+    void on_tick();
+    void schedule_check(const std::shared_ptr<Session> &session, int64_t deadline_ms);
+    void check_session(std::shared_ptr<Session> session);
+    void poll_drain();
 };
 
 // Session wraps a websocket stream and serializes write operations.
 struct Session : public std::enable_shared_from_this<Session> {
-    std::shared_ptr<websocket::stream<tcp::socket>> ws;
+    enum State { Handshake, Open, Closing, Closed };
+
     // Use the io_context's executor for the strand.
-    boost::asio::strand<boost::asio::io_context::executor_type> strand;
-    // Queue of messages to send.
-    std::deque<std::string> write_queue;
+    session_executor strand;
+    // The socket is bound to the strand, so reads, writes and pings all run
+    // serialized. Exactly one of these is set: plain ws, plain ws through
+    // the server's io_uring, TLS through beast::ssl_stream, or TLS through
+    // KtlsStream when kTLS was asked for.
+    std::shared_ptr<websocket::stream<session_socket>> ws;
+    std::shared_ptr<websocket::stream<UringStream<session_socket>>> uws;
+    std::shared_ptr<websocket::stream<beast::ssl_stream<session_socket>>> wss;
+    std::shared_ptr<websocket::stream<KtlsStream<session_socket>>> kwss;
+    // Outbound priority classes. Control frames (responses to the client's own
+    // requests, acks, notices) go first; live traffic (chat and presence)
+    // comes next; bulk history replay and search results get what's left, but at least one
+    // frame in every kLiveFramesPerBulk so a busy room can't starve a join.
+    // Lanes are picked per frame, so a queued history backlog delays a new
+    // live message by at most one frame. Pings are sent by Beast between
+    // frames, outside these queues.
+    enum Lane { Control, Live, Bulk, kLanes };
+    static const int kLiveFramesPerBulk = 8;
+
+    // A queued frame. The trace id and enqueue time are set when the frame
+    // was queued while handling a traced message.
+    struct Outbound {
+        std::shared_ptr<const std::string> payload;
+        uint64_t trace_id;
+        int64_t enqueued_ns;
+    };
+    // Queues of messages to send, one per lane. Broadcasts share one payload
+    // across every recipient's queue instead of copying it per session.
+    std::deque<Outbound> write_queues[kLanes];
+    // Frames written from Control or Live since the last Bulk frame.
+    int frames_since_bulk = 0;
+    // Rooms this session joined.
+    std::set<std::string> rooms;
+    // Never expires; cancelling it wakes write_loop.
+    session_timer write_signal;
+
+    // Timeout bookkeeping, all in steady-clock milliseconds.
+    std::atomic<int> state{Handshake};
+    int64_t created_ms;
+    std::atomic<int64_t> last_activity_ms;
+    // Start of the in-flight write, or 0 when the writer is idle.
+    std::atomic<int64_t> write_started_ms{0};
+    // A keepalive ping is queued or awaiting its pong; Beast allows one at a time.
+    bool ping_outstanding = false;
+    // Set by close(); the close frame goes out once every lane is empty.
+    bool close_requested = false;
+    websocket::close_code close_code = websocket::close_code::normal;
+
+    // Rate limiting, owned by the strand. The user and room buckets are shared
+    // with the user's other sessions and the room's other senders.
+    std::string username;
+    std::unique_ptr<TokenBucket> connection_bucket;
+    std::shared_ptr<TokenBucket> user_bucket;
+    std::unordered_map<std::string, std::shared_ptr<TokenBucket>> room_buckets;
+    // Further "rate_limited" notices are suppressed until this time.
+    int64_t rate_notice_until_us = 0;
+
+    // Constructor now takes the io_context reference, and the TLS context
+    // for wss:// listeners or the ring for ws:// ones on io_uring.
+    explicit Session(asio::io_context &context, asio::ssl::context *tls = nullptr, bool ktls = false,
+                     IoUring *uring = nullptr);
 
-    // Constructor now takes the io_context reference.
-    Session(std::shared_ptr<websocket::stream<tcp::socket>> ws, asio::io_context &context)
-        : ws(ws), strand(context.get_executor()) {}
+    // Call f with whichever websocket stream this session uses.
+    template <typename F>
+    decltype(auto) with_stream(F &&f) {
+        if (wss) {
+            return f(*wss);
+        }
+        if (kwss) {
+            return f(*kwss);
+        }
+        if (uws) {
+            return f(*uws);
+        }
+        return f(*ws);
+    }
+
+    // The TCP socket under the stream.
+    session_socket &socket() {
+        return with_stream([](auto &stream) -> session_socket & { return beast::get_lowest_layer(stream); });
+    }
 
     // Enqueue a message and initiate writing if necessary.
-    void write(const std::string &msg);
+    void write(const std::string &msg, Lane lane = Live);
+    void write(std::shared_ptr<const std::string> msg, Lane lane = Live);
+    // Enqueue several messages in order with a single hop to the strand.
+    void write(std::vector<std::shared_ptr<const std::string>> msgs, Lane lane);
+
+    // Writer coroutine, started once the handshake completes. Sends queued
+    // messages, in order within each lane, and the close frame once close()
+    // was called.
+    session_awaitable<void> write_loop();
+
+    // Record inbound traffic (frames or pongs) for the idle timeout.
+    void touch();
+
+    // Send a close frame with the given code after everything already queued.
+    void close(websocket::close_code code);
 
-    // Helper to perform an async_write for the front message in the queue.
-    void do_write();
+    // Tear down the TCP connection; pending operations complete with an error.
+    void close_socket();
 };
 
 #endif // WEBSOCKET_SERVER_H
@@ -2,11 +2,22 @@
 #include <gtest/gtest.h>
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
+#include <boost/beast/ssl.hpp>
 #include <thread>
 #include <chrono>
+#include <future>
 #include "websocket_server.h"
 #include "DatabaseManager.h"
+#include "BrokerBackplane.h"
+#include "TestCertificate.h"
 #include <nlohmann/json.hpp>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <csignal>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace asio = boost::asio;
 namespace beast = boost::beast;
@@ -19,7 +30,9 @@ static const int testPort = 9001;
 // Helper fixture to run the server in a separate thread.
 class WebSocketServerFixture {
 public:
-    WebSocketServerFixture() : ioContext(), dbManager("functional_test.db"), server(ioContext, testPort, dbManager) {
+    explicit WebSocketServerFixture(const ServerConfig &config = ServerConfig(),
+                                    const StorageConfig &storage = StorageConfig())
+        : ioContext(), dbManager("functional_test.db", storage), server(ioContext, testPort, dbManager, config) {
         dbManager.initDB();
         serverThread = std::thread([this]() {
             server.start_accept();
@@ -33,6 +46,9 @@ public:
             serverThread.join();
         std::remove("functional_test.db");
     }
+    const ServerStats &stats() const { return server.stats(); }
+    WebSocketServer &getServer() { return server; }
+    DatabaseManager &getDB() { return dbManager; }
 private:
     asio::io_context ioContext;
     DatabaseManager dbManager;
@@ -40,6 +56,18 @@ private:
     std::thread serverThread;
 };
 
+static json readJson(websocket::stream<tcp::socket> &ws) {
+    beast::flat_buffer buffer;
+    ws.read(buffer);
+    return json::parse(beast::buffers_to_string(buffer.data()));
+}
+
+// Chat is delivered to a room's members, so clients join before they talk.
+static void joinRoom(websocket::stream<tcp::socket> &ws, const std::string &username, const std::string &room) {
+    ws.write(asio::buffer(json({{"type", "join"}, {"username", username}, {"room", room}}).dump()));
+    EXPECT_EQ(readJson(ws)["type"], "join_response");
+}
+
 TEST(WebSocketServerTest, SignupAndLogin) {
     WebSocketServerFixture serverFixture;
 
@@ -83,6 +111,690 @@ TEST(WebSocketServerTest, SignupAndLogin) {
     ws.close(websocket::close_code::normal);
 }
 
+// wss:// round trip, then a second connection that resumes the first one's
+// TLS 1.3 session from a ticket. Runs with user-space TLS and with kTLS
+// requested (which falls back to user space if the kernel lacks the tls module).
+static void runTlsRoundTrip(bool ktls) {
+    writeTestCertificate("tls_test.crt", "tls_test.key");
+    ServerConfig config;
+    config.tls_certificate_file = "tls_test.crt";
+    config.tls_private_key_file = "tls_test.key";
+    config.tls_ktls = ktls;
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    asio::ssl::context tls(asio::ssl::context::tls_client);
+    tls.add_certificate_authority(asio::buffer(std::string(kTestCertificatePem)));
+    tls.set_verify_mode(asio::ssl::verify_peer);
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), testPort);
+
+    SSL_SESSION *saved = nullptr;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        websocket::stream<beast::ssl_stream<tcp::socket>> ws(clientIo, tls);
+        ws.next_layer().next_layer().connect(endpoint);
+        SSL_set_tlsext_host_name(ws.next_layer().native_handle(), "localhost");
+        if (saved) {
+            SSL_set_session(ws.next_layer().native_handle(), saved);
+        }
+        ws.next_layer().handshake(asio::ssl::stream_base::client);
+        ws.handshake("localhost", "/");
+        EXPECT_EQ(SSL_session_reused(ws.next_layer().native_handle()) == 1, attempt == 1);
+
+        json signupMsg = {
+            {"type", "signup"},
+            {"username", "tlsUser" + std::to_string(attempt)},
+            {"password", "tlsPass"}
+        };
+        ws.write(asio::buffer(signupMsg.dump()));
+        beast::flat_buffer buffer;
+        ws.read(buffer);
+        EXPECT_EQ(json::parse(beast::buffers_to_string(buffer.data()))["status"], "success");
+
+        // TLS 1.3 tickets arrive after the handshake; reading a reply has processed them.
+        if (!saved) {
+            saved = SSL_get1_session(ws.next_layer().native_handle());
+        }
+        ws.close(websocket::close_code::normal);
+    }
+    SSL_SESSION_free(saved);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(serverFixture.stats().tls_handshakes, 2u);
+    EXPECT_EQ(serverFixture.stats().tls_resumed, 1u);
+
+    // A plain ws:// client is turned away at the TLS layer.
+    websocket::stream<tcp::socket> plain(clientIo);
+    plain.next_layer().connect(endpoint);
+    boost::system::error_code ec;
+    plain.handshake("localhost", "/", ec);
+    EXPECT_TRUE(ec);
+
+    std::remove("tls_test.crt");
+    std::remove("tls_test.key");
+}
+
+TEST(WebSocketServerTest, TlsRoundTripAndResumption) {
+    runTlsRoundTrip(false);
+}
+
+TEST(WebSocketServerTest, KtlsRoundTripAndResumption) {
+    runTlsRoundTrip(true);
+}
+
+TEST(WebSocketServerTest, ReapsStalledConnections) {
+    ServerConfig config;
+    config.handshake_timeout_ms = 200;
+    config.idle_timeout_ms = 400;
+    config.ping_interval_ms = 0;
+    config.tick_ms = 20;
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), testPort);
+
+    // Never sends the upgrade request.
+    tcp::socket silent(clientIo);
+    silent.connect(endpoint);
+
+    // Completes the handshake, then goes quiet.
+    websocket::stream<tcp::socket> idle(clientIo);
+    idle.next_layer().connect(endpoint);
+    idle.handshake("localhost", "/");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(800));
+    EXPECT_EQ(serverFixture.stats().reaped_handshake, 1u);
+    EXPECT_EQ(serverFixture.stats().reaped_idle, 1u);
+
+    // Both sockets should have been closed by the server.
+    char byte;
+    boost::system::error_code ec;
+    silent.read_some(asio::buffer(&byte, 1), ec);
+    EXPECT_TRUE(ec);
+    beast::flat_buffer buffer;
+    idle.read(buffer, ec);
+    EXPECT_TRUE(ec);
+}
+
+TEST(WebSocketServerTest, PingsKeepResponsiveClientsAlive) {
+    ServerConfig config;
+    config.idle_timeout_ms = 300;
+    config.ping_interval_ms = 100;
+    config.tick_ms = 20;
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    websocket::stream<tcp::socket> ws(clientIo);
+    ws.next_layer().connect(tcp::endpoint(asio::ip::make_address("127.0.0.1"), testPort));
+    ws.handshake("localhost", "/");
+
+    // A blocked read still answers pings; stop it after several idle windows.
+    asio::steady_timer stop(clientIo, std::chrono::milliseconds(1000));
+    stop.async_wait([&ws](boost::system::error_code) {
+        beast::get_lowest_layer(ws).cancel();
+    });
+    beast::flat_buffer buffer;
+    ws.async_read(buffer, [](boost::system::error_code, std::size_t) {});
+    clientIo.run();
+
+    EXPECT_GE(serverFixture.stats().pings_sent, 3u);
+    EXPECT_EQ(serverFixture.stats().reaped_idle, 0u);
+}
+
+TEST(WebSocketServerTest, ZeroTickDisablesTimeouts) {
+    ServerConfig config;
+    config.tick_ms = 0;
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    websocket::stream<tcp::socket> ws(clientIo);
+    ws.next_layer().connect(tcp::endpoint(asio::ip::make_address("127.0.0.1"), testPort));
+    ws.handshake("localhost", "/");
+
+    json signupMsg = {
+        {"type", "signup"},
+        {"username", "untimedUser"},
+        {"password", "untimedPass"}
+    };
+    ws.write(asio::buffer(signupMsg.dump()));
+    beast::flat_buffer buffer;
+    ws.read(buffer);
+    EXPECT_EQ(json::parse(beast::buffers_to_string(buffer.data()))["status"], "success");
+    EXPECT_EQ(serverFixture.stats().pings_sent, 0u);
+
+    ws.close(websocket::close_code::normal);
+}
+
+TEST(WebSocketServerTest, SearchStreamsResultsInFrames) {
+    ServerConfig config;
+    config.search_frame_results = 2;
+    WebSocketServerFixture serverFixture(config);
+    for (int i = 0; i < 5; ++i) {
+        serverFixture.getDB().storeMessage("search_room", "finder", "needle number " + std::to_string(i), "t");
+    }
+    serverFixture.getDB().storeMessage("search_room", "finder", "haystack", "t");
+
+    asio::io_context clientIo;
+    websocket::stream<tcp::socket> ws(clientIo);
+    ws.next_layer().connect(tcp::endpoint(asio::ip::make_address("127.0.0.1"), testPort));
+    ws.handshake("localhost", "/");
+
+    json request = {
+        {"type", "search"},
+        {"room", "search_room"},
+        {"query", "needle"},
+        {"limit", 4}
+    };
+    ws.write(asio::buffer(request.dump()));
+
+    int frames = 0;
+    std::size_t results = 0;
+    json last;
+    do {
+        beast::flat_buffer buffer;
+        ws.read(buffer);
+        last = json::parse(beast::buffers_to_string(buffer.data()));
+        ASSERT_EQ(last["type"], "search_results");
+        EXPECT_LE(last["results"].size(), 2u);
+        results += last["results"].size();
+        ++frames;
+    } while (!last["done"]);
+
+    EXPECT_EQ(frames, 2);
+    EXPECT_EQ(results, 4u);
+    EXPECT_EQ(last["next_offset"], 4);
+
+    // An absurd offset is clamped rather than overflowing; there is nothing there.
+    request["offset"] = 9223372036854775807LL;
+    ws.write(asio::buffer(request.dump()));
+    beast::flat_buffer buffer;
+    ws.read(buffer);
+    last = json::parse(beast::buffers_to_string(buffer.data()));
+    EXPECT_TRUE(last["results"].empty());
+    EXPECT_TRUE(last["done"]);
+    EXPECT_FALSE(last.contains("next_offset"));
+    ws.close(websocket::close_code::normal);
+}
+
+// The log engine has no search index; a search gets an explicit error
+// instead of an empty page that looks like "no matches".
+TEST(WebSocketServerTest, SearchIsRejectedWithoutAnIndex) {
+    const std::string logDir = "functional_test_log";
+    StorageConfig storage;
+    storage.engine = StorageConfig::Log;
+    storage.logDirectory = logDir;
+    {
+        WebSocketServerFixture serverFixture(ServerConfig(), storage);
+        serverFixture.getDB().storeMessage("log_room", "finder", "needle", "t");
+
+        asio::io_context clientIo;
+        websocket::stream<tcp::socket> ws(clientIo);
+        ws.next_layer().connect(tcp::endpoint(asio::ip::make_address("127.0.0.1"), testPort));
+        ws.handshake("localhost", "/");
+        json request = {
+            {"type", "search"},
+            {"room", "log_room"},
+            {"query", "needle"}
+        };
+        ws.write(asio::buffer(request.dump()));
+        beast::flat_buffer buffer;
+        ws.read(buffer);
+        json response = json::parse(beast::buffers_to_string(buffer.data()));
+        EXPECT_EQ(response["type"], "search_results");
+        EXPECT_EQ(response["status"], "error");
+        EXPECT_EQ(response["error"], "unsupported");
+        EXPECT_TRUE(response["results"].empty());
+        EXPECT_TRUE(response["done"]);
+        ws.close(websocket::close_code::normal);
+    }
+    std::remove((logDir + "/segment-00000001.log").c_str());
+    rmdir(logDir.c_str());
+}
+
+// Reads frames until the server closes the connection; returns the number of chat messages seen.
+static int readUntilClose(websocket::stream<tcp::socket> &ws) {
+    int received = 0;
+    for (;;) {
+        beast::flat_buffer buffer;
+        boost::system::error_code ec;
+        ws.read(buffer, ec);
+        if (ec) {
+            return received;
+        }
+        if (json::parse(beast::buffers_to_string(buffer.data()))["type"] == "message") {
+            ++received;
+        }
+    }
+}
+
+TEST(WebSocketServerTest, ShutdownDrainsWithoutMessageLoss) {
+    ServerConfig config;
+    config.drain_timeout_ms = 5000;
+    config.presence_flush_ms = 0; // Only chat frames, so they can be counted.
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), testPort);
+    websocket::stream<tcp::socket> sender(clientIo);
+    sender.next_layer().connect(endpoint);
+    sender.handshake("localhost", "/");
+    // The receiver does not read until shutdown starts, so its broadcasts pile
+    // up in the server's write queue and kernel buffers.
+    websocket::stream<tcp::socket> receiver(clientIo);
+    receiver.next_layer().connect(endpoint);
+    receiver.handshake("localhost", "/");
+    joinRoom(sender, "drainer", "drain_room");
+    joinRoom(receiver, "drain_receiver", "drain_room");
+    // Connected, but only upgrades once shutdown has begun.
+    websocket::stream<tcp::socket> late(clientIo);
+    late.next_layer().connect(endpoint);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    const int numMessages = 200;
+    const std::string payload(16 * 1024, 'x');
+    for (int i = 0; i < numMessages; ++i) {
+        json msg = {
+            {"type", "message"},
+            {"from", "drainer"},
+            {"room", "drain_room"},
+            {"content", payload},
+            {"timestamp", "2025-04-01T00:00:00Z"}
+        };
+        sender.write(asio::buffer(msg.dump()));
+    }
+    // Once the sender sees all of its own broadcasts, the server has stored
+    // and queued every message.
+    int echoed = 0;
+    while (echoed < numMessages) {
+        beast::flat_buffer buffer;
+        sender.read(buffer);
+        ++echoed;
+    }
+
+    std::promise<void> drained;
+    serverFixture.getServer().shutdown([&drained]() { drained.set_value(); });
+    late.handshake("localhost", "/");
+    readUntilClose(late);
+    EXPECT_EQ(late.reason().code, websocket::close_code::going_away);
+
+    std::thread senderThread([&sender]() { readUntilClose(sender); });
+    int delivered = readUntilClose(receiver);
+    senderThread.join();
+    ASSERT_EQ(drained.get_future().wait_for(std::chrono::seconds(10)), std::future_status::ready);
+
+    EXPECT_EQ(delivered, numMessages);
+    EXPECT_EQ(receiver.reason().code, websocket::close_code::going_away);
+    EXPECT_EQ(sender.reason().code, websocket::close_code::going_away);
+    EXPECT_EQ(serverFixture.getDB().getMessagesForRoom("drain_room").size(), static_cast<std::size_t>(numMessages));
+}
+
+// Run fn in a child process until the test sends it SIGTERM.
+template <typename Fn>
+static pid_t spawnProcess(Fn fn) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        fn();
+        _exit(0);
+    }
+    return pid;
+}
+
+// One chat node: its own io_context, database and broker connection.
+static void runClusterNode(int port, const std::string &brokerAddress) {
+    asio::io_context io;
+    DatabaseManager db("cluster_node_" + std::to_string(port) + ".db");
+    db.initDB();
+    BrokerBackplane backplane(io, brokerAddress, 50);
+    WebSocketServer server(io, port, db, ServerConfig(), &backplane);
+    asio::signal_set signals(io, SIGTERM);
+    signals.async_wait([&io](boost::system::error_code, int) { io.stop(); });
+    server.start_accept();
+    io.run();
+}
+
+static void connectWithRetry(websocket::stream<tcp::socket> &ws, int port) {
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), port);
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        boost::system::error_code ec;
+        ws.next_layer().connect(endpoint, ec);
+        if (!ec) {
+            ws.handshake("localhost", "/");
+            return;
+        }
+        ws.next_layer().close(ec);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    FAIL() << "Node on port " << port << " never came up";
+}
+
+// Two server processes joined through a broker process: a member on one node
+// receives what is sent on the other, and a node without members in a room
+// gets none of its traffic.
+TEST(ClusterTest, CrossNodeDelivery) {
+    const std::string brokerAddress = "unix:cluster_broker.sock";
+    const int portA = 9011, portB = 9012;
+    pid_t brokerPid = spawnProcess([&brokerAddress]() {
+        asio::io_context io;
+        Broker broker(io, brokerAddress);
+        if (!broker.start()) {
+            _exit(1);
+        }
+        asio::signal_set signals(io, SIGTERM);
+        signals.async_wait([&io](boost::system::error_code, int) { io.stop(); });
+        io.run();
+    });
+    pid_t nodeA = spawnProcess([&]() { runClusterNode(portA, brokerAddress); });
+    pid_t nodeB = spawnProcess([&]() { runClusterNode(portB, brokerAddress); });
+
+    asio::io_context clientIo;
+    websocket::stream<tcp::socket> sender(clientIo), receiver(clientIo), bystander(clientIo);
+    connectWithRetry(sender, portA);
+    connectWithRetry(receiver, portB);
+    connectWithRetry(bystander, portB);
+
+    json join = {{"type", "join"}, {"username", "sender"}, {"room", "cluster_room"}};
+    sender.write(asio::buffer(join.dump()));
+    EXPECT_EQ(readJson(sender)["type"], "join_response");
+    join["username"] = "receiver";
+    receiver.write(asio::buffer(join.dump()));
+    EXPECT_EQ(readJson(receiver)["type"], "join_response");
+
+    // Node B subscribes asynchronously; warm up until the first message crosses.
+    auto sendText = [&sender](const std::string &room, const std::string &text) {
+        json msg = {{"type", "message"}, {"from", "sender"}, {"room", room}, {"text", text}};
+        sender.write(asio::buffer(msg.dump()));
+        readJson(sender); // Node A's own broadcast.
+    };
+    bool crossed = false;
+    for (int attempt = 0; attempt < 100 && !crossed; ++attempt) {
+        sendText("cluster_room", "warmup");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        crossed = receiver.next_layer().available() > 0;
+    }
+    ASSERT_TRUE(crossed);
+
+    const int numProbes = 200;
+    std::vector<double> latencies;
+    for (int i = 0; i < numProbes; ++i) {
+        std::string text = "probe " + std::to_string(i);
+        auto start = std::chrono::steady_clock::now();
+        sendText("cluster_room", text);
+        json received;
+        do {
+            received = readJson(receiver);
+        } while (received["text"] != text);
+        latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    // Traffic for a room nobody on node B joined never reaches it.
+    sendText("elsewhere", "not for node B");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(bystander.next_layer().available(), 0u);
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "Cross-node delivery over " << numProbes << " messages: p50 "
+              << latencies[numProbes / 2] << " ms, p99 " << latencies[numProbes * 99 / 100]
+              << " ms, max " << latencies.back() << " ms" << std::endl;
+
+    for (pid_t pid : {nodeA, nodeB, brokerPid}) {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+    std::remove("cluster_node_9011.db");
+    std::remove("cluster_node_9012.db");
+    std::remove("cluster_broker.sock");
+}
+
+TEST(WebSocketServerTest, TypingAndPresenceAreCoalesced) {
+    ServerConfig config;
+    config.presence_flush_ms = 50;
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), testPort);
+    websocket::stream<tcp::socket> alice(clientIo), bob(clientIo);
+    for (auto *ws : {&alice, &bob}) {
+        ws->next_layer().connect(endpoint);
+        ws->handshake("localhost", "/");
+    }
+    json join = {{"type", "join"}, {"username", "alice"}, {"room", "typing_room"}};
+    alice.write(asio::buffer(join.dump()));
+    EXPECT_EQ(readJson(alice)["online"], json({"alice"}));
+    join["username"] = "bob";
+    bob.write(asio::buffer(join.dump()));
+    EXPECT_EQ(readJson(bob)["online"], json({"alice", "bob"}));
+
+    // A burst of typing events reaches bob as a single presence frame.
+    json typing = {{"type", "typing"}, {"room", "typing_room"}};
+    for (int i = 0; i < 20; ++i) {
+        alice.write(asio::buffer(typing.dump()));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    int frames = 0;
+    json last;
+    while (bob.next_layer().available() > 0) {
+        last = readJson(bob);
+        EXPECT_EQ(last["type"], "presence");
+        ++frames;
+    }
+    // Possibly one for bob coming online, then one for the typing burst.
+    EXPECT_GE(frames, 1);
+    EXPECT_LE(frames, 2);
+    EXPECT_EQ(last["typing"], json({"alice"}));
+
+    // Disconnecting takes alice offline and clears her indicator.
+    alice.close(websocket::close_code::normal);
+    json offline;
+    do {
+        offline = readJson(bob);
+    } while (offline["offline"].empty());
+    EXPECT_EQ(offline["offline"], json({"alice"}));
+    EXPECT_TRUE(offline["typing"].empty());
+
+    // Typing is never stored.
+    EXPECT_TRUE(serverFixture.getDB().getMessagesForRoom("typing_room").empty());
+    bob.close(websocket::close_code::normal);
+}
+
+TEST(WebSocketServerTest, RetriedSendIsAcknowledgedOnce) {
+    ServerConfig config;
+    config.presence_flush_ms = 0;
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), testPort);
+    websocket::stream<tcp::socket> alice(clientIo), bob(clientIo);
+    for (auto *ws : {&alice, &bob}) {
+        ws->next_layer().connect(endpoint);
+        ws->handshake("localhost", "/");
+    }
+    joinRoom(alice, "alice", "retry_room");
+    joinRoom(bob, "bob", "retry_room");
+
+    // First send: one broadcast, and an ack with the stored sequence. The
+    // ack rides the control lane, so it may overtake alice's own copy.
+    json message = {{"type", "message"}, {"from", "alice"}, {"room", "retry_room"},
+                    {"text", "once"}, {"client_msg_id", "alice-1"}};
+    alice.write(asio::buffer(message.dump()));
+    EXPECT_EQ(readJson(bob)["text"], "once");
+    json first = readJson(alice), second = readJson(alice);
+    json ack = first["type"] == "ack" ? first : second;
+    EXPECT_EQ((first["type"] == "ack" ? second : first)["text"], "once");
+    EXPECT_EQ(ack["type"], "ack");
+    EXPECT_EQ(ack["client_msg_id"], "alice-1");
+    EXPECT_FALSE(ack["duplicate"].get<bool>());
+    int64_t seq = ack["seq"];
+
+    // A retry, as after a reconnect, on a fresh connection: only an ack.
+    websocket::stream<tcp::socket> retry(clientIo);
+    retry.next_layer().connect(endpoint);
+    retry.handshake("localhost", "/");
+    joinRoom(retry, "alice", "alice_lobby");
+    retry.write(asio::buffer(message.dump()));
+    json again = readJson(retry);
+    EXPECT_EQ(again["type"], "ack");
+    EXPECT_TRUE(again["duplicate"].get<bool>());
+    EXPECT_EQ(again["seq"], seq);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_EQ(bob.next_layer().available(), 0u);
+    EXPECT_EQ(serverFixture.getDB().getMessagesForRoom("retry_room").size(), 1u);
+    EXPECT_EQ(serverFixture.stats().duplicates, 1u);
+    EXPECT_EQ(serverFixture.stats().duplicates_from_index, 1u);
+
+    for (auto *ws : {&alice, &bob, &retry}) {
+        ws->close(websocket::close_code::normal);
+    }
+}
+
+// The sender is the connection's user, so nobody can spend another user's
+// client_msg_id or post under their name.
+TEST(WebSocketServerTest, MessagesFromAnotherSenderAreRejected) {
+    ServerConfig config;
+    config.presence_flush_ms = 0;
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), testPort);
+    websocket::stream<tcp::socket> alice(clientIo), mallory(clientIo);
+    for (auto *ws : {&alice, &mallory}) {
+        ws->next_layer().connect(endpoint);
+        ws->handshake("localhost", "/");
+    }
+    json message = {{"type", "message"}, {"from", "alice"}, {"room", "owned_room"},
+                    {"text", "mine"}, {"client_msg_id", "alice-1"}};
+
+    mallory.write(asio::buffer(message.dump()));
+    json rejected = readJson(mallory);
+    EXPECT_EQ(rejected["type"], "message_response");
+    EXPECT_EQ(rejected["error"], "not_logged_in");
+    EXPECT_EQ(rejected["client_msg_id"], "alice-1");
+
+    joinRoom(mallory, "mallory", "owned_room");
+    mallory.write(asio::buffer(message.dump()));
+    EXPECT_EQ(readJson(mallory)["error"], "sender_mismatch");
+    EXPECT_TRUE(serverFixture.getDB().getMessagesForRoom("owned_room").empty());
+
+    // alice's own send is new, not a duplicate of either attempt.
+    joinRoom(alice, "alice", "alice_lobby");
+    alice.write(asio::buffer(message.dump()));
+    json ack = readJson(alice);
+    EXPECT_EQ(ack["type"], "ack");
+    EXPECT_FALSE(ack["duplicate"].get<bool>());
+    EXPECT_EQ(readJson(mallory)["text"], "mine");
+    EXPECT_EQ(serverFixture.stats().duplicates, 0u);
+
+    for (auto *ws : {&alice, &mallory}) {
+        ws->close(websocket::close_code::normal);
+    }
+}
+
+TEST(WebSocketServerTest, TracesMessageHotPath) {
+    ServerConfig config;
+    config.trace_events_per_thread = 4096;
+    config.presence_flush_ms = 0;
+    WebSocketServerFixture serverFixture(config);
+
+    asio::io_context clientIo;
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), testPort);
+    websocket::stream<tcp::socket> alice(clientIo), bob(clientIo);
+    for (auto *ws : {&alice, &bob}) {
+        ws->next_layer().connect(endpoint);
+        ws->handshake("localhost", "/");
+    }
+    joinRoom(alice, "alice", "trace_room");
+    joinRoom(bob, "bob", "trace_room");
+    json message = {{"type", "message"}, {"from", "alice"}, {"room", "trace_room"}, {"text", "traced"}};
+    alice.write(asio::buffer(message.dump()));
+    EXPECT_EQ(readJson(alice)["text"], "traced");
+    EXPECT_EQ(readJson(bob)["text"], "traced");
+    // The write spans close once the server sees its writes complete.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    Tracer::global().enable(0);
+
+    std::stringstream out;
+    Tracer::global().write_json(out);
+    auto trace = json::parse(out.str());
+    std::map<uint64_t, std::map<std::string, int>> spans;
+    for (const auto &event : trace["traceEvents"]) {
+        if (event["ph"] != "M") {
+            spans[event["args"]["msg"].get<uint64_t>()][event["name"].get<std::string>()]++;
+        }
+    }
+    // Find the chat message by its persist span: one receive, parse and
+    // persist, then enqueue, queued and write for each recipient.
+    auto traced = std::find_if(spans.begin(), spans.end(), [](const auto &entry) {
+        return entry.second.count("persist") > 0;
+    });
+    ASSERT_NE(traced, spans.end());
+    std::map<std::string, int> expected = {{"receive", 1}, {"parse", 1}, {"persist", 1},
+                                           {"enqueue", 2}, {"queued", 2}, {"write", 2}};
+    EXPECT_EQ(traced->second, expected);
+
+    alice.close(websocket::close_code::normal);
+    bob.close(websocket::close_code::normal);
+}
+
+TEST(WebSocketServerTest, WarmCacheServesJoinsAndStaysCurrent) {
+    std::remove("functional_test.db");
+    {
+        DatabaseManager seed("functional_test.db");
+        ASSERT_TRUE(seed.initDB());
+        for (int i = 0; i < 30; ++i) {
+            seed.storeMessage("busy_room", "alice", "busy " + std::to_string(i), "t");
+        }
+        seed.storeMessage("quiet_room", "alice", "quiet", "t");
+    }
+    ServerConfig config;
+    config.preload_rooms = 1;
+    config.presence_flush_ms = 0;
+    WebSocketServerFixture serverFixture(config);
+    for (int i = 0; i < 100 && serverFixture.stats().preload_ms == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_GT(serverFixture.stats().preload_ms, 0);
+    EXPECT_EQ(serverFixture.stats().preload_rooms_loaded, 1u);
+
+    asio::io_context clientIo;
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), testPort);
+    auto joinAndReadHistory = [&](const std::string &room, std::size_t expected) {
+        websocket::stream<tcp::socket> ws(clientIo);
+        ws.next_layer().connect(endpoint);
+        ws.handshake("localhost", "/");
+        ws.write(asio::buffer(json({{"type", "join"}, {"username", "bob"}, {"room", room}}).dump()));
+        EXPECT_EQ(readJson(ws)["type"], "join_response");
+        std::vector<json> history;
+        while (history.size() < expected) {
+            history.push_back(readJson(ws));
+        }
+        ws.close(websocket::close_code::normal);
+        return history;
+    };
+
+    // The busiest room comes from memory, the other from the database.
+    auto busy = joinAndReadHistory("busy_room", 30);
+    EXPECT_EQ(busy.front()["content"], "busy 0");
+    EXPECT_EQ(busy.back()["content"], "busy 29");
+    joinAndReadHistory("quiet_room", 1);
+    EXPECT_EQ(serverFixture.stats().history_cache_hits, 1u);
+    EXPECT_EQ(serverFixture.stats().history_cache_misses, 1u);
+
+    // New messages reach the cache, matching what the database returns.
+    websocket::stream<tcp::socket> alice(clientIo);
+    alice.next_layer().connect(endpoint);
+    alice.handshake("localhost", "/");
+    joinRoom(alice, "alice", "alice_lobby");
+    // Not a member, so the ack is the sign it was stored and cached.
+    alice.write(asio::buffer(json({{"type", "message"}, {"from", "alice"}, {"room", "busy_room"},
+                                   {"text", "fresh"}, {"timestamp", "t2"}, {"client_msg_id", "fresh-1"}}).dump()));
+    EXPECT_EQ(readJson(alice)["type"], "ack");
+    busy = joinAndReadHistory("busy_room", 31);
+    auto stored = serverFixture.getDB().getMessagesForRoom("busy_room");
+    ASSERT_EQ(stored.size(), 31u);
+    EXPECT_EQ(busy.back(), stored.back());
+    EXPECT_EQ(serverFixture.stats().history_cache_hits, 2u);
+    alice.close(websocket::close_code::normal);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -2,7 +2,130 @@
 #include <gtest/gtest.h>
 #include "DatabaseManager.h"
 #include <chrono>
+#include <cstddef>
 #include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+#include <random>
+#include <algorithm>
+#include <vector>
+#include <sqlite3.h>
+#include <unistd.h>
+#include "LogMessageStore.h"
+#include "PresenceCoalescer.h"
+#include "DedupIndex.h"
+#include "Tracer.h"
+#include "websocket_server.h"
+#include <atomic>
+#include <new>
+#include <thread>
+#include <nlohmann/json.hpp>
+#include <boost/beast/ssl.hpp>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+#include "TestCertificate.h"
+
+// Count operator new calls made on threads that opt in, so a test can see
+// what the server allocates per message. Every form of new and delete is
+// replaced so each allocation is released by its matching function; they
+// are kept out of line so GCC doesn't pair an inlined free() with new.
+static std::atomic<uint64_t> countedAllocations{0};
+static thread_local bool countAllocations = false;
+
+__attribute__((noinline)) static void* countedAlloc(std::size_t size, std::size_t alignment) {
+    if (countAllocations) {
+        countedAllocations++;
+    }
+    size = size ? size : 1;
+    if (alignment <= alignof(std::max_align_t)) {
+        return std::malloc(size);
+    }
+    // aligned_alloc wants a multiple of the alignment.
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+__attribute__((noinline)) static void countedFree(void *p) noexcept {
+    std::free(p);
+}
+
+static void* countedAllocOrThrow(std::size_t size, std::size_t alignment) {
+    void *p = countedAlloc(size, alignment);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(std::size_t size) {
+    return countedAllocOrThrow(size, 0);
+}
+void* operator new[](std::size_t size) {
+    return countedAllocOrThrow(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return countedAllocOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return countedAllocOrThrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return countedAlloc(size, 0);
+}
+void* operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return countedAlloc(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return countedAlloc(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return countedAlloc(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept {
+    countedFree(p);
+}
+void operator delete[](void *p) noexcept {
+    countedFree(p);
+}
+void operator delete(void *p, std::size_t) noexcept {
+    countedFree(p);
+}
+void operator delete[](void *p, std::size_t) noexcept {
+    countedFree(p);
+}
+void operator delete(void *p, std::align_val_t) noexcept {
+    countedFree(p);
+}
+void operator delete[](void *p, std::align_val_t) noexcept {
+    countedFree(p);
+}
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+    countedFree(p);
+}
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+    countedFree(p);
+}
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    countedFree(p);
+}
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    countedFree(p);
+}
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+    countedFree(p);
+}
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+    countedFree(p);
+}
+
+// Chat reaches only a room's members; join and read the join response.
+static void joinRoom(websocket::stream<tcp::socket> &ws, const std::string &username, const std::string &room) {
+    ws.write(boost::asio::buffer(nlohmann::json({{"type", "join"}, {"username", username}, {"room", room}}).dump()));
+    beast::flat_buffer buffer;
+    ws.read(buffer);
+}
 
 class PerformanceTest : public ::testing::Test {
 protected:
@@ -35,6 +158,754 @@ TEST_F(PerformanceTest, BulkMessageInsert) {
     EXPECT_LT(avgTime, 0.005);
 }
 
+// Corpus size defaults to something CI can build quickly; set
+// PERF_SEARCH_CORPUS=10000000 for the full-scale run.
+TEST_F(PerformanceTest, SearchLatency) {
+    long corpus = 200000;
+    if (const char *env = std::getenv("PERF_SEARCH_CORPUS")) {
+        corpus = std::atol(env);
+    }
+    const int numRooms = 1000;
+    const int vocabulary = 5000;
+
+    {
+        DatabaseManager schema(perfDB);
+        ASSERT_TRUE(schema.initDB());
+    }
+
+    // Bulk-load through a raw connection in large transactions; the triggers
+    // created by initDB keep the search index in sync as rows go in.
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    sqlite3 *raw = nullptr;
+    ASSERT_EQ(sqlite3_open(perfDB.c_str(), &raw), SQLITE_OK);
+    sqlite3_exec(raw, "PRAGMA synchronous=OFF;", nullptr, nullptr, nullptr);
+    sqlite3_stmt *insert = nullptr;
+    ASSERT_EQ(sqlite3_prepare_v2(raw, "INSERT INTO messages (room, sender, content, timestamp) VALUES (?, ?, ?, ?);",
+                                 -1, &insert, nullptr), SQLITE_OK);
+    std::mt19937 rng(42);
+    // Zipf-ish word choice so some terms are common and most are rare.
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    auto word = [&]() { return "w" + std::to_string(static_cast<int>(vocabulary * std::pow(unit(rng), 3.0))); };
+    sqlite3_exec(raw, "BEGIN;", nullptr, nullptr, nullptr);
+    for (long i = 0; i < corpus; ++i) {
+        std::string room = "room" + std::to_string(rng() % numRooms);
+        std::string sender = "user" + std::to_string(rng() % 100);
+        std::string content;
+        int words = 4 + rng() % 12;
+        for (int w = 0; w < words; ++w) {
+            content += word() + " ";
+        }
+        sqlite3_bind_text(insert, 1, room.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insert, 2, sender.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insert, 3, content.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insert, 4, "2025-04-01T00:00:00Z", -1, SQLITE_STATIC);
+        sqlite3_step(insert);
+        sqlite3_reset(insert);
+        if (i % 100000 == 99999) {
+            sqlite3_exec(raw, "COMMIT; BEGIN;", nullptr, nullptr, nullptr);
+        }
+    }
+    sqlite3_exec(raw, "COMMIT;", nullptr, nullptr, nullptr);
+    sqlite3_finalize(insert);
+    sqlite3_close(raw);
+    std::chrono::duration<double> loadTime = std::chrono::high_resolution_clock::now() - loadStart;
+    std::cout << "Loaded " << corpus << " messages in " << loadTime.count() << " seconds" << std::endl;
+
+    DatabaseManager dbManager(perfDB);
+    ASSERT_TRUE(dbManager.initDB());
+    const int numQueries = 500;
+    std::vector<double> latencies;
+    for (int q = 0; q < numQueries; ++q) {
+        std::string room = "room" + std::to_string(rng() % numRooms);
+        std::string query = word();
+        if (q % 2) {
+            query += " " + word();
+        }
+        std::string sender = q % 4 == 0 ? "user" + std::to_string(rng() % 100) : "";
+        auto start = std::chrono::high_resolution_clock::now();
+        dbManager.searchMessages(room, sender, query, 20, 0);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+        latencies.push_back(elapsed.count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    double p50 = latencies[latencies.size() / 2];
+    double p99 = latencies[latencies.size() * 99 / 100];
+    std::cout << "Search over " << corpus << " messages: p50 = " << p50 << " ms, p99 = " << p99
+              << " ms, max = " << latencies.back() << " ms" << std::endl;
+
+    EXPECT_LT(p50, 50.0);
+}
+
+// Same insert and history-replay load against both message engines.
+TEST_F(PerformanceTest, StorageEngineComparison) {
+    const int numMessages = 20000;
+    const int numRooms = 20;
+    const std::string content(200, 'm');
+    const std::string logDir = perfDB + ".log";
+
+    struct Result { double insert; double replay; };
+    auto run = [&](StorageConfig::Engine engine) {
+        StorageConfig storage;
+        storage.engine = engine;
+        std::remove(perfDB.c_str());
+        DatabaseManager dbManager(perfDB, storage);
+        EXPECT_TRUE(dbManager.initDB());
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < numMessages; ++i) {
+            dbManager.storeMessage("room" + std::to_string(i % numRooms), "tester", content, "2025-04-01T00:00:00Z");
+        }
+        dbManager.checkpoint();
+        std::chrono::duration<double> insert = std::chrono::high_resolution_clock::now() - start;
+
+        start = std::chrono::high_resolution_clock::now();
+        std::size_t replayed = 0;
+        for (int r = 0; r < numRooms; ++r) {
+            replayed += dbManager.getMessagesForRoom("room" + std::to_string(r)).size();
+        }
+        std::chrono::duration<double> replay = std::chrono::high_resolution_clock::now() - start;
+        EXPECT_EQ(replayed, static_cast<std::size_t>(numMessages));
+        return Result{insert.count(), replay.count()};
+    };
+
+    Result sqliteResult = run(StorageConfig::Sqlite);
+    Result logResult = run(StorageConfig::Log);
+
+    // Zero-copy replay straight from the mapped segments, without building JSON.
+    double rawReplay;
+    {
+        LogMessageStore store(logDir, StorageConfig());
+        ASSERT_TRUE(store.open());
+        auto start = std::chrono::high_resolution_clock::now();
+        std::size_t bytes = 0;
+        for (int r = 0; r < numRooms; ++r) {
+            store.replayRoom("room" + std::to_string(r), 0, [&bytes](const LogMessageStore::RecordView &view) {
+                bytes += view.content.size();
+            });
+        }
+        std::chrono::duration<double> replay = std::chrono::high_resolution_clock::now() - start;
+        rawReplay = replay.count();
+        EXPECT_EQ(bytes, content.size() * numMessages);
+    }
+    std::remove((logDir + "/segment-00000001.log").c_str());
+    rmdir(logDir.c_str());
+
+    std::cout << "SQLite engine: " << numMessages / sqliteResult.insert << " inserts/s, replay "
+              << sqliteResult.replay * 1000 << " ms" << std::endl;
+    std::cout << "Log engine:    " << numMessages / logResult.insert << " inserts/s, replay "
+              << logResult.replay * 1000 << " ms (zero-copy " << rawReplay * 1000 << " ms)" << std::endl;
+
+    EXPECT_LT(logResult.insert, sqliteResult.insert);
+}
+
+// Round trips through a live server: one client sends a message and waits for
+// its own broadcast. Reports the server thread's heap allocations per message
+// and the round-trip latency. Uses the log engine so SQLite stays out of the
+// numbers.
+TEST_F(PerformanceTest, SessionAllocationsPerMessage) {
+    const int port = 9003;
+    const int warmup = 200;
+    const int numMessages = 5000;
+    const std::string logDir = perfDB + ".log";
+
+    StorageConfig storage;
+    storage.engine = StorageConfig::Log;
+    DatabaseManager dbManager(perfDB, storage);
+    ASSERT_TRUE(dbManager.initDB());
+    // Thousands of back-to-back messages from one client would trip the rate
+    // limits; presence frames would be read as echoes.
+    ServerConfig config;
+    config.connection_rate = config.user_rate = config.room_rate = 0;
+    config.presence_flush_ms = 0;
+    boost::asio::io_context serverIo;
+    WebSocketServer server(serverIo, port, dbManager, config);
+    std::thread serverThread([&]() {
+        countAllocations = true;
+        server.start_accept();
+        serverIo.run();
+    });
+
+    boost::asio::io_context clientIo;
+    websocket::stream<tcp::socket> ws(clientIo);
+    ws.next_layer().connect(tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), port));
+    ws.handshake("localhost", "/");
+    joinRoom(ws, "perf_client", "alloc_room");
+    const std::string msg = nlohmann::json({
+        {"type", "message"},
+        {"from", "perf_client"},
+        {"room", "alloc_room"},
+        {"content", "allocation probe"},
+        {"timestamp", "2025-04-01T00:00:00Z"}
+    }).dump();
+
+    std::vector<double> latencies;
+    uint64_t startAllocations = 0;
+    beast::flat_buffer buffer;
+    for (int i = 0; i < warmup + numMessages; ++i) {
+        if (i == warmup) {
+            startAllocations = countedAllocations;
+        }
+        auto start = std::chrono::steady_clock::now();
+        ws.write(boost::asio::buffer(msg));
+        ws.read(buffer);
+        buffer.consume(buffer.size());
+        if (i >= warmup) {
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    double allocationsPerMessage = double(countedAllocations - startAllocations) / numMessages;
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "Session loop: " << allocationsPerMessage << " server allocations per message, round trip p50 "
+              << latencies[numMessages / 2] << " us, p99 " << latencies[numMessages * 99 / 100] << " us" << std::endl;
+
+    ws.close(websocket::close_code::normal);
+    serverIo.stop();
+    serverThread.join();
+    std::remove((logDir + "/segment-00000001.log").c_str());
+    rmdir(logDir.c_str());
+}
+
+static double threadCpuSeconds(std::thread &thread) {
+    clockid_t clock;
+    timespec ts{};
+    if (pthread_getcpuclockid(thread.native_handle(), &clock) != 0 || clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// wss:// cost on the server: full and resumed handshakes per second, and the
+// server thread's CPU per 1 KB message round trip, for plain ws, user-space
+// TLS and kTLS. Reports whether kTLS actually engaged; without the kernel tls
+// module the kTLS row is OpenSSL on the socket in user space.
+TEST_F(PerformanceTest, TlsHandshakeAndMessageCost) {
+    const int port = 9003;
+    const int handshakes = 200;
+    const int numMessages = 3000;
+    const std::string logDir = perfDB + ".log";
+    writeTestCertificate("perf_tls.crt", "perf_tls.key");
+
+    const std::string msg = nlohmann::json({
+        {"type", "message"},
+        {"from", "perf_client"},
+        {"room", "tls_room"},
+        {"content", std::string(1024, 'x')},
+        {"timestamp", "2025-04-01T00:00:00Z"}
+    }).dump();
+
+    enum Mode { Plain, UserTls, KernelTls };
+    for (Mode mode : {Plain, UserTls, KernelTls}) {
+        StorageConfig storage;
+        storage.engine = StorageConfig::Log;
+        DatabaseManager dbManager(perfDB, storage);
+        ASSERT_TRUE(dbManager.initDB());
+        ServerConfig config;
+        config.connection_rate = config.user_rate = config.room_rate = 0;
+        config.presence_flush_ms = 0;
+        if (mode != Plain) {
+            config.tls_certificate_file = "perf_tls.crt";
+            config.tls_private_key_file = "perf_tls.key";
+            config.tls_ktls = mode == KernelTls;
+        }
+        boost::asio::io_context serverIo;
+        WebSocketServer server(serverIo, port, dbManager, config);
+        std::thread serverThread([&]() {
+            server.start_accept();
+            serverIo.run();
+        });
+
+        boost::asio::io_context clientIo;
+        boost::asio::ssl::context tls(boost::asio::ssl::context::tls_client);
+        tcp::endpoint endpoint(boost::asio::ip::make_address("127.0.0.1"), port);
+        const char *name = mode == Plain ? "ws" : mode == UserTls ? "wss" : "wss+kTLS";
+
+        if (mode != Plain) {
+            // Full handshakes, then resumptions from the last session's ticket.
+            SSL_SESSION *saved = nullptr;
+            for (int resumed = 0; resumed < 2; ++resumed) {
+                auto start = std::chrono::steady_clock::now();
+                for (int i = 0; i < handshakes; ++i) {
+                    websocket::stream<beast::ssl_stream<tcp::socket>> ws(clientIo, tls);
+                    ws.next_layer().next_layer().connect(endpoint);
+                    if (resumed) {
+                        SSL_set_session(ws.next_layer().native_handle(), saved);
+                    }
+                    ws.next_layer().handshake(boost::asio::ssl::stream_base::client);
+                    ws.handshake("localhost", "/");
+                    if (!resumed && i == handshakes - 1) {
+                        // Tickets follow the handshake; a round trip makes sure they arrived.
+                        ws.write(boost::asio::buffer(nlohmann::json({{"type", "join"}, {"username", "perf_client"},
+                                                                     {"room", "tls_room"}}).dump()));
+                        beast::flat_buffer buffer;
+                        ws.read(buffer);
+                        saved = SSL_get1_session(ws.next_layer().native_handle());
+                    }
+                    ws.close(websocket::close_code::normal);
+                }
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                std::cout << name << ": " << (resumed ? "resumed" : "full") << " handshakes " << handshakes / seconds
+                          << "/s" << std::endl;
+            }
+            SSL_SESSION_free(saved);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            EXPECT_EQ(server.stats().tls_handshakes, 2u * handshakes);
+            EXPECT_GE(server.stats().tls_resumed, static_cast<uint64_t>(handshakes));
+        }
+
+        // Per-message server CPU over one long-lived connection.
+        websocket::stream<beast::ssl_stream<tcp::socket>> secure(clientIo, tls);
+        websocket::stream<tcp::socket> plain(clientIo);
+        beast::flat_buffer buffer;
+        auto roundTrip = [&]() {
+            if (mode == Plain) {
+                plain.write(boost::asio::buffer(msg));
+                plain.read(buffer);
+            } else {
+                secure.write(boost::asio::buffer(msg));
+                secure.read(buffer);
+            }
+            buffer.consume(buffer.size());
+        };
+        const std::string join = nlohmann::json({{"type", "join"}, {"username", "perf_client"},
+                                                 {"room", "tls_room"}}).dump();
+        if (mode == Plain) {
+            plain.next_layer().connect(endpoint);
+            plain.handshake("localhost", "/");
+            plain.write(boost::asio::buffer(join));
+            plain.read(buffer);
+        } else {
+            secure.next_layer().next_layer().connect(endpoint);
+            secure.next_layer().handshake(boost::asio::ssl::stream_base::client);
+            secure.handshake("localhost", "/");
+            secure.write(boost::asio::buffer(join));
+            secure.read(buffer);
+        }
+        buffer.consume(buffer.size());
+        for (int i = 0; i < 100; ++i) {
+            roundTrip();
+        }
+        double cpuStart = threadCpuSeconds(serverThread);
+        for (int i = 0; i < numMessages; ++i) {
+            roundTrip();
+        }
+        double cpuPerMessage = (threadCpuSeconds(serverThread) - cpuStart) / numMessages * 1e6;
+        std::cout << name << ": " << cpuPerMessage << " us server CPU per message";
+        if (mode == KernelTls) {
+            std::cout << " (kTLS engaged on " << server.stats().ktls_connections << " connections)";
+        }
+        std::cout << std::endl;
+
+        if (mode == Plain) {
+            plain.close(websocket::close_code::normal);
+        } else {
+            secure.close(websocket::close_code::normal);
+        }
+        serverIo.stop();
+        serverThread.join();
+        std::remove((logDir + "/segment-00000001.log").c_str());
+        rmdir(logDir.c_str());
+        std::remove(perfDB.c_str());
+    }
+    std::remove("perf_tls.crt");
+    std::remove("perf_tls.key");
+}
+
+// Typing traffic in 1k active rooms of 10 members, where everyone sends a
+// typing refresh every ~300 ms and starts or stops typing now and then.
+// Compares the frames the server writes with coalescing (one per changed
+// room per 100 ms flush, to every member) against relaying each event to
+// every member.
+TEST_F(PerformanceTest, TypingCoalescingFrameCounts) {
+    const int numRooms = 1000;
+    const int membersPerRoom = 10;
+    const int flushMs = 100;
+    const int durationMs = 3000;
+    const int stepMs = 10;
+
+    PresenceCoalescer coalescer(5000);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> percent(0, 99);
+    for (int room = 0; room < numRooms; ++room) {
+        for (int member = 0; member < membersPerRoom; ++member) {
+            coalescer.presence("room" + std::to_string(room), "user" + std::to_string(member), true);
+        }
+    }
+
+    uint64_t frames = 0;
+    double flushSeconds = 0;
+    for (int now = 0; now < durationMs; now += stepMs) {
+        for (int room = 0; room < numRooms; ++room) {
+            for (int member = 0; member < membersPerRoom; ++member) {
+                int roll = percent(rng);
+                // ~3% per 10 ms step: one refresh per ~300 ms; 1 in 30 of them toggles.
+                if (roll < 3) {
+                    bool active = percent(rng) >= 3;
+                    coalescer.typing("room" + std::to_string(room), "user" + std::to_string(member), active, now);
+                }
+            }
+        }
+        if ((now + stepMs) % flushMs == 0) {
+            auto start = std::chrono::steady_clock::now();
+            frames += coalescer.flush(now).size();
+            flushSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    uint64_t events = coalescer.events();
+    uint64_t relayedWrites = events * membersPerRoom;
+    uint64_t coalescedWrites = frames * membersPerRoom;
+    std::cout << "Typing in " << numRooms << " rooms over " << durationMs << " ms: " << events << " events, "
+              << frames << " frames; " << coalescedWrites << " writes coalesced vs " << relayedWrites
+              << " relayed (" << double(relayedWrites) / coalescedWrites << "x fewer); flush "
+              << flushSeconds * 1e3 / (durationMs / flushMs) << " ms per tick" << std::endl;
+    EXPECT_LE(frames, static_cast<uint64_t>(numRooms) * (durationMs / flushMs));
+    EXPECT_LT(coalescedWrites, relayedWrites);
+}
+
+TEST_F(PerformanceTest, DedupIndexFootprintAndLookup) {
+    const int numUsers = 1000;
+    const int idsPerUser = 100;
+    const int lookups = 1000000;
+    auto id = [](int user, int n) {
+        return "c" + std::to_string(user) + "-" + std::to_string(n) + "-0123456789abcdef";
+    };
+    std::vector<std::string> users;
+    for (int user = 0; user < numUsers; ++user) {
+        users.push_back("user" + std::to_string(user));
+    }
+
+    malloc_trim(0);
+    std::size_t before = mallinfo2().uordblks;
+    DedupIndex index(10 * 60 * 1000, 1024);
+    for (int n = 0; n < idsPerUser; ++n) {
+        for (int user = 0; user < numUsers; ++user) {
+            index.insert(users[user], id(user, n), int64_t(n) * numUsers + user + 1, n);
+        }
+    }
+    std::size_t after = mallinfo2().uordblks;
+    std::size_t entries = index.size();
+    ASSERT_EQ(entries, static_cast<std::size_t>(numUsers) * idsPerUser);
+
+    std::vector<std::string> hits, misses;
+    for (int i = 0; i < 1000; ++i) {
+        hits.push_back(id(i % numUsers, (i * 7) % idsPerUser));
+        misses.push_back(id(i % numUsers, idsPerUser + i));
+    }
+    auto timeLookups = [&](const std::vector<std::string> &ids, bool expectHit) {
+        auto start = std::chrono::steady_clock::now();
+        int found = 0;
+        for (int i = 0; i < lookups; ++i) {
+            int k = i % 1000;
+            found += index.find(users[k % numUsers], ids[k], idsPerUser) != 0;
+        }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        EXPECT_EQ(found, expectHit ? lookups : 0);
+        return ns / lookups;
+    };
+    double hitNs = timeLookups(hits, true);
+    double missNs = timeLookups(misses, false);
+
+    double bytesPerEntry = double(after - before) / entries;
+    std::cout << "Dedup index: " << entries << " ids for " << numUsers << " users in "
+              << (after - before) / 1024 << " KB (" << bytesPerEntry << " bytes per id); lookup "
+              << hitNs << " ns hit, " << missNs << " ns miss" << std::endl;
+    // A 10-minute window at 1024 ids per user stays in the hundreds of bytes per id.
+    EXPECT_LT(bytesPerEntry, 512);
+    EXPECT_LT(hitNs, 5000);
+}
+
+// A user joins a room with 50k stored messages while someone else chats.
+// Reports how long the history replay takes to reach the joiner and the
+// latency of the live messages they receive meanwhile; with a single FIFO
+// every live message would wait for the rest of the replay.
+TEST_F(PerformanceTest, LiveLatencyDuringHistoryReplay) {
+    const int port = 9003;
+    const int historySize = 50000;
+    const int liveMessages = 300;
+    const int liveIntervalMs = 5;
+
+    {
+        DatabaseManager schema(perfDB);
+        ASSERT_TRUE(schema.initDB());
+        sqlite3 *raw = nullptr;
+        ASSERT_EQ(sqlite3_open(perfDB.c_str(), &raw), SQLITE_OK);
+        sqlite3_exec(raw, "PRAGMA synchronous=OFF; BEGIN;", nullptr, nullptr, nullptr);
+        sqlite3_stmt *insert = nullptr;
+        ASSERT_EQ(sqlite3_prepare_v2(raw, "INSERT INTO messages (room, sender, content, timestamp, created_at) "
+                                          "VALUES ('big_room', 'archivist', ?, '2025-04-01T00:00:00Z', ?);",
+                                     -1, &insert, nullptr), SQLITE_OK);
+        for (int i = 0; i < historySize; ++i) {
+            std::string content = "history message " + std::to_string(i) + " with some ordinary chat-sized text";
+            sqlite3_bind_text(insert, 1, content.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(insert, 2, static_cast<sqlite3_int64>(std::time(nullptr)));
+            sqlite3_step(insert);
+            sqlite3_reset(insert);
+        }
+        sqlite3_finalize(insert);
+        sqlite3_exec(raw, "COMMIT;", nullptr, nullptr, nullptr);
+        sqlite3_close(raw);
+    }
+
+    DatabaseManager dbManager(perfDB);
+    ASSERT_TRUE(dbManager.initDB());
+    ServerConfig config;
+    config.connection_rate = config.user_rate = config.room_rate = 0;
+    config.presence_flush_ms = 0;
+    boost::asio::io_context serverIo;
+    WebSocketServer server(serverIo, port, dbManager, config);
+    std::thread serverThread([&]() {
+        server.start_accept();
+        serverIo.run();
+    });
+
+    boost::asio::io_context clientIo;
+    tcp::endpoint endpoint(boost::asio::ip::make_address("127.0.0.1"), port);
+    websocket::stream<tcp::socket> joiner(clientIo), chatter(clientIo);
+    for (auto *ws : {&joiner, &chatter}) {
+        ws->next_layer().connect(endpoint);
+        ws->handshake("localhost", "/");
+    }
+    joinRoom(chatter, "chatter", "chatter_lobby");
+
+    auto joinStart = std::chrono::steady_clock::now();
+    joiner.write(boost::asio::buffer(nlohmann::json({{"type", "join"}, {"username", "joiner"},
+                                                     {"room", "big_room"}}).dump()));
+    beast::flat_buffer buffer;
+    joiner.read(buffer);
+    EXPECT_EQ(nlohmann::json::parse(beast::buffers_to_string(buffer.data()))["type"], "join_response");
+    buffer.consume(buffer.size());
+
+    // Live messages go out every few ms. The chatter is not a member, so it
+    // waits for each message's ack instead of its own copy.
+    std::vector<std::chrono::steady_clock::time_point> sent(liveMessages);
+    std::thread chatterThread([&]() {
+        beast::flat_buffer own;
+        for (int i = 0; i < liveMessages; ++i) {
+            sent[i] = std::chrono::steady_clock::now();
+            chatter.write(boost::asio::buffer(nlohmann::json({{"type", "message"}, {"from", "chatter"},
+                                                              {"room", "big_room"},
+                                                              {"content", "live " + std::to_string(i)},
+                                                              {"client_msg_id", "live-" + std::to_string(i)}}).dump()));
+            chatter.read(own);
+            own.consume(own.size());
+            std::this_thread::sleep_for(std::chrono::milliseconds(liveIntervalMs));
+        }
+    });
+
+    int history = 0;
+    int live = 0;
+    std::chrono::steady_clock::time_point replayEnd;
+    std::vector<std::chrono::steady_clock::time_point> received(liveMessages);
+    while (history < historySize || live < liveMessages) {
+        joiner.read(buffer);
+        auto now = std::chrono::steady_clock::now();
+        auto frame = nlohmann::json::parse(beast::buffers_to_string(buffer.data()));
+        buffer.consume(buffer.size());
+        if (frame["from"] == "chatter") {
+            received[std::stoi(frame["content"].get<std::string>().substr(5))] = now;
+            ++live;
+        } else if (++history == historySize) {
+            replayEnd = now;
+        }
+    }
+    chatterThread.join();
+
+    // Only messages sent while the replay was still arriving count.
+    std::vector<double> latencies;
+    for (int i = 0; i < liveMessages; ++i) {
+        if (sent[i] < replayEnd) {
+            latencies.push_back(std::chrono::duration<double, std::milli>(received[i] - sent[i]).count());
+        }
+    }
+    double replayMs = std::chrono::duration<double, std::milli>(replayEnd - joinStart).count();
+    ASSERT_FALSE(latencies.empty());
+    std::sort(latencies.begin(), latencies.end());
+    double p50 = latencies[latencies.size() / 2];
+    double p99 = latencies[latencies.size() * 99 / 100];
+    std::cout << "Joining a " << historySize << "-message room: replay took " << replayMs << " ms; "
+              << latencies.size() << " live messages during it had p50 " << p50 << " ms, p99 " << p99
+              << " ms, max " << latencies.back() << " ms" << std::endl;
+    // Behind a single FIFO the median lands at a good fraction of the replay.
+    EXPECT_LT(p50, replayMs / 8);
+
+    joiner.close(websocket::close_code::normal);
+    chatter.close(websocket::close_code::normal);
+    serverIo.stop();
+    serverThread.join();
+}
+
+// Throughput of the message round trip with tracing off and on, alternating
+// rounds so drift on the machine hits both alike.
+TEST_F(PerformanceTest, TracingOverhead) {
+    const int port = 9003;
+    const int rounds = 6;
+    const int messagesPerRound = 2000;
+
+    DatabaseManager dbManager(perfDB);
+    ASSERT_TRUE(dbManager.initDB());
+    ServerConfig config;
+    config.connection_rate = config.user_rate = config.room_rate = 0;
+    config.presence_flush_ms = 0;
+    boost::asio::io_context serverIo;
+    WebSocketServer server(serverIo, port, dbManager, config);
+    std::thread serverThread([&]() {
+        server.start_accept();
+        serverIo.run();
+    });
+
+    boost::asio::io_context clientIo;
+    websocket::stream<tcp::socket> ws(clientIo);
+    ws.next_layer().connect(tcp::endpoint(boost::asio::ip::make_address("127.0.0.1"), port));
+    ws.handshake("localhost", "/");
+    joinRoom(ws, "perf_client", "trace_room");
+    const std::string msg = nlohmann::json({
+        {"type", "message"},
+        {"from", "perf_client"},
+        {"room", "trace_room"},
+        {"content", "tracing probe"}
+    }).dump();
+
+    beast::flat_buffer buffer;
+    double seconds[2] = {0, 0};
+    uint64_t before = Tracer::global().recorded();
+    for (int round = 0; round < rounds * 2; ++round) {
+        bool traced = round % 2 == 1;
+        Tracer::global().enable(traced ? 1 << 16 : 0);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < messagesPerRound; ++i) {
+            ws.write(boost::asio::buffer(msg));
+            ws.read(buffer);
+            buffer.consume(buffer.size());
+        }
+        seconds[traced] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    Tracer::global().enable(0);
+    uint64_t events = Tracer::global().recorded() - before;
+
+    double off = rounds * messagesPerRound / seconds[0];
+    double on = rounds * messagesPerRound / seconds[1];
+    std::cout << "Tracing: " << off << " msg/s off, " << on << " msg/s on (" << (1 - on / off) * 100
+              << "% slower), " << double(events) / (rounds * messagesPerRound) << " events per message"
+              << std::endl;
+    EXPECT_GT(events, 0u);
+    EXPECT_GT(on, off * 0.85);
+
+    ws.close(websocket::close_code::normal);
+    serverIo.stop();
+    serverThread.join();
+}
+
+// Restart against a large database, with and without the warm history
+// cache: how soon the server accepts, how long the preload takes, and how
+// long the first joins into the busiest rooms take to receive their history.
+// With the cache on, joins replay only each room's newest messages.
+TEST_F(PerformanceTest, StartupPreloadAndFirstJoin) {
+    const int port = 9003;
+    const int numRooms = 200;
+    const int busyRooms = 20;
+    const int busyMessages = 5000;
+    const int otherMessages = 500;
+    const int joins = 5;
+
+    {
+        DatabaseManager schema(perfDB);
+        ASSERT_TRUE(schema.initDB());
+        sqlite3 *raw = nullptr;
+        ASSERT_EQ(sqlite3_open(perfDB.c_str(), &raw), SQLITE_OK);
+        sqlite3_exec(raw, "PRAGMA synchronous=OFF; BEGIN;", nullptr, nullptr, nullptr);
+        sqlite3_stmt *insert = nullptr;
+        ASSERT_EQ(sqlite3_prepare_v2(raw, "INSERT INTO messages (room, sender, content, timestamp, created_at) "
+                                          "VALUES (?, 'user', ?, '2025-04-01T00:00:00Z', ?);",
+                                     -1, &insert, nullptr), SQLITE_OK);
+        // Interleaved, as real traffic would be, so no room's rows sit together.
+        std::vector<int> order;
+        for (int room = 0; room < numRooms; ++room) {
+            order.insert(order.end(), room < busyRooms ? busyMessages : otherMessages, room);
+        }
+        std::shuffle(order.begin(), order.end(), std::mt19937(7));
+        for (std::size_t i = 0; i < order.size(); ++i) {
+            std::string name = "room" + std::to_string(order[i]);
+            std::string content = "message " + std::to_string(i) + " with some ordinary chat-sized text";
+            sqlite3_bind_text(insert, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(insert, 2, content.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(insert, 3, static_cast<sqlite3_int64>(std::time(nullptr)));
+            sqlite3_step(insert);
+            sqlite3_reset(insert);
+        }
+        sqlite3_finalize(insert);
+        sqlite3_exec(raw, "COMMIT;", nullptr, nullptr, nullptr);
+        sqlite3_close(raw);
+    }
+
+    for (bool preload : {false, true}) {
+        auto start = std::chrono::steady_clock::now();
+        DatabaseManager dbManager(perfDB);
+        ASSERT_TRUE(dbManager.initDB());
+        ServerConfig config;
+        config.connection_rate = config.user_rate = config.room_rate = 0;
+        config.preload_rooms = preload ? busyRooms : 0;
+        boost::asio::io_context serverIo;
+        WebSocketServer server(serverIo, port, dbManager, config);
+        std::thread serverThread([&]() {
+            server.start_accept();
+            serverIo.run();
+        });
+
+        boost::asio::io_context clientIo;
+        tcp::endpoint endpoint(boost::asio::ip::make_address("127.0.0.1"), port);
+        websocket::stream<tcp::socket> probe(clientIo);
+        probe.next_layer().connect(endpoint);
+        probe.handshake("localhost", "/");
+        double acceptingMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        for (int i = 0; i < 1000 && preload && server.stats().preload_ms == 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        // First join into each of the busiest rooms, timed to the last history frame.
+        std::vector<double> joinMs;
+        std::size_t historyTotal = 0;
+        for (int room = 0; room < joins; ++room) {
+            auto history = dbManager.getMessagesForRoom("room" + std::to_string(room)).size();
+            if (preload) {
+                history = std::min(history, config.preload_messages_per_room);
+            }
+            historyTotal += history;
+            websocket::stream<tcp::socket> ws(clientIo);
+            ws.next_layer().connect(endpoint);
+            ws.handshake("localhost", "/");
+            auto joinStart = std::chrono::steady_clock::now();
+            ws.write(boost::asio::buffer(nlohmann::json({{"type", "join"}, {"username", "joiner"},
+                                                         {"room", "room" + std::to_string(room)}}).dump()));
+            beast::flat_buffer buffer;
+            for (std::size_t frames = 0; frames < history + 1; ++frames) {
+                ws.read(buffer);
+                buffer.consume(buffer.size());
+            }
+            joinMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - joinStart).count());
+            ws.close(websocket::close_code::normal);
+        }
+        std::sort(joinMs.begin(), joinMs.end());
+
+        std::cout << (preload ? "Preload on: " : "Preload off: ") << "accepting after " << acceptingMs << " ms";
+        if (preload) {
+            std::cout << ", preload of " << server.stats().preload_rooms_loaded << " rooms took "
+                      << server.stats().preload_ms << " ms";
+        }
+        std::cout << "; first join (" << historyTotal / joins << "-message rooms) median " << joinMs[joins / 2]
+                  << " ms, max " << joinMs.back() << " ms; cache hits " << server.stats().history_cache_hits
+                  << std::endl;
+        if (preload) {
+            EXPECT_EQ(server.stats().preload_rooms_loaded, static_cast<uint64_t>(busyRooms));
+            EXPECT_EQ(server.stats().history_cache_hits, static_cast<uint64_t>(joins));
+        }
+
+        probe.close(websocket::close_code::normal);
+        serverIo.stop();
+        serverThread.join();
+    }
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
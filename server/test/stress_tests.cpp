@@ -4,10 +4,14 @@
 #include <boost/beast.hpp>
 #include <thread>
 #include <vector>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <mutex>
 #include <iostream>
 #include <cstdio>
+#include <memory>
+#include <sys/resource.h>
 #include "DatabaseManager.h"
 #include "websocket_server.h"
 #include <nlohmann/json.hpp>
@@ -21,6 +25,20 @@ using json = nlohmann::json;
 static const int STRESS_TEST_PORT = 9002;
 static const int NUM_CLIENTS = 50;  // Number of concurrent clients
 
+// Chat reaches only a room's members, so every client joins first. Presence
+// frames are turned off so the clients see nothing but chat.
+static ServerConfig chatOnlyConfig() {
+    ServerConfig config;
+    config.presence_flush_ms = 0;
+    return config;
+}
+
+static void joinRoom(websocket::stream<tcp::socket> &ws, const std::string &username, const std::string &room) {
+    ws.write(asio::buffer(json({{"type", "join"}, {"username", username}, {"room", room}}).dump()));
+    beast::flat_buffer buffer;
+    ws.read(buffer);
+}
+
 // StressTest fixture starts the server in a separate thread using a dedicated database.
 class StressTest : public ::testing::Test {
 protected:
@@ -30,7 +48,7 @@ protected:
     std::thread serverThread;
 
     StressTest() 
-      : server(serverIo, STRESS_TEST_PORT, dbManager) 
+      : server(serverIo, STRESS_TEST_PORT, dbManager, chatOnlyConfig()) 
     {
         // Initialize the test database and start the server.
         dbManager.initDB();
@@ -55,8 +73,9 @@ TEST_F(StressTest, ConcurrentMessageBroadcast) {
     std::mutex latenciesMutex;
     std::vector<std::thread> clientThreads;
 
-    // Each client will connect, send a message, and wait for the broadcast (its own message).
-    auto clientFunc = [&latencies, &latenciesMutex]() {
+    // Each client will connect, join the shared room, send a message, and wait
+    // for the broadcast of its own message.
+    auto clientFunc = [&latencies, &latenciesMutex](int id) {
         try {
             asio::io_context io;
             tcp::resolver resolver(io);
@@ -64,11 +83,13 @@ TEST_F(StressTest, ConcurrentMessageBroadcast) {
             websocket::stream<tcp::socket> ws(io);
             asio::connect(ws.next_layer(), results.begin(), results.end());
             ws.handshake("localhost", "/");
+            const std::string name = "stress_client_" + std::to_string(id);
+            joinRoom(ws, name, "stress_room");
 
             // Create the test message.
             json msg = {
                 {"type", "message"},
-                {"from", "stress_client"},
+                {"from", name},
                 {"room", "stress_room"},
                 {"content", "Hello from stress test"},
                 {"timestamp", "2025-04-01T00:00:00Z"}
@@ -77,9 +98,14 @@ TEST_F(StressTest, ConcurrentMessageBroadcast) {
             auto start = std::chrono::steady_clock::now();
             ws.write(asio::buffer(msg.dump()));
 
-            // Wait for the broadcast message (assumes client receives its own message).
-            beast::flat_buffer buffer;
-            ws.read(buffer);
+            // Room history and the other clients' messages arrive too; wait for our own.
+            for (;;) {
+                beast::flat_buffer buffer;
+                ws.read(buffer);
+                if (json::parse(beast::buffers_to_string(buffer.data())).value("from", "") == name) {
+                    break;
+                }
+            }
             auto end = std::chrono::steady_clock::now();
             std::chrono::duration<double> elapsed = end - start;
             {
@@ -94,7 +120,7 @@ TEST_F(StressTest, ConcurrentMessageBroadcast) {
 
     // Launch NUM_CLIENTS concurrently.
     for (int i = 0; i < NUM_CLIENTS; i++) {
-        clientThreads.emplace_back(clientFunc);
+        clientThreads.emplace_back(clientFunc, i);
     }
 
     // Wait for all clients to complete.
@@ -120,6 +146,289 @@ TEST_F(StressTest, ConcurrentMessageBroadcast) {
     EXPECT_LT(avgLatency, 0.1);
 }
 
+static double cpu_seconds(const timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Fan-out load on each socket backend in turn: Asio's epoll reactor, then
+// io_uring (ServerConfig::io_uring). The same 100 receivers and 200 messages
+// run against a fresh server each time, so the numbers compare directly.
+// System CPU per delivery is mostly socket syscalls; on io_uring the sends
+// of a broadcast share io_uring_enter calls, counted as SQEs per call.
+TEST(IoBackendTest, BroadcastFanOut) {
+    const int numReceivers = 100;
+    const int numMessages = 200;
+    double rate[2] = {0, 0};
+
+    for (bool uring : {false, true}) {
+        ServerConfig config = chatOnlyConfig();
+        config.io_uring = uring;
+        DatabaseManager dbManager("stress_test.db");
+        dbManager.initDB();
+        boost::asio::io_context serverIo;
+        WebSocketServer server(serverIo, STRESS_TEST_PORT, dbManager, config);
+        std::thread serverThread([&]() {
+            server.start_accept();
+            serverIo.run();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        asio::io_context io;
+        tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), STRESS_TEST_PORT);
+        std::vector<std::unique_ptr<websocket::stream<tcp::socket>>> clients;
+        for (int i = 0; i < numReceivers + 1; i++) {
+            clients.emplace_back(new websocket::stream<tcp::socket>(io));
+            clients.back()->next_layer().connect(endpoint);
+            clients.back()->handshake("localhost", "/");
+            joinRoom(*clients.back(), i == 0 ? "fanout_sender" : "fanout_" + std::to_string(i), "fanout_room");
+        }
+        auto &sender = *clients[0];
+        // Let the server finish registering every session before timing.
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        uint64_t callsBefore = server.uring_submit_calls(), sqesBefore = server.uring_submitted();
+        rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < numMessages; i++) {
+            json msg = {
+                {"type", "message"},
+                {"from", "fanout_sender"},
+                {"room", "fanout_room"},
+                {"content", "fan-out message " + std::to_string(i)},
+                {"timestamp", "2025-04-01T00:00:00Z"}
+            };
+            sender.write(asio::buffer(msg.dump()));
+        }
+        // Every member, the sender included, receives every broadcast.
+        int delivered = 0;
+        for (auto &client : clients) {
+            for (int i = 0; i < numMessages; i++) {
+                beast::flat_buffer buffer;
+                client->read(buffer);
+                ++delivered;
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        getrusage(RUSAGE_SELF, &after);
+
+        double systemCpu = cpu_seconds(after.ru_stime) - cpu_seconds(before.ru_stime);
+        double userCpu = cpu_seconds(after.ru_utime) - cpu_seconds(before.ru_utime);
+        rate[uring] = delivered / elapsed.count();
+        std::cout << "Fan-out (" << (uring ? "io_uring" : io_backend_name()) << "): " << delivered
+                  << " deliveries in " << elapsed.count() << " seconds, " << rate[uring]
+                  << " deliveries per second" << std::endl;
+        std::cout << "CPU per delivery: " << systemCpu * 1e6 / delivered << " us system, "
+                  << userCpu * 1e6 / delivered << " us user";
+        if (uring) {
+            uint64_t calls = server.uring_submit_calls() - callsBefore;
+            uint64_t sqes = server.uring_submitted() - sqesBefore;
+            std::cout << "; " << sqes << " SQEs in " << calls << " io_uring_enter calls ("
+                      << static_cast<double>(sqes) / std::max<uint64_t>(calls, 1) << " per call)";
+            EXPECT_GT(sqes, calls);
+        }
+        std::cout << std::endl;
+        EXPECT_EQ(delivered, (numReceivers + 1) * numMessages);
+
+        for (auto &client : clients) {
+            boost::system::error_code ec;
+            client->next_layer().close(ec);
+        }
+        serverIo.stop();
+        serverThread.join();
+        std::remove("stress_test.db");
+    }
+    std::cout << "io_uring vs epoll: " << rate[1] / rate[0] << "x the deliveries per second" << std::endl;
+}
+
+// Round-trip latency of a client in a quiet room, alone and while another
+// client floods a different room at ~2k messages/s (ten times its limit), with the rate limits on
+// and (for comparison) off. The limits keep the flood from reaching the
+// database and the broadcast path, so the quiet room's p99 should barely move.
+static double probeP99(websocket::stream<tcp::socket> &probe, int rounds) {
+    std::vector<double> latencies;
+    for (int i = 0; i < rounds; i++) {
+        // A chatty but well-behaved client: about 100 messages per second.
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::string text = "probe " + std::to_string(i);
+        json msg = {{"type", "message"}, {"from", "probe"}, {"room", "quiet_room"}, {"text", text}};
+        auto start = std::chrono::steady_clock::now();
+        probe.write(asio::buffer(msg.dump()));
+        // Skip anything else the server sends (presence); wait for our own message.
+        for (;;) {
+            beast::flat_buffer buffer;
+            probe.read(buffer);
+            json received = json::parse(beast::buffers_to_string(buffer.data()));
+            if (received.value("text", "") == text) {
+                break;
+            }
+        }
+        latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    return latencies[latencies.size() * 99 / 100];
+}
+
+TEST(RateLimitTest, FloodingClientDoesNotMoveOtherRoomsP99) {
+    const int rounds = 200;
+    double limitedBaseline = 0, limitedFlood = 0;
+    uint64_t dropped = 0;
+    for (bool limited : {true, false}) {
+        ServerConfig config;
+        if (!limited) {
+            config.connection_rate = config.user_rate = config.room_rate = 0;
+        }
+        DatabaseManager dbManager("stress_test.db");
+        dbManager.initDB();
+        boost::asio::io_context serverIo;
+        WebSocketServer server(serverIo, STRESS_TEST_PORT, dbManager, config);
+        std::thread serverThread([&]() {
+            server.start_accept();
+            serverIo.run();
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        asio::io_context io;
+        tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), STRESS_TEST_PORT);
+        websocket::stream<tcp::socket> probe(io), flooder(io);
+        for (auto *ws : {&probe, &flooder}) {
+            ws->next_layer().connect(endpoint);
+            ws->handshake("localhost", "/");
+        }
+        json join = {{"type", "join"}, {"username", "probe"}, {"room", "quiet_room"}};
+        probe.write(asio::buffer(join.dump()));
+        beast::flat_buffer buffer;
+        probe.read(buffer);
+        flooder.write(asio::buffer(json({{"type", "join"}, {"username", "flooder"}, {"room", "flooder_lobby"}}).dump()));
+        double baseline = probeP99(probe, rounds);
+
+        // The flooder never reads; what the server sends it just sits in socket buffers.
+        std::atomic<bool> flooding{true};
+        std::thread floodThread([&]() {
+            json flood = {{"type", "message"}, {"from", "flooder"}, {"room", "flood_room"}, {"text", "spam"}};
+            const std::string payload = flood.dump();
+            boost::system::error_code ec;
+            while (flooding && !ec) {
+                for (int i = 0; i < 2 && !ec; i++) {
+                    flooder.write(asio::buffer(payload), ec);
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        double duringFlood = probeP99(probe, rounds);
+        flooding = false;
+        floodThread.join();
+
+        std::cout << "Quiet room p99 with rate limits " << (limited ? "on" : "off") << ": " << baseline
+                  << " ms alone, " << duringFlood << " ms during flood" << std::endl;
+        if (limited) {
+            limitedBaseline = baseline;
+            limitedFlood = duringFlood;
+            dropped = server.stats().rate_limited;
+        }
+
+        boost::system::error_code ec;
+        probe.next_layer().close(ec);
+        flooder.next_layer().close(ec);
+        serverIo.stop();
+        serverThread.join();
+        std::remove("stress_test.db");
+    }
+    EXPECT_GT(dropped, 0u);
+    EXPECT_LT(limitedFlood, std::max(limitedBaseline * 2, limitedBaseline + 2.0));
+}
+
+// Reconnect storm: `count` clients connect and start the WebSocket handshake
+// all at once, as after an outage. Returns once every client has either
+// finished its handshake or failed; the connections stay open in `clients`,
+// which must be destroyed before `io`.
+struct StormResult {
+    int connected = 0;
+    int failed = 0;
+    double seconds = 0;
+};
+
+static StormResult reconnectStorm(asio::io_context &io, const tcp::endpoint &endpoint, int count,
+                                  std::vector<std::unique_ptr<websocket::stream<tcp::socket>>> &clients) {
+    StormResult result;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        clients.emplace_back(new websocket::stream<tcp::socket>(io));
+        auto *ws = clients.back().get();
+        ws->next_layer().async_connect(endpoint, [ws, &result](boost::system::error_code ec) {
+            if (ec) {
+                result.failed++;
+                return;
+            }
+            ws->async_handshake("localhost", "/", [&result](boost::system::error_code ec) {
+                ec ? result.failed++ : result.connected++;
+            });
+        });
+    }
+    io.run();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// Established sessions keep their latency while a storm of 2000 reconnects,
+// twice max_connections, hits the listener.
+TEST(AdmissionTest, ReconnectStormSparesEstablishedSessions) {
+    const int stormClients = 2000;
+    ServerConfig config;
+    config.max_connections = 1000;
+    config.max_handshakes = 64;
+    config.accept_batch = 8;
+    config.listen_backlog = 4096;
+    DatabaseManager dbManager("stress_test.db");
+    dbManager.initDB();
+    boost::asio::io_context serverIo;
+    WebSocketServer server(serverIo, STRESS_TEST_PORT, dbManager, config);
+    std::thread serverThread([&]() {
+        server.start_accept();
+        serverIo.run();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    asio::io_context io;
+    tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), STRESS_TEST_PORT);
+    websocket::stream<tcp::socket> probe(io);
+    probe.next_layer().connect(endpoint);
+    probe.handshake("localhost", "/");
+    json join = {{"type", "join"}, {"username", "probe"}, {"room", "quiet_room"}};
+    probe.write(asio::buffer(join.dump()));
+    beast::flat_buffer buffer;
+    probe.read(buffer);
+    double baseline = probeP99(probe, 100);
+
+    asio::io_context stormIo;
+    std::vector<std::unique_ptr<websocket::stream<tcp::socket>>> storm;
+    StormResult result;
+    std::thread stormThread([&]() { result = reconnectStorm(stormIo, endpoint, stormClients, storm); });
+    double duringStorm = probeP99(probe, 100);
+    stormThread.join();
+
+    std::cout << "Reconnect storm: " << result.connected << " connected, " << result.failed << " rejected in "
+              << result.seconds << " s; accepts paused " << server.stats().accepts_paused << " times" << std::endl;
+    std::cout << "Established session p99: " << baseline << " ms before, " << duringStorm << " ms during storm"
+              << std::endl;
+    EXPECT_EQ(result.connected + result.failed, stormClients);
+    // The probe holds one of the slots.
+    EXPECT_EQ(result.connected, config.max_connections - 1);
+    EXPECT_EQ(server.stats().connections_rejected, static_cast<uint64_t>(result.failed));
+    EXPECT_LE(server.stats().connections, config.max_connections);
+
+    // The probe is still served after the storm.
+    EXPECT_GT(probeP99(probe, 10), 0);
+
+    storm.clear();
+    boost::system::error_code ec;
+    probe.next_layer().close(ec);
+    serverIo.stop();
+    serverThread.join();
+    std::remove("stress_test.db");
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
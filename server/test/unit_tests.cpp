@@ -1,7 +1,28 @@
 // server/test/unit_tests.cpp
 #include <gtest/gtest.h>
 #include "DatabaseManager.h"
+#include "TimerWheel.h"
+#include "LogMessageStore.h"
+#include "Backplane.h"
+#include "BrokerBackplane.h"
+#include "RateLimiter.h"
+#include "PresenceCoalescer.h"
+#include "DedupIndex.h"
+#include "Tracer.h"
+#include "RoomCache.h"
+#include <nlohmann/json.hpp>
 #include <cstdio> // For remove()
+#include <vector>
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <sstream>
 
 // Fixture for tests using a temporary test database.
 class DatabaseManagerTest : public ::testing::Test {
@@ -57,6 +78,591 @@ TEST_F(DatabaseManagerTest, MessageStorageAndRetrieval) {
     EXPECT_EQ(messages[0]["timestamp"], timestamp);
 }
 
+TEST_F(DatabaseManagerTest, ClientMessageIdsAreUnique) {
+    DatabaseManager dbManager(testDB);
+    ASSERT_TRUE(dbManager.initDB());
+
+    int64_t first = 0, again = 0, other = 0;
+    bool duplicate = true;
+    ASSERT_TRUE(dbManager.storeMessage("general", "alice", "hi", "t1", "c-1", first, duplicate));
+    EXPECT_FALSE(duplicate);
+    EXPECT_GT(first, 0);
+
+    // The same sender resending the id gets the original row back.
+    ASSERT_TRUE(dbManager.storeMessage("general", "alice", "hi", "t1", "c-1", again, duplicate));
+    EXPECT_TRUE(duplicate);
+    EXPECT_EQ(again, first);
+
+    // Ids are scoped to the sender, and messages without one never collide.
+    ASSERT_TRUE(dbManager.storeMessage("general", "bob", "hi", "t2", "c-1", other, duplicate));
+    EXPECT_FALSE(duplicate);
+    EXPECT_NE(other, first);
+    EXPECT_TRUE(dbManager.storeMessage("general", "alice", "plain", "t3"));
+    EXPECT_TRUE(dbManager.storeMessage("general", "alice", "plain", "t3"));
+    EXPECT_EQ(dbManager.getMessagesForRoom("general").size(), 4u);
+}
+
+TEST_F(DatabaseManagerTest, SearchIsScopedAndRanked) {
+    DatabaseManager dbManager(testDB);
+    ASSERT_TRUE(dbManager.initDB());
+
+    ASSERT_TRUE(dbManager.storeMessage("general", "alice", "deploy the release tonight", "t1"));
+    ASSERT_TRUE(dbManager.storeMessage("general", "bob", "release release release notes", "t2"));
+    ASSERT_TRUE(dbManager.storeMessage("general", "bob", "lunch anyone?", "t3"));
+    ASSERT_TRUE(dbManager.storeMessage("general chat", "alice", "release party", "t4"));
+    ASSERT_TRUE(dbManager.storeMessage("random", "alice", "release the kraken", "t5"));
+
+    // Only exact room matches, best match first.
+    auto results = dbManager.searchMessages("general", "", "release", 10, 0);
+    ASSERT_EQ(results.size(), 2u);
+    EXPECT_EQ(results[0]["from"], "bob");
+    EXPECT_EQ(results[1]["from"], "alice");
+
+    // Sender scope and multi-word AND.
+    results = dbManager.searchMessages("general", "alice", "release", 10, 0);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0]["timestamp"], "t1");
+    EXPECT_EQ(dbManager.searchMessages("general", "", "release tonight", 10, 0).size(), 1u);
+
+    // Pagination.
+    results = dbManager.searchMessages("general", "", "release", 1, 1);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0]["from"], "alice");
+
+    // FTS syntax in user input is treated literally.
+    EXPECT_TRUE(dbManager.searchMessages("general", "", "\"release OR (", 10, 0).empty());
+}
+
+TEST_F(DatabaseManagerTest, ColdMonthsAreArchivedAndExpired) {
+    StorageConfig storage;
+    storage.hotMonths = 1;
+    storage.retentionMonths = 6;
+    DatabaseManager dbManager(testDB, storage);
+    ASSERT_TRUE(dbManager.initDB());
+
+    std::time_t now = std::time(nullptr);
+    for (int i = 0; i < 5; ++i) {
+        ASSERT_TRUE(dbManager.storeMessage("general", "alice", "old " + std::to_string(i), "t"));
+    }
+    ASSERT_TRUE(dbManager.storeMessage("random", "bob", "elsewhere", "t"));
+    // Enough for compaction to stream several pages and chunks.
+    for (int i = 0; i < 2500; ++i) {
+        ASSERT_TRUE(dbManager.storeMessage("busy", "carol", "busy " + std::to_string(i), "t"));
+    }
+
+    // Two months on, this month is cold: it moves into an archive file and
+    // reads come back unchanged, in order.
+    std::time_t later = now + 62 * 24 * 3600;
+    std::vector<std::string> expired;
+    ASSERT_TRUE(dbManager.compactPartitions(later, expired));
+    EXPECT_TRUE(expired.empty());
+    std::tm parts;
+    gmtime_r(&now, &parts);
+    std::string archivePath = testDB + ".archive-" + std::to_string((parts.tm_year + 1900) * 100 + parts.tm_mon + 1);
+    FILE* archived = std::fopen(archivePath.c_str(), "rb");
+    ASSERT_NE(archived, nullptr);
+    std::fclose(archived);
+
+    ASSERT_TRUE(dbManager.storeMessage("general", "alice", "new", "t"));
+    auto messages = dbManager.getMessagesForRoom("general");
+    ASSERT_EQ(messages.size(), 6u);
+    EXPECT_EQ(messages[0]["content"], "old 0");
+    EXPECT_EQ(messages[4]["content"], "old 4");
+    EXPECT_EQ(messages[5]["content"], "new");
+    ASSERT_EQ(dbManager.getMessagesForRoom("random").size(), 1u);
+    auto busy = dbManager.getMessagesForRoom("busy");
+    ASSERT_EQ(busy.size(), 2500u);
+    for (int i = 0; i < 2500; ++i) {
+        ASSERT_EQ(busy[i]["content"], "busy " + std::to_string(i));
+    }
+
+    // The newest messages, live first and then back through the archive.
+    auto recent = dbManager.recentFrames("general", 3);
+    ASSERT_EQ(recent.size(), 3u);
+    for (std::size_t i = 0; i < recent.size(); ++i) {
+        EXPECT_EQ(*recent[i].second, messages[3 + i].dump());
+    }
+    recent = dbManager.recentFrames("busy", 10);
+    ASSERT_EQ(recent.size(), 10u);
+    EXPECT_EQ(*recent.front().second, busy[2490].dump());
+    EXPECT_EQ(*recent.back().second, busy[2499].dump());
+    EXPECT_EQ(dbManager.recentFrames("random", 10).size(), 1u);
+
+    // Archived messages are still found by search, ranked alongside live ones
+    // and paged across both.
+    auto found = dbManager.searchMessages("general", "", "old", 10, 0);
+    ASSERT_EQ(found.size(), 5u);
+    EXPECT_EQ(found[0]["from"], "alice");
+    EXPECT_TRUE(dbManager.searchMessages("general", "bob", "old", 10, 0).empty());
+    EXPECT_TRUE(dbManager.searchMessages("random", "", "old", 10, 0).empty());
+    found = dbManager.searchMessages("busy", "carol", "busy 1234", 10, 0);
+    ASSERT_EQ(found.size(), 1u);
+    EXPECT_EQ(found[0]["content"], "busy 1234");
+    ASSERT_TRUE(dbManager.storeMessage("general", "alice", "old but live", "t"));
+    EXPECT_EQ(dbManager.searchMessages("general", "", "old", 10, 0).size(), 6u);
+    EXPECT_EQ(dbManager.searchMessages("general", "", "old", 4, 4).size(), 2u);
+
+    // Reading from a later point skips the archived month.
+    EXPECT_EQ(dbManager.getMessagesForRoom("general", now + 31 * 24 * 3600).size(), 0u);
+
+    // Past retention the archive is dropped entirely, and every room is reported.
+    ASSERT_TRUE(dbManager.compactPartitions(now + 400 * 24 * 3600, expired));
+    std::sort(expired.begin(), expired.end());
+    EXPECT_EQ(expired, std::vector<std::string>({"busy", "general", "random"}));
+    EXPECT_EQ(std::fopen(archivePath.c_str(), "rb"), nullptr);
+    EXPECT_TRUE(dbManager.getMessagesForRoom("random").empty());
+    EXPECT_TRUE(dbManager.searchMessages("busy", "", "busy", 10, 0).empty());
+}
+
+// Remove a log engine directory and its segments.
+static void removeLogDirectory(const std::string &directory) {
+    char name[32];
+    for (unsigned number = 1; number < 100; ++number) {
+        std::snprintf(name, sizeof(name), "/segment-%08u.log", number);
+        std::remove((directory + name).c_str());
+    }
+    rmdir(directory.c_str());
+}
+
+TEST_F(DatabaseManagerTest, LogEngineStoresMessages) {
+    removeLogDirectory(testDB + ".log");
+    StorageConfig storage;
+    storage.engine = StorageConfig::Log;
+    storage.logSegmentBytes = 4096; // Force several segment rolls.
+    {
+        DatabaseManager dbManager(testDB, storage);
+        ASSERT_TRUE(dbManager.initDB());
+        EXPECT_TRUE(dbManager.registerUser("loguser", "secret"));
+        for (int i = 0; i < 100; ++i) {
+            ASSERT_TRUE(dbManager.storeMessage(i % 2 ? "odd" : "even", "loguser", "message " + std::to_string(i), "t"));
+        }
+    }
+
+    // Reopening rebuilds the room index from the segments.
+    DatabaseManager dbManager(testDB, storage);
+    ASSERT_TRUE(dbManager.initDB());
+    EXPECT_TRUE(dbManager.authenticateUser("loguser", "secret"));
+    auto messages = dbManager.getMessagesForRoom("odd");
+    ASSERT_EQ(messages.size(), 50u);
+    EXPECT_EQ(messages[0]["content"], "message 1");
+    EXPECT_EQ(messages[49]["content"], "message 99");
+
+    // Frames written straight from the log match the JSON history exactly.
+    ASSERT_TRUE(dbManager.storeMessage("odd", "log\"user", "quote \" slash \\ tab \t nl \n ctl \x01 caf\xc3\xa9", "t\r"));
+    messages = dbManager.getMessagesForRoom("odd");
+    auto frames = dbManager.historyFrames("odd");
+    ASSERT_EQ(frames.size(), messages.size());
+    for (std::size_t i = 0; i < frames.size(); ++i) {
+        EXPECT_EQ(frames[i].first, messages[i]["seq"].get<int64_t>());
+        EXPECT_EQ(*frames[i].second, messages[i].dump());
+    }
+    auto recent = dbManager.recentFrames("odd", 5);
+    ASSERT_EQ(recent.size(), 5u);
+    for (std::size_t i = 0; i < recent.size(); ++i) {
+        EXPECT_EQ(*recent[i].second, *frames[frames.size() - 5 + i].second);
+    }
+    EXPECT_EQ(dbManager.recentFrames("odd", 1000).size(), frames.size());
+    removeLogDirectory(testDB + ".log");
+}
+
+TEST(LogMessageStoreTest, RecoversFromTornTail) {
+    const std::string directory = "log_store_test";
+    removeLogDirectory(directory);
+    StorageConfig storage;
+    {
+        LogMessageStore store(directory, storage);
+        ASSERT_TRUE(store.open());
+        for (int i = 0; i < 3; ++i) {
+            ASSERT_TRUE(store.storeMessage("room", "writer", "record " + std::to_string(i), "t"));
+        }
+    }
+
+    // Flip the last written byte, which belongs to the final record's payload.
+    const std::string segment = directory + "/segment-00000001.log";
+    std::string bytes;
+    {
+        std::ifstream in(segment, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::size_t last = bytes.find_last_not_of('\0');
+    ASSERT_NE(last, std::string::npos);
+    {
+        std::fstream out(segment, std::ios::in | std::ios::out | std::ios::binary);
+        out.seekp(static_cast<std::streamoff>(last));
+        out.put(static_cast<char>(bytes[last] ^ 0x5a));
+    }
+
+    {
+        LogMessageStore store(directory, storage);
+        ASSERT_TRUE(store.open());
+        auto messages = store.getMessagesForRoom("room", 0);
+        ASSERT_EQ(messages.size(), 2u);
+        EXPECT_EQ(messages[1]["content"], "record 1");
+        ASSERT_TRUE(store.storeMessage("room", "writer", "after recovery", "t"));
+    }
+
+    LogMessageStore store(directory, storage);
+    ASSERT_TRUE(store.open());
+    std::vector<std::string> contents;
+    store.replayRoom("room", 0, [&contents](const LogMessageStore::RecordView &view) {
+        contents.push_back(view.content.to_string());
+    });
+    ASSERT_EQ(contents.size(), 3u);
+    EXPECT_EQ(contents[2], "after recovery");
+    removeLogDirectory(directory);
+}
+
+TEST(TimerWheelTest, ExpiresEntriesAtTheirTick) {
+    TimerWheel<int> wheel(1000);
+    // Spread entries across all levels, including one beyond the wheel's range.
+    std::vector<uint64_t> expiries = {1001, 1063, 1064, 1100, 5000, 300000, 20000000};
+    for (std::size_t i = 0; i < expiries.size(); ++i) {
+        wheel.schedule(expiries[i], static_cast<int>(i));
+    }
+    EXPECT_EQ(wheel.size(), expiries.size());
+
+    std::vector<std::pair<uint64_t, int>> fired;
+    for (uint64_t tick = 1001; tick <= 20000000; tick += 7) {
+        wheel.advance(tick, [&](int item) { fired.push_back({wheel.now(), item}); });
+    }
+    wheel.advance(20000000, [&](int item) { fired.push_back({wheel.now(), item}); });
+
+    ASSERT_EQ(fired.size(), expiries.size());
+    for (auto &f : fired) {
+        EXPECT_EQ(f.first, expiries[f.second]);
+    }
+    EXPECT_EQ(wheel.size(), 0u);
+}
+
+TEST(TimerWheelTest, PastDeadlinesFireOnNextTick) {
+    TimerWheel<int> wheel(50);
+    wheel.schedule(10, 1);
+    int fired = 0;
+    wheel.advance(51, [&](int) { ++fired; });
+    EXPECT_EQ(fired, 1);
+}
+
+TEST(RateLimiterTest, TokenBucketAllowsBurstThenRate) {
+    TokenBucket bucket(10, 5); // one token per 100 ms, five at once
+    int64_t now = 1000000;
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ(bucket.take(now), 0);
+    }
+    // Empty: the next token is 100 ms away.
+    EXPECT_EQ(bucket.take(now), 100000);
+    EXPECT_EQ(bucket.take(now + 60000), 40000);
+    EXPECT_EQ(bucket.take(now + 100000), 0);
+    EXPECT_GT(bucket.take(now + 100000), 0);
+    EXPECT_FALSE(bucket.full(now + 100000));
+    EXPECT_TRUE(bucket.full(now + 600000));
+}
+
+TEST(RateLimiterTest, SharesBucketsByKey) {
+    RateLimiter limiter(10, 2);
+    auto a = limiter.bucket("alice", 0);
+    auto b = limiter.bucket("alice", 0);
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, limiter.bucket("bob", 0));
+    EXPECT_EQ(a->take(0), 0);
+    EXPECT_EQ(b->take(0), 0);
+    EXPECT_GT(a->take(0), 0);
+
+    RateLimiter disabled(0, 10);
+    EXPECT_FALSE(disabled.enabled());
+    EXPECT_EQ(disabled.bucket("alice", 0), nullptr);
+}
+
+TEST(PresenceCoalescerTest, OneFramePerRoomPerFlush) {
+    PresenceCoalescer coalescer(1000);
+    coalescer.presence("lobby", "alice", true);
+    coalescer.presence("lobby", "bob", true);
+    for (int i = 0; i < 50; ++i) {
+        coalescer.typing("lobby", i % 2 ? "alice" : "bob", true, 100);
+    }
+    coalescer.typing("other", "carol", true, 100);
+    // Joined and left within the window: nothing to report.
+    coalescer.presence("quiet", "dave", true);
+    coalescer.presence("quiet", "dave", false);
+
+    auto frames = coalescer.flush(150);
+    ASSERT_EQ(frames.size(), 2u);
+    std::sort(frames.begin(), frames.end());
+    auto lobby = nlohmann::json::parse(frames[0].second);
+    EXPECT_EQ(frames[0].first, "lobby");
+    EXPECT_EQ(lobby["type"], "presence");
+    EXPECT_EQ(lobby["online"], nlohmann::json({"alice", "bob"}));
+    EXPECT_EQ(lobby["typing"].size(), 2u);
+    EXPECT_EQ(frames[1].first, "other");
+
+    // Refreshing an indicator is not news; it lapses after the timeout.
+    coalescer.typing("lobby", "alice", true, 500);
+    EXPECT_TRUE(coalescer.flush(600).empty());
+    frames = coalescer.flush(1200);
+    ASSERT_EQ(frames.size(), 2u);
+    std::sort(frames.begin(), frames.end());
+    EXPECT_EQ(nlohmann::json::parse(frames[0].second)["typing"], nlohmann::json({"alice"}));
+    EXPECT_TRUE(nlohmann::json::parse(frames[1].second)["typing"].empty());
+    EXPECT_EQ(coalescer.frames(), 4u);
+}
+
+TEST(DedupIndexTest, ExpiresAndCapsPerUser) {
+    DedupIndex index(1000, 3);
+    index.insert("alice", "a", 11, 0);
+    index.insert("bob", "a", 21, 0);
+    EXPECT_EQ(index.find("alice", "a", 500), 11);
+    EXPECT_EQ(index.find("bob", "a", 500), 21);
+    EXPECT_EQ(index.find("alice", "b", 500), 0);
+
+    // Past the per-user cap the oldest id goes first.
+    index.insert("alice", "b", 12, 100);
+    index.insert("alice", "c", 13, 200);
+    index.insert("alice", "d", 14, 300);
+    EXPECT_EQ(index.find("alice", "a", 400), 0);
+    EXPECT_EQ(index.find("alice", "d", 400), 14);
+    EXPECT_EQ(index.size(), 4u);
+
+    // Ids lapse after the window and are dropped on the user's next insert.
+    EXPECT_EQ(index.find("alice", "b", 1100), 0);
+    EXPECT_EQ(index.find("alice", "d", 1100), 14);
+    index.insert("alice", "e", 15, 1250);
+    EXPECT_EQ(index.find("alice", "d", 1250), 14);
+    EXPECT_EQ(index.find("alice", "e", 1250), 15);
+    EXPECT_LE(index.size(), 3u);
+}
+
+TEST(TracerTest, WritesChromeTraceEvents) {
+    Tracer &tracer = Tracer::global();
+    tracer.enable(1024);
+    uint64_t id = tracer.next_id();
+    {
+        TraceContext context(id);
+        TraceSpan span("parse");
+        tracer.record("receive", TraceContext::current(), Tracer::now_ns());
+    }
+    // Untraced work records nothing.
+    { TraceSpan span("persist"); }
+    // A thread's ring keeps only its latest events.
+    std::thread([&tracer]() {
+        TraceContext context(tracer.next_id());
+        for (int i = 0; i < 1500; ++i) {
+            TraceSpan span("write");
+        }
+    }).join();
+    tracer.enable(0);
+    { TraceContext context(id); TraceSpan span("queued"); }
+
+    std::stringstream out;
+    tracer.write_json(out);
+    auto trace = nlohmann::json::parse(out.str());
+    int parses = 0, receives = 0, writes = 0, others = 0;
+    for (const auto &event : trace["traceEvents"]) {
+        if (event["ph"] == "M") {
+            continue;
+        }
+        std::string name = event["name"];
+        if (name == "parse") {
+            ++parses;
+            EXPECT_EQ(event["ph"], "X");
+            EXPECT_GE(event["dur"].get<double>(), 0.0);
+            EXPECT_EQ(event["args"]["msg"], id);
+        } else if (name == "receive") {
+            ++receives;
+            EXPECT_EQ(event["ph"], "i");
+        } else if (name == "write") {
+            ++writes;
+        } else {
+            ++others;
+        }
+    }
+    EXPECT_EQ(parses, 1);
+    EXPECT_EQ(receives, 1);
+    // A full ring gives up its oldest slot, which a writer may be refilling.
+    EXPECT_EQ(writes, 1023);
+    EXPECT_EQ(others, 0);
+    EXPECT_EQ(tracer.recorded(), 1502u);
+}
+
+TEST(RoomCacheTest, MergesAppendsDuringLoadAndKeepsBudget) {
+    auto frame = [](const std::string &text) { return std::make_shared<const std::string>(text); };
+    RoomCache cache(4096);
+    std::vector<RoomCache::Frame> frames;
+    EXPECT_FALSE(cache.tracks("lobby"));
+    EXPECT_FALSE(cache.snapshot("lobby", frames));
+
+    // Stores racing the read: seq 3 made it into the read, 4 did not.
+    ASSERT_TRUE(cache.begin_load("lobby", 0));
+    EXPECT_FALSE(cache.begin_load("lobby", 0));
+    EXPECT_TRUE(cache.tracks("lobby"));
+    cache.append("lobby", 4, frame("m4"));
+    cache.append("lobby", 3, frame("m3"));
+    EXPECT_FALSE(cache.snapshot("lobby", frames));
+    ASSERT_TRUE(cache.finish_load("lobby", 0, {{1, frame("m1")}, {2, frame("m2")}, {3, frame("m3")}}));
+    cache.append("lobby", 6, frame("m6"));
+    cache.append("lobby", 5, frame("m5"));
+    ASSERT_TRUE(cache.snapshot("lobby", frames));
+    std::vector<std::string> texts;
+    for (const auto &f : frames) {
+        texts.push_back(*f);
+    }
+    EXPECT_EQ(texts, std::vector<std::string>({"m1", "m2", "m3", "m4", "m5", "m6"}));
+    EXPECT_EQ(cache.rooms(), 1u);
+
+    // A room that doesn't fit is dropped; growth evicts the least recently joined.
+    ASSERT_TRUE(cache.begin_load("huge", 0));
+    EXPECT_FALSE(cache.finish_load("huge", 0, {{1, frame(std::string(8192, 'x'))}}));
+    EXPECT_FALSE(cache.tracks("huge"));
+    ASSERT_TRUE(cache.begin_load("other", 0));
+    ASSERT_TRUE(cache.finish_load("other", 0, {{7, frame("o7")}}));
+    frames.clear();
+    ASSERT_TRUE(cache.snapshot("other", frames));
+    cache.append("other", 8, frame(std::string(3500, 'y')));
+    EXPECT_FALSE(cache.tracks("lobby"));
+    EXPECT_TRUE(cache.tracks("other"));
+    EXPECT_LE(cache.bytes(), 4096u);
+}
+
+TEST(RoomCacheTest, ClearCancelsLoadsInFlight) {
+    auto frame = [](const std::string &text) { return std::make_shared<const std::string>(text); };
+    RoomCache cache(4096);
+    uint64_t stale = cache.generation();
+    ASSERT_TRUE(cache.begin_load("lobby", stale));
+
+    // A clear mid-read: the old load can't install, nor claim more rooms.
+    uint64_t current = cache.clear();
+    EXPECT_NE(current, stale);
+    EXPECT_FALSE(cache.begin_load("annex", stale));
+    ASSERT_TRUE(cache.begin_load("lobby", current));
+    EXPECT_FALSE(cache.finish_load("lobby", stale, {{1, frame("archived")}}));
+    EXPECT_TRUE(cache.tracks("lobby"));
+
+    ASSERT_TRUE(cache.finish_load("lobby", current, {{2, frame("kept")}}));
+    std::vector<RoomCache::Frame> frames;
+    ASSERT_TRUE(cache.snapshot("lobby", frames));
+    ASSERT_EQ(frames.size(), 1u);
+    EXPECT_EQ(*frames[0], "kept");
+}
+
+TEST(RoomCacheTest, CapsRoomsAndInvalidatesOne) {
+    auto frame = [](const std::string &text) { return std::make_shared<const std::string>(text); };
+    RoomCache cache(4096, 2);
+    std::vector<RoomCache::Frame> frames;
+
+    // Only the newest two frames are kept, through the load and after it.
+    ASSERT_TRUE(cache.begin_load("lobby", 0));
+    ASSERT_TRUE(cache.finish_load("lobby", 0, {{1, frame("m1")}, {2, frame("m2")}, {3, frame("m3")}}));
+    cache.append("lobby", 4, frame("m4"));
+    ASSERT_TRUE(cache.snapshot("lobby", frames));
+    ASSERT_EQ(frames.size(), 2u);
+    EXPECT_EQ(*frames[0], "m3");
+    EXPECT_EQ(*frames[1], "m4");
+    ASSERT_TRUE(cache.begin_load("annex", 0));
+    ASSERT_TRUE(cache.finish_load("annex", 0, {{5, frame("a5")}}));
+    std::size_t bytes = cache.bytes();
+
+    // Invalidating one room leaves the others, and lets it be loaded again.
+    EXPECT_TRUE(cache.invalidate("lobby"));
+    EXPECT_FALSE(cache.tracks("lobby"));
+    EXPECT_TRUE(cache.tracks("annex"));
+    EXPECT_LT(cache.bytes(), bytes);
+    EXPECT_FALSE(cache.invalidate("lobby"));
+    ASSERT_TRUE(cache.begin_load("lobby", 0));
+
+    // A load in flight is not installed, so nothing read before is served.
+    EXPECT_FALSE(cache.invalidate("lobby"));
+    EXPECT_FALSE(cache.finish_load("lobby", 0, {{3, frame("m3")}, {4, frame("m4")}}));
+    EXPECT_FALSE(cache.tracks("lobby"));
+    EXPECT_EQ(cache.rooms(), 1u);
+}
+
+TEST(BackplaneTest, InProcessDeliversToOtherSubscribers) {
+    InProcessBus bus;
+    InProcessBackplane a(bus), b(bus), c(bus);
+    std::vector<std::string> gotA, gotB, gotC;
+    a.start([&gotA](const std::string &room, const std::string &payload) { gotA.push_back(room + ":" + payload); });
+    b.start([&gotB](const std::string &room, const std::string &payload) { gotB.push_back(room + ":" + payload); });
+    c.start([&gotC](const std::string &room, const std::string &payload) { gotC.push_back(room + ":" + payload); });
+
+    a.subscribe("lobby");
+    b.subscribe("lobby");
+    c.subscribe("other");
+    a.publish("lobby", "hello");
+    EXPECT_TRUE(gotA.empty());
+    ASSERT_EQ(gotB.size(), 1u);
+    EXPECT_EQ(gotB[0], "lobby:hello");
+    EXPECT_TRUE(gotC.empty());
+
+    b.unsubscribe("lobby");
+    a.publish("lobby", "again");
+    EXPECT_EQ(gotB.size(), 1u);
+}
+
+TEST(BackplaneTest, BrokerRelaysBatchedFrames) {
+    const std::string address = "unix:backplane_test.sock";
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    Broker broker(io, address);
+    ASSERT_TRUE(broker.start());
+    BrokerBackplane a(io, address, 50), b(io, address, 50);
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::string> received;
+    int echoed = 0;
+    a.start([&](const std::string &, const std::string &) { ++echoed; });
+    b.start([&](const std::string &room, const std::string &payload) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (room == "lobby") {
+            received.push_back(payload);
+        }
+        changed.notify_all();
+    });
+    a.subscribe("lobby");
+    b.subscribe("lobby");
+    std::thread ioThread([&io]() { io.run(); });
+
+    // Subscriptions travel on their own connections; probe until b's is live.
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (int attempt = 0; attempt < 100 && received.empty(); ++attempt) {
+            lock.unlock();
+            a.publish("lobby", "probe");
+            lock.lock();
+            changed.wait_for(lock, std::chrono::milliseconds(50), [&received]() { return !received.empty(); });
+        }
+        ASSERT_FALSE(received.empty());
+    }
+
+    const int numMessages = 1000;
+    for (int i = 0; i < numMessages; ++i) {
+        a.publish("lobby", std::to_string(i));
+    }
+    std::vector<std::string> numbered;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait_for(lock, std::chrono::seconds(10), [&received, numMessages]() {
+            return !received.empty() && received.back() == std::to_string(numMessages - 1);
+        });
+        for (const auto &payload : received) {
+            if (payload != "probe") {
+                numbered.push_back(payload);
+            }
+        }
+    }
+    ASSERT_EQ(numbered.size(), static_cast<std::size_t>(numMessages));
+    for (int i = 0; i < numMessages; ++i) {
+        EXPECT_EQ(numbered[i], std::to_string(i));
+    }
+    EXPECT_LT(a.batches_sent(), a.frames_sent());
+
+    a.stop();
+    b.stop();
+    broker.stop();
+    work.reset();
+    ioThread.join();
+    EXPECT_EQ(echoed, 0);
+    std::remove("backplane_test.sock");
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();